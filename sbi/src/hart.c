@@ -72,6 +72,19 @@ bool hart_stop(unsigned int hart) {
     return false;
 }
 
+bool hart_send_ipi(unsigned int hart) {
+    if (hart >= MAX_ALLOWABLE_HARTS) {
+        return false;
+    }
+    mutex_spinlock(sbi_hart_lock + hart);
+    bool ret = sbi_hart_data[hart].status == HS_STARTED;
+    if (ret) {
+        clint_set_msip(hart);
+    }
+    mutex_unlock(sbi_hart_lock + hart);
+    return ret;
+}
+
 void hart_handle_msip(unsigned int hart) {
     // We need a mutex since this can be set asynchronously from us.
     mutex_spinlock(sbi_hart_lock + hart);
@@ -90,6 +103,12 @@ void hart_handle_msip(unsigned int hart) {
         CSR_WRITE("satp", sbi_hart_data[hart].satp);
         sbi_hart_data[hart].status = HS_STARTED;
     }
+    else if (sbi_hart_data[hart].status == HS_STARTED) {
+        // Anything else is an IPI from the OS, which handles it as an SSIP.
+        unsigned long mip;
+        CSR_READ(mip, "mip");
+        CSR_WRITE("mip", mip | MIP_SSIP);
+    }
 
     mutex_unlock(sbi_hart_lock + hart);
     MRET();
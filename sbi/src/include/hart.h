@@ -80,6 +80,15 @@ bool hart_start(unsigned int hart, unsigned long target, unsigned long scratch,
  */
 bool hart_stop(unsigned int hart);
 
+/**
+ * @brief Send an MSIP to a STARTED HART, which hands it to the OS as an SSIP.
+ * 
+ * @param hart - The HART to interrupt.
+ * @return true - the MSIP was sent.
+ * @return false - the HART is not started.
+ */
+bool hart_send_ipi(unsigned int hart);
+
 /**
  * @brief When MSIPs occur in ctrap.c, they are fowarded here.
  * 
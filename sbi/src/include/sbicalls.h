@@ -26,3 +26,5 @@
 #define SBI_SVCALL_WHOAMI       (11)
 
 #define SBI_SVCALL_POWEROFF     (12)
+
+#define SBI_SVCALL_SEND_IPI     (13)
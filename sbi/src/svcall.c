@@ -34,6 +34,9 @@ void svcall_handle(int hart)
         case SBI_SVCALL_HART_STOP:
             mscratch[XREG_A0] = hart_stop(hart);
             break;
+        case SBI_SVCALL_SEND_IPI:
+            mscratch[XREG_A0] = hart_send_ipi(mscratch[XREG_A0]);
+            break;
         case SBI_SVCALL_GET_TIME:
             mscratch[XREG_A0] = clint_get_time();
             break;
@@ -0,0 +1,300 @@
+/*
+*   Buffer cache for filesystem blocks
+*/
+#include <bcache.h>
+#include <block.h>
+#include <config.h>
+#include <debug.h>
+#include <kmalloc.h>
+#include <lock.h>
+#include <util.h>
+
+// #define BCACHE_DEBUG
+
+#ifdef BCACHE_DEBUG
+#define debugf(...) debugf(__VA_ARGS__)
+#else
+#define debugf(...)
+#endif
+
+typedef struct Buffer {
+    VirtioDevice *dev;
+    uint64_t block;
+    uint16_t block_size;
+    // How many bytes `data` can hold
+    uint16_t capacity;
+    bool valid;
+    bool dirty;
+    uint8_t *data;
+
+    // Chain of buffers in the same hash bucket
+    struct Buffer *hash_next;
+    // Least recently used order, most recent at the head
+    struct Buffer *lru_prev, *lru_next;
+} Buffer;
+
+static Buffer buffers[BCACHE_NUM_BUFFERS];
+static Buffer *hash_table[BCACHE_HASH_BUCKETS];
+static Buffer *lru_head, *lru_tail;
+static Mutex bcache_lock = MUTEX_UNLOCKED;
+static bool is_init = false;
+
+static uint64_t bcache_hash(VirtioDevice *dev, uint64_t block) {
+    return (((uint64_t)dev >> 4) ^ (block * 0x9E3779B97F4A7C15ULL)) % BCACHE_HASH_BUCKETS;
+}
+
+static void lru_unlink(Buffer *b) {
+    if (b->lru_prev) b->lru_prev->lru_next = b->lru_next;
+    else lru_head = b->lru_next;
+    if (b->lru_next) b->lru_next->lru_prev = b->lru_prev;
+    else lru_tail = b->lru_prev;
+    b->lru_prev = b->lru_next = NULL;
+}
+
+static void lru_push_front(Buffer *b) {
+    b->lru_prev = NULL;
+    b->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = b;
+    lru_head = b;
+    if (lru_tail == NULL) lru_tail = b;
+}
+
+static void lru_push_back(Buffer *b) {
+    b->lru_next = NULL;
+    b->lru_prev = lru_tail;
+    if (lru_tail) lru_tail->lru_next = b;
+    lru_tail = b;
+    if (lru_head == NULL) lru_head = b;
+}
+
+static void hash_remove(Buffer *b) {
+    Buffer **link = &hash_table[bcache_hash(b->dev, b->block)];
+    while (*link != NULL) {
+        if (*link == b) {
+            *link = b->hash_next;
+            break;
+        }
+        link = &(*link)->hash_next;
+    }
+    b->hash_next = NULL;
+}
+
+static void hash_insert(Buffer *b) {
+    uint64_t bucket = bcache_hash(b->dev, b->block);
+    b->hash_next = hash_table[bucket];
+    hash_table[bucket] = b;
+}
+
+static Buffer *hash_find(VirtioDevice *dev, uint64_t block) {
+    for (Buffer *b = hash_table[bcache_hash(dev, block)]; b != NULL; b = b->hash_next) {
+        if (b->dev == dev && b->block == block) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+static uint64_t bcache_first_sector(Buffer *b) {
+    return b->block * b->block_size / block_device_get_sector_size(b->dev);
+}
+
+static uint64_t bcache_num_sectors(Buffer *b) {
+    return b->block_size / block_device_get_sector_size(b->dev);
+}
+
+static void bcache_writeback(Buffer *b) {
+    if (!b->valid || !b->dirty) {
+        return;
+    }
+    debugf("bcache_writeback: Writing block %u of %s\n", b->block, b->dev->name);
+    // Leave the block dirty if the write failed so a later sync tries again
+    if (block_device_write_sectors(b->dev, bcache_first_sector(b), b->data, bcache_num_sectors(b)) == VIRTIO_BLK_S_OK) {
+        b->dirty = false;
+    }
+}
+
+void bcache_init(void) {
+    if (is_init) {
+        return;
+    }
+    memset(buffers, 0, sizeof(buffers));
+    memset(hash_table, 0, sizeof(hash_table));
+    lru_head = lru_tail = NULL;
+    for (uint32_t i=0; i<BCACHE_NUM_BUFFERS; i++) {
+        lru_push_back(&buffers[i]);
+    }
+    is_init = true;
+    debugf("bcache_init: %u buffers in %u buckets\n", BCACHE_NUM_BUFFERS, BCACHE_HASH_BUCKETS);
+}
+
+// Find the buffer for a block, recycling the least recently used buffer on a miss.
+// If `fill` is false, the caller is about to overwrite the whole block, so it is
+// not read from the disk. Returns NULL if the block could not be read, in which
+// case nothing is cached for it. Must be called with the lock held.
+static Buffer *bcache_get(VirtioDevice *dev, uint64_t block, uint16_t block_size, bool fill) {
+    Buffer *b = hash_find(dev, block);
+    if (b != NULL && b->block_size == block_size) {
+        lru_unlink(b);
+        lru_push_front(b);
+        return b;
+    } else if (b != NULL) {
+        // The filesystem was remounted with a different block size
+        bcache_writeback(b);
+        hash_remove(b);
+        b->valid = false;
+    }
+
+    // Recycle the least recently used buffer
+    b = lru_tail;
+    if (b->valid) {
+        debugf("bcache_get: Evicting block %u of %s\n", b->block, b->dev->name);
+        bcache_writeback(b);
+        hash_remove(b);
+        b->valid = false;
+    }
+    if (b->capacity < block_size) {
+        if (b->data != NULL) {
+            kfree(b->data);
+        }
+        b->data = (uint8_t *)kmalloc(block_size);
+        if (b->data == NULL) {
+            fatalf("bcache_get: Could not allocate a %u byte buffer\n", block_size);
+        }
+        b->capacity = block_size;
+    }
+
+    b->dev = dev;
+    b->block = block;
+    b->block_size = block_size;
+    b->dirty = false;
+    if (fill && block_device_read_sectors(dev, bcache_first_sector(b), b->data, bcache_num_sectors(b)) != VIRTIO_BLK_S_OK) {
+        // Reuse this buffer first rather than caching what the device gave us
+        lru_unlink(b);
+        lru_push_back(b);
+        return NULL;
+    }
+    b->valid = true;
+    hash_insert(b);
+    lru_unlink(b);
+    lru_push_front(b);
+    return b;
+}
+
+bool bcache_read(VirtioDevice *dev, uint64_t block, uint16_t block_size, uint32_t offset, void *data, uint32_t count) {
+    if (offset + count > block_size) {
+        warnf("bcache_read: Read of %u bytes at %u overflows block %u\n", count, offset, block);
+        return false;
+    }
+    mutex_spinlock(&bcache_lock);
+    bcache_init();
+    Buffer *b = bcache_get(dev, block, block_size, true);
+    if (b == NULL) {
+        mutex_unlock(&bcache_lock);
+        warnf("bcache_read: Could not read block %u of %s\n", block, dev->name);
+        memset(data, 0, count);
+        return false;
+    }
+    memcpy(data, b->data + offset, count);
+    mutex_unlock(&bcache_lock);
+    return true;
+}
+
+bool bcache_write(VirtioDevice *dev, uint64_t block, uint16_t block_size, uint32_t offset, const void *data, uint32_t count) {
+    if (offset + count > block_size) {
+        warnf("bcache_write: Write of %u bytes at %u overflows block %u\n", count, offset, block);
+        return false;
+    }
+    mutex_spinlock(&bcache_lock);
+    bcache_init();
+    // A partial write needs the rest of the block from the disk
+    Buffer *b = bcache_get(dev, block, block_size, offset != 0 || count != block_size);
+    if (b == NULL) {
+        mutex_unlock(&bcache_lock);
+        warnf("bcache_write: Could not read block %u of %s\n", block, dev->name);
+        return false;
+    }
+    memcpy(b->data + offset, data, count);
+    b->dirty = true;
+    mutex_unlock(&bcache_lock);
+    return true;
+}
+
+bool bcache_prefetch(VirtioDevice *dev, uint64_t block, uint32_t count, uint16_t block_size) {
+    uint64_t sector_size = block_device_get_sector_size(dev);
+    // Never read more in one go than the cache can hold without evicting the run itself
+    uint32_t max_run = BCACHE_MAX_RUN_BYTES / block_size;
+    if (max_run > BCACHE_NUM_BUFFERS / 2) {
+        max_run = BCACHE_NUM_BUFFERS / 2;
+    } else if (max_run == 0) {
+        max_run = 1;
+    }
+
+    mutex_spinlock(&bcache_lock);
+    bcache_init();
+    bool ok = true;
+    uint32_t i = 0;
+    while (i < count) {
+        Buffer *b = hash_find(dev, block + i);
+        if (b != NULL && b->block_size == block_size) {
+            // Already cached (and maybe dirty), so the disk copy must not replace it
+            i++;
+            continue;
+        }
+        // Gather the following blocks that are also missing
+        uint32_t length = 1;
+        while (i + length < count && length < max_run) {
+            b = hash_find(dev, block + i + length);
+            if (b != NULL && b->block_size == block_size) {
+                break;
+            }
+            length++;
+        }
+
+        uint8_t *run = (uint8_t *)kmalloc(length * block_size);
+        if (run == NULL) {
+            // Not worth failing over, the blocks are read one at a time on demand
+            break;
+        }
+        debugf("bcache_prefetch: Reading %u blocks at %u of %s\n", length, block + i, dev->name);
+        if (block_device_read_sectors(dev, (block + i) * block_size / sector_size, run, length * block_size / sector_size) != VIRTIO_BLK_S_OK) {
+            // Cache none of the run; bcache_read retries each block on demand
+            kfree(run);
+            ok = false;
+            break;
+        }
+        for (uint32_t j=0; j<length; j++) {
+            b = bcache_get(dev, block + i + j, block_size, false);
+            memcpy(b->data, run + j * block_size, block_size);
+        }
+        kfree(run);
+        i += length;
+    }
+    mutex_unlock(&bcache_lock);
+    return ok;
+}
+
+void bcache_sync(VirtioDevice *dev) {
+    mutex_spinlock(&bcache_lock);
+    bcache_init();
+    for (uint32_t i=0; i<BCACHE_NUM_BUFFERS; i++) {
+        if (dev == NULL || buffers[i].dev == dev) {
+            bcache_writeback(&buffers[i]);
+        }
+    }
+    mutex_unlock(&bcache_lock);
+}
+
+void bcache_invalidate(VirtioDevice *dev, uint64_t block) {
+    mutex_spinlock(&bcache_lock);
+    bcache_init();
+    Buffer *b = hash_find(dev, block);
+    if (b != NULL) {
+        hash_remove(b);
+        b->valid = false;
+        b->dirty = false;
+        // Reuse this buffer first
+        lru_unlink(b);
+        lru_push_back(b);
+    }
+    mutex_unlock(&bcache_lock);
+}
@@ -11,6 +11,11 @@
 #include <csr.h>
 #include <block.h>
 #include <util.h>
+#include <plic.h>
+#include <sbi.h>
+#include <sched.h>
+#include <lock.h>
+#include <tlb.h>
 
 // #define BLOCK_DEVICE_DEBUG
 
@@ -30,7 +35,7 @@ void block_device_init() {
     // device_active_jobs = vector_new();
     // block_device = virtio_get_block_device();
     block_device_mutex = MUTEX_UNLOCKED;
-    for (uint16_t n; n < 8; n++) {
+    for (uint16_t n = 0; n < 8; n++) {
         // debugf("BAR %d: %x\n", n, pci_get_bar(block_device->pcidev, n));
         VirtioDevice *block_device = virtio_get_block_device(n);
         if (block_device == NULL) {
@@ -71,110 +76,179 @@ void block_device_handle_job(VirtioDevice *block_device, Job *job) {
     debugf("Handling block device job %u\n", job->job_id);
     BlockRequestPacket *packet = (BlockRequestPacket *)job->data;
     debugf("Packet status in handle: %x\n", packet->status);
-    
+
+    // The device has already written the status byte by the time the
+    // interrupt arrives, so all that is left is to wake up the waiter.
+    if (job->pid_id != BLOCK_NO_WAITER && process_map_contains(job->pid_id)) {
+        Process *waiter = process_map_get(job->pid_id);
+        if (waiter->state == PS_WAITING) {
+            debugf("Waking process %u after block request\n", job->pid_id);
+            waiter->state = PS_RUNNING;
+        }
+    }
+
     job->data = NULL;
 }
 
-void block_device_send_request(VirtioDevice *block_device, BlockRequestPacket *packet) {
-    debugf("Sending block request\n");
-    // mutex_spinlock(&block_device_mutex);
+bool block_device_send_request_async(VirtioDevice *block_device, BlockRequestPacket *packet, uint16_t waiter) {
     request_count++;
 
     debugf("Sending block request #%u\n", request_count);
     // First descriptor is the header
-    packet->status = 0xf;
+    packet->status = BLOCK_STATUS_PENDING;
 
     VirtioDescriptor header;
-    header.addr = kernel_mmu_translate((uint64_t)packet);
+    header.addr = kernel_mmu_translate_fast((uint64_t)packet);
     header.flags = VIRTQ_DESC_F_NEXT;
     header.len = sizeof(uint32_t) + sizeof(uint32_t) + sizeof(uint64_t);
 
     // Second descriptor is the data
     VirtioDescriptor data;
-    data.addr = kernel_mmu_translate((uint64_t)packet->data);
+    data.addr = kernel_mmu_translate_fast((uint64_t)packet->data);
+    data.flags = VIRTQ_DESC_F_NEXT;
     if (packet->type == VIRTIO_BLK_T_IN)
-        data.flags = VIRTQ_DESC_F_WRITE;
-    data.flags |= VIRTQ_DESC_F_NEXT;
+        data.flags |= VIRTQ_DESC_F_WRITE;
     data.len = packet->sector_count * 512;
 
     // The third descriptor is the status
     VirtioDescriptor status;
-    status.addr = kernel_mmu_translate((uint64_t)&packet->status);
+    status.addr = kernel_mmu_translate_fast((uint64_t)&packet->status);
     status.flags = VIRTQ_DESC_F_WRITE;
     status.len = sizeof(packet->status);
 
-    VirtioDescriptor chain[3];
+    VirtioDescriptor chain[BLOCK_REQUEST_DESCRIPTORS];
     chain[0] = header;
     chain[1] = data;
     chain[2] = status;
 
-    // IRQ_OFF();
-    debugf("Sending block device request #%u\n", request_count);
-    virtio_create_job_with_data(block_device, 1, block_device_handle_job, packet);
-    virtio_send_descriptor_chain(block_device, 0, chain, 3, true);
-    // mutex_unlock(&block_device_mutex);
-
-    // WFI();
-    // IRQ_ON();
-    while (packet->status == 0xf) {
-        infof("Waiting for block device request #%u\n", request_count);
-        // debugf("Waiting for block device request #%u\n", request_count);
-        // WFI();
+    bool sent = virtio_send_job(block_device, 0, chain, BLOCK_REQUEST_DESCRIPTORS, waiter, block_device_handle_job, packet);
+
+    if (!sent) {
+        // Nothing was submitted, so the caller can send the same packet again
+        debugf("Block device request #%u: queue is full\n", request_count);
+        packet->status = BLOCK_STATUS_RETRY;
+    }
+    return sent;
+}
+
+static bool block_device_request_done(void *arg) {
+    return ((volatile BlockRequestPacket *)arg)->status != BLOCK_STATUS_PENDING;
+}
+
+static bool block_device_queue_has_room(void *arg) {
+    return virtio_has_free_descriptors((VirtioDevice *)arg, BLOCK_REQUEST_DESCRIPTORS);
+}
+
+// Sleep the hart until `done` holds, which only changes when the device interrupts.
+// The trap handler runs with interrupts globally disabled, so we only unmask
+// external interrupts for the WFI and then service the PLIC ourselves.
+// Syscalls have no stack of their own to switch away from, so this hart does
+// nothing else until the device answers. The other harts keep going, and an
+// idle one can steal the processes queued behind the waiter (see src/sched.c).
+static void block_device_wait(bool (*done)(void *), void *arg) {
+    int hart = hart_id();
+    uint64_t sie, sstatus;
+    CSR_READ(sie, "sie");
+    CSR_WRITE("sie", sie | SIE_SEIE);
+
+    // The other harts can run syscalls and page faults until the device
+    // answers. Callers in the filesystem still hold the filesystem lock.
+    bool relock = kernel_lock_drop(hart);
+    while (!done(arg)) {
+        WFI();
+        CSR_READ(sstatus, "sstatus");
+        if (!(sstatus & SSTATUS_SIE)) {
+            plic_handle_irq(hart);
+        }
+        // Now that other harts are running, they may unmap pages we cached
+        tlb_handle_ipi(hart);
+    }
+    if (relock) {
+        kernel_lock(hart);
+    }
+
+    CSR_WRITE("sie", sie);
+}
+
+void block_device_wait_request(BlockRequestPacket *packet) {
+    block_device_wait(block_device_request_done, packet);
+}
+
+uint8_t block_device_send_request(VirtioDevice *block_device, BlockRequestPacket *packet) {
+    debugf("Sending block request\n");
+    // If a process asked for this, park it until the device interrupts us.
+    Process *current = sched_get_current();
+    uint16_t waiter = BLOCK_NO_WAITER;
+    if (current != NULL && current != sched_get_idle_process() && current->state == PS_RUNNING) {
+        waiter = current->pid;
+        current->state = PS_WAITING;
+    }
+
+    // A full queue drains as the device completes requests, so wait for
+    // descriptors to come back just like we wait for our own completion.
+    while (!block_device_send_request_async(block_device, packet, waiter)) {
+        block_device_wait(block_device_queue_has_room, block_device);
+    }
+    block_device_wait_request(packet);
+
+    if (waiter != BLOCK_NO_WAITER) {
+        // In case the completion was reaped without going through our job
+        current->state = PS_RUNNING;
     }
 
     debugf("Packet status after sending request #%u: %x\n", request_count, packet->status);
-    // if (packet->status != 0) {
-    //     warnf("Block device request failed with status %x\n", packet->status);
-    // }
-    
+    if (packet->status != VIRTIO_BLK_S_OK) {
+        warnf("Block device request failed with status %x\n", packet->status);
+    }
+    return packet->status;
 }
 
-void block_device_read_sector(VirtioDevice *block_device, uint64_t sector, uint8_t *data) {
+uint8_t block_device_read_sector(VirtioDevice *block_device, uint64_t sector, uint8_t *data) {
     debugf("Reading sector %d\n", sector);
     BlockRequestPacket packet;
     packet.type = VIRTIO_BLK_T_IN;
     packet.sector = sector;
     packet.data = data;
     packet.sector_count = 1;
-    packet.status = 0xf;
+    packet.status = BLOCK_STATUS_PENDING;
 
-    block_device_send_request(block_device, &packet);
+    return block_device_send_request(block_device, &packet);
 }
 
-void block_device_write_sector(VirtioDevice *block_device, uint64_t sector, uint8_t *data) {
+uint8_t block_device_write_sector(VirtioDevice *block_device, uint64_t sector, uint8_t *data) {
     debugf("Writing sector %d\n", sector);
     BlockRequestPacket packet;
     packet.type = VIRTIO_BLK_T_OUT;
     packet.sector = sector;
     packet.data = data;
     packet.sector_count = 1;
-    packet.status = 0xf;
+    packet.status = BLOCK_STATUS_PENDING;
 
-    block_device_send_request(block_device, &packet);
+    return block_device_send_request(block_device, &packet);
 }
 
-void block_device_read_sectors(VirtioDevice *block_device, uint64_t sector, uint8_t *data, uint64_t count) {
+uint8_t block_device_read_sectors(VirtioDevice *block_device, uint64_t sector, uint8_t *data, uint64_t count) {
     debugf("Read sectors %d-%d\n", sector, sector + count);
     BlockRequestPacket packet;
     packet.type = VIRTIO_BLK_T_IN;
     packet.sector = sector;
     packet.data = data;
     packet.sector_count = count;
-    packet.status = 0xf;
+    packet.status = BLOCK_STATUS_PENDING;
 
-    block_device_send_request(block_device, &packet);
+    return block_device_send_request(block_device, &packet);
 }
 
-void block_device_write_sectors(VirtioDevice *block_device, uint64_t sector, uint8_t *data, uint64_t count) {
+uint8_t block_device_write_sectors(VirtioDevice *block_device, uint64_t sector, uint8_t *data, uint64_t count) {
     debugf("Writing sectors %d-%d\n", sector, sector + count);
     BlockRequestPacket packet;
     packet.type = VIRTIO_BLK_T_OUT;
     packet.sector = sector;
     packet.data = data;
     packet.sector_count = count;
-    packet.status = 0xf;
+    packet.status = BLOCK_STATUS_PENDING;
 
-    block_device_send_request(block_device, &packet);
+    return block_device_send_request(block_device, &packet);
 }
 
 
@@ -0,0 +1,330 @@
+/*
+*   Completely fair scheduler run queue
+*/
+#include <cfs.h>
+#include <process.h>
+#include <stddef.h>
+
+#define node_process(n) ((struct Process *)((char *)(n) - offsetof(struct Process, sched_node)))
+
+// The weight of each nice level from NICE_MIN to NICE_MAX. Each level is
+// about 1.25 times the next, so one nice step is about a 10% share of the CPU.
+static const uint32_t nice_weights[NICE_MAX - NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548,  7620,  6100,  4904,  3906,
+    3121,  2501,  1991,  1586,  1277,
+    1024,  820,   655,   526,   423,
+    335,   272,   215,   172,   137,
+    110,   87,    70,    56,    45,
+    36,    29,    23,    18,    15,
+};
+
+uint64_t cfs_weight(int nice) {
+    if (nice < NICE_MIN) {
+        nice = NICE_MIN;
+    } else if (nice > NICE_MAX) {
+        nice = NICE_MAX;
+    }
+    return nice_weights[nice - NICE_MIN];
+}
+
+uint64_t cfs_scale(uint64_t delta, int nice) {
+    uint64_t weight = cfs_weight(nice);
+    if (weight == NICE_0_WEIGHT) {
+        return delta;
+    }
+    return delta * NICE_0_WEIGHT / weight;
+}
+
+void cfs_init(CfsQueue *q) {
+    q->root = NULL;
+    q->leftmost = NULL;
+    q->nr_queued = 0;
+    q->min_vruntime = 0;
+}
+
+// Whether `a` runs before `b`
+static bool cfs_before(const struct Process *a, const struct Process *b) {
+    if (a->vruntime != b->vruntime) {
+        return a->vruntime < b->vruntime;
+    }
+    return a->pid < b->pid;
+}
+
+static void rotate_left(CfsQueue *q, CfsNode *x) {
+    CfsNode *y = x->right;
+    x->right = y->left;
+    if (y->left) {
+        y->left->parent = x;
+    }
+    y->parent = x->parent;
+    if (x->parent == NULL) {
+        q->root = y;
+    } else if (x == x->parent->left) {
+        x->parent->left = y;
+    } else {
+        x->parent->right = y;
+    }
+    y->left = x;
+    x->parent = y;
+}
+
+static void rotate_right(CfsQueue *q, CfsNode *x) {
+    CfsNode *y = x->left;
+    x->left = y->right;
+    if (y->right) {
+        y->right->parent = x;
+    }
+    y->parent = x->parent;
+    if (x->parent == NULL) {
+        q->root = y;
+    } else if (x == x->parent->right) {
+        x->parent->right = y;
+    } else {
+        x->parent->left = y;
+    }
+    y->right = x;
+    x->parent = y;
+}
+
+static void insert_fixup(CfsQueue *q, CfsNode *z) {
+    while (z->parent && z->parent->red) {
+        // A red node is never the root, so the grandparent is there
+        CfsNode *gp = z->parent->parent;
+        if (z->parent == gp->left) {
+            CfsNode *uncle = gp->right;
+            if (uncle && uncle->red) {
+                z->parent->red = false;
+                uncle->red = false;
+                gp->red = true;
+                z = gp;
+            } else {
+                if (z == z->parent->right) {
+                    z = z->parent;
+                    rotate_left(q, z);
+                }
+                z->parent->red = false;
+                gp->red = true;
+                rotate_right(q, gp);
+            }
+        } else {
+            CfsNode *uncle = gp->left;
+            if (uncle && uncle->red) {
+                z->parent->red = false;
+                uncle->red = false;
+                gp->red = true;
+                z = gp;
+            } else {
+                if (z == z->parent->left) {
+                    z = z->parent;
+                    rotate_right(q, z);
+                }
+                z->parent->red = false;
+                gp->red = true;
+                rotate_left(q, gp);
+            }
+        }
+    }
+    q->root->red = false;
+}
+
+// Put `v` where `u` was under u's parent
+static void transplant(CfsQueue *q, CfsNode *u, CfsNode *v) {
+    if (u->parent == NULL) {
+        q->root = v;
+    } else if (u == u->parent->left) {
+        u->parent->left = v;
+    } else {
+        u->parent->right = v;
+    }
+    if (v) {
+        v->parent = u->parent;
+    }
+}
+
+// `x` is short one black node, and may be NULL, so its parent is passed too
+static void erase_fixup(CfsQueue *q, CfsNode *x, CfsNode *parent) {
+    while (x != q->root && (x == NULL || !x->red)) {
+        if (x == parent->left) {
+            CfsNode *w = parent->right;
+            if (w->red) {
+                w->red = false;
+                parent->red = true;
+                rotate_left(q, parent);
+                w = parent->right;
+            }
+            if ((w->left == NULL || !w->left->red) && (w->right == NULL || !w->right->red)) {
+                w->red = true;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if (w->right == NULL || !w->right->red) {
+                    w->left->red = false;
+                    w->red = true;
+                    rotate_right(q, w);
+                    w = parent->right;
+                }
+                w->red = parent->red;
+                parent->red = false;
+                if (w->right) {
+                    w->right->red = false;
+                }
+                rotate_left(q, parent);
+                x = q->root;
+            }
+        } else {
+            CfsNode *w = parent->left;
+            if (w->red) {
+                w->red = false;
+                parent->red = true;
+                rotate_right(q, parent);
+                w = parent->left;
+            }
+            if ((w->left == NULL || !w->left->red) && (w->right == NULL || !w->right->red)) {
+                w->red = true;
+                x = parent;
+                parent = x->parent;
+            } else {
+                if (w->left == NULL || !w->left->red) {
+                    w->right->red = false;
+                    w->red = true;
+                    rotate_left(q, w);
+                    w = parent->left;
+                }
+                w->red = parent->red;
+                parent->red = false;
+                if (w->left) {
+                    w->left->red = false;
+                }
+                rotate_right(q, parent);
+                x = q->root;
+            }
+        }
+    }
+    if (x) {
+        x->red = false;
+    }
+}
+
+static CfsNode *node_next(const CfsNode *n) {
+    if (n->right) {
+        n = n->right;
+        while (n->left) {
+            n = n->left;
+        }
+        return (CfsNode *)n;
+    }
+    while (n->parent && n == n->parent->right) {
+        n = n->parent;
+    }
+    return n->parent;
+}
+
+void cfs_enqueue(CfsQueue *q, struct Process *p) {
+    CfsNode *node = &p->sched_node;
+    if (p->vruntime < q->min_vruntime) {
+        p->vruntime = q->min_vruntime;
+    }
+
+    CfsNode **link = &q->root;
+    CfsNode *parent = NULL;
+    bool leftmost = true;
+    while (*link) {
+        parent = *link;
+        if (cfs_before(p, node_process(parent))) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            leftmost = false;
+        }
+    }
+    node->parent = parent;
+    node->left = node->right = NULL;
+    node->red = true;
+    node->queue = q;
+    *link = node;
+    if (leftmost) {
+        q->leftmost = node;
+    }
+    insert_fixup(q, node);
+    q->nr_queued++;
+}
+
+void cfs_dequeue(CfsQueue *q, struct Process *p) {
+    CfsNode *z = &p->sched_node;
+    if (z->queue != q) {
+        return;
+    }
+    if (q->leftmost == z) {
+        q->leftmost = node_next(z);
+    }
+
+    CfsNode *x, *x_parent;
+    bool removed_red = z->red;
+    if (z->left == NULL) {
+        x = z->right;
+        x_parent = z->parent;
+        transplant(q, z, z->right);
+    } else if (z->right == NULL) {
+        x = z->left;
+        x_parent = z->parent;
+        transplant(q, z, z->left);
+    } else {
+        // Take z's place with its successor
+        CfsNode *y = z->right;
+        while (y->left) {
+            y = y->left;
+        }
+        removed_red = y->red;
+        x = y->right;
+        if (y->parent == z) {
+            x_parent = y;
+        } else {
+            x_parent = y->parent;
+            transplant(q, y, y->right);
+            y->right = z->right;
+            y->right->parent = y;
+        }
+        transplant(q, z, y);
+        y->left = z->left;
+        y->left->parent = y;
+        y->red = z->red;
+    }
+    if (!removed_red) {
+        erase_fixup(q, x, x_parent);
+    }
+
+    z->parent = z->left = z->right = NULL;
+    z->queue = NULL;
+    q->nr_queued--;
+}
+
+struct Process *cfs_first(const CfsQueue *q) {
+    return q->leftmost == NULL ? NULL : node_process(q->leftmost);
+}
+
+struct Process *cfs_last(const CfsQueue *q) {
+    CfsNode *n = q->root;
+    if (n == NULL) {
+        return NULL;
+    }
+    while (n->right) {
+        n = n->right;
+    }
+    return node_process(n);
+}
+
+struct Process *cfs_next(const struct Process *p) {
+    CfsNode *n = node_next(&p->sched_node);
+    return n == NULL ? NULL : node_process(n);
+}
+
+void cfs_update_min_vruntime(CfsQueue *q) {
+    if (q->leftmost != NULL) {
+        uint64_t lowest = node_process(q->leftmost)->vruntime;
+        if (lowest > q->min_vruntime) {
+            q->min_vruntime = lowest;
+        }
+    }
+}
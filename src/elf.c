@@ -734,7 +734,158 @@ bool elf_is_valid(const uint8_t *elf) {
     return true;
 }
 
-int elf_create_process(Process *p, const uint8_t *elf) {
+/*
+ * The image cache keeps the whole pages of the read-only segments (text and
+ * rodata) of recently run executables. Each cached page has the cache as one
+ * owner and every process mapping it as another (see page_ref), so a process
+ * that exits or is evicted from the cache never pulls a page from under the
+ * others. Partial pages at the end of a segment are always loaded privately,
+ * since whatever follows the segment in memory may be written to.
+ */
+typedef struct ElfSharedSegment {
+    uint64_t vaddr;
+    uint64_t num_pages;
+    void **pages;
+} ElfSharedSegment;
+
+typedef struct ElfImage {
+    ElfImageKey key;
+    bool valid;
+    uint64_t last_used;
+    ElfSharedSegment text;
+    ElfSharedSegment rodata;
+} ElfImage;
+
+static ElfImage elf_cache[ELF_CACHE_NUM_IMAGES];
+static uint64_t elf_cache_clock;
+static uint64_t elf_cache_gen;
+static Mutex elf_cache_lock = MUTEX_UNLOCKED;
+
+static void elf_segment_free(ElfSharedSegment *segment) {
+    for (uint64_t i = 0; i < segment->num_pages; i++) {
+        page_free(segment->pages[i]);
+    }
+    kfree(segment->pages);
+    segment->pages = NULL;
+    segment->num_pages = 0;
+}
+
+static void elf_image_evict(ElfImage *image) {
+    debugf("elf_image_evict: Dropping image of inode %u\n", image->key.inode);
+    elf_segment_free(&image->text);
+    elf_segment_free(&image->rodata);
+    image->valid = false;
+}
+
+// Copy the whole file pages of a segment into new pages. Returns false if memory is out.
+static bool elf_segment_load(ElfSharedSegment *segment, const uint8_t *elf, Elf64_Phdr header, bool valid) {
+    segment->vaddr = header.p_vaddr;
+    segment->num_pages = 0;
+    segment->pages = NULL;
+    // The segment has to start on a page, or its first page holds something else too
+    if (!valid || header.p_vaddr % PAGE_SIZE_4K != 0 || header.p_filesz < PAGE_SIZE_4K) {
+        return true;
+    }
+    uint64_t n = header.p_filesz / PAGE_SIZE_4K;
+    segment->pages = kmalloc(n * sizeof(void *));
+    if (segment->pages == NULL) {
+        return false;
+    }
+    for (; segment->num_pages < n; segment->num_pages++) {
+        void *page = page_alloc();
+        if (page == NULL) {
+            elf_segment_free(segment);
+            return false;
+        }
+        memcpy(page, elf + header.p_offset + segment->num_pages * PAGE_SIZE_4K, PAGE_SIZE_4K);
+        segment->pages[segment->num_pages] = page;
+    }
+    return true;
+}
+
+// Find the cached image for a file, loading it on a miss. Must be called with the lock held.
+static ElfImage *elf_cache_get(const ElfImageKey *key, const uint8_t *elf, Elf64_Phdr text, Elf64_Phdr rodata) {
+    if (key->generation != elf_cache_gen) {
+        // A file was written while this one was read, so `elf` may be stale
+        return NULL;
+    }
+    ElfImage *victim = &elf_cache[0];
+    for (int i = 0; i < ELF_CACHE_NUM_IMAGES; i++) {
+        ElfImage *image = &elf_cache[i];
+        if (image->valid && image->key.dev == key->dev && image->key.inode == key->inode) {
+            if (image->text.vaddr == text.p_vaddr && image->rodata.vaddr == rodata.p_vaddr) {
+                image->last_used = ++elf_cache_clock;
+                return image;
+            }
+            elf_image_evict(image);
+        }
+        if (!image->valid) {
+            victim = image;
+        } else if (victim->valid && image->last_used < victim->last_used) {
+            victim = image;
+        }
+    }
+
+    if (victim->valid) {
+        elf_image_evict(victim);
+    }
+    if (!elf_segment_load(&victim->text, elf, text, elf_is_valid_text(text))) {
+        return NULL;
+    }
+    if (!elf_segment_load(&victim->rodata, elf, rodata, elf_is_valid_rodata(rodata))) {
+        elf_segment_free(&victim->text);
+        return NULL;
+    }
+    debugf("elf_cache_get: Cached %u text and %u rodata pages of inode %u\n", victim->text.num_pages, victim->rodata.num_pages, key->inode);
+    victim->key = *key;
+    victim->valid = true;
+    victim->last_used = ++elf_cache_clock;
+    return victim;
+}
+
+// Make a process one of the owners of the shared pages of a segment
+static void elf_segment_share(Process *p, const ElfSharedSegment *segment) {
+    for (uint64_t i = 0; i < segment->num_pages; i++) {
+        page_ref(segment->pages[i]);
+        list_add_ptr(p->rcb.image_pages, segment->pages[i]);
+    }
+}
+
+// Map the shared pages of a segment into a process that owns them
+static void elf_segment_map(Process *p, const ElfSharedSegment *segment, uint64_t bits) {
+    for (uint64_t i = 0; i < segment->num_pages; i++) {
+        mmu_map(p->rcb.ptable, segment->vaddr + i * PAGE_SIZE_4K, (uint64_t)segment->pages[i], MMU_LEVEL_4K, bits);
+    }
+}
+
+// Leave only the part of a segment that is not shared to be loaded privately
+static void elf_segment_skip(Elf64_Phdr *header, const ElfSharedSegment *segment) {
+    uint64_t skip = segment->num_pages * PAGE_SIZE_4K;
+    header->p_vaddr += skip;
+    header->p_offset += skip;
+    header->p_filesz -= skip;
+    header->p_memsz -= skip;
+}
+
+void elf_cache_invalidate(VirtioDevice *dev, uint32_t inode) {
+    mutex_spinlock(&elf_cache_lock);
+    for (int i = 0; i < ELF_CACHE_NUM_IMAGES; i++) {
+        if (elf_cache[i].valid && elf_cache[i].key.dev == dev && elf_cache[i].key.inode == inode) {
+            elf_image_evict(&elf_cache[i]);
+        }
+    }
+    elf_cache_gen++;
+    mutex_unlock(&elf_cache_lock);
+}
+
+uint64_t elf_cache_generation(void) {
+    mutex_spinlock(&elf_cache_lock);
+    uint64_t gen = elf_cache_gen;
+    mutex_unlock(&elf_cache_lock);
+    return gen;
+}
+
+int elf_create_process(Process *p, const uint8_t *elf, const ElfImageKey *key) {
     if (!elf_is_valid_header(*(Elf64_Ehdr*)elf)) {
         debugf("Invalid ELF header\n");
         return 1;
@@ -794,6 +945,21 @@ int elf_create_process(Process *p, const uint8_t *elf) {
     elf_debug_program_header(data_header);
 
     // Get the sizes of the segments
+    // Take the whole read-only pages from the image cache, and load only the rest
+    mutex_spinlock(&elf_cache_lock);
+    ElfImage *shared = key != NULL ? elf_cache_get(key, elf, text_header, rodata_header) : NULL;
+    ElfSharedSegment shared_text = {0}, shared_rodata = {0};
+    if (shared != NULL) {
+        shared_text = shared->text;
+        shared_rodata = shared->rodata;
+        // The process owns its own share of the pages, so they outlive an eviction
+        elf_segment_share(p, &shared_text);
+        elf_segment_share(p, &shared_rodata);
+        elf_segment_skip(&text_header, &shared_text);
+        elf_segment_skip(&rodata_header, &shared_rodata);
+    }
+    mutex_unlock(&elf_cache_lock);
+
     debugf("Getting sizes of segments\n");
     #define min(a, b) ((a) < (b)? (a) : (b))
     #define max(a, b) ((a) > (b)? (a) : (b))
@@ -812,6 +978,13 @@ int elf_create_process(Process *p, const uint8_t *elf) {
     debugf("Total size: %x\n", total_size);
     // Allocate the memory for the segments
     uint8_t *segments = (uint8_t*)page_znalloc(ALIGN_UP_TO_PAGE(total_size) / PAGE_SIZE_4K);
+    if (segments == NULL) {
+        debugf("Failed to allocate %x bytes for the image\n", total_size);
+        kfree(program_headers);
+        return 1;
+    }
+    // Every page is kept on image_pages on its own, so fork can share them one at a time
+    page_split(segments);
     // memset(segments, 0, total_size);
     p->image = segments;
     p->image_size = total_size;
@@ -1007,6 +1180,10 @@ int elf_create_process(Process *p, const uint8_t *elf) {
                 (data_size / 0x1000) * 0x1000,
                 permission_bits);
     }
+    // The private mappings are rounded up past the end of their segments and
+    // can run over the shared pages, so those are mapped last
+    elf_segment_map(p, &shared_text, PB_READ | PB_EXECUTE | PB_USER);
+    elf_segment_map(p, &shared_rodata, PB_READ | PB_USER);
 
     Elf64_Shdr *section_headers = kmalloc(header.e_shentsize * header.e_shnum);
     memcpy(section_headers, elf + header.e_shoff, header.e_shentsize * header.e_shnum);
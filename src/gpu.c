@@ -11,6 +11,7 @@
 #include <debug.h>
 #include <csr.h>
 #include <gpu.h>
+#include <util.h>
 #include <kmalloc.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -297,17 +298,17 @@ void gpu_send_command(VirtioDevice *gpu_device,
                       size_t resp1_size) {
     // mutex_spinlock(&gpu_device_mutex);
     VirtioDescriptor cmd_desc;
-    cmd_desc.addr = kernel_mmu_translate((uintptr_t)cmd);
+    cmd_desc.addr = kernel_mmu_translate_fast((uintptr_t)cmd);
     cmd_desc.len = cmd_size;
     cmd_desc.flags = VIRTQ_DESC_F_NEXT;
 
     VirtioDescriptor resp0_desc;
-    resp0_desc.addr = kernel_mmu_translate((uintptr_t)resp0);
+    resp0_desc.addr = kernel_mmu_translate_fast((uintptr_t)resp0);
     resp0_desc.len = resp0_size;
     resp0_desc.flags = VIRTQ_DESC_F_NEXT;
     
     VirtioDescriptor resp1_desc;
-    resp1_desc.addr = kernel_mmu_translate((uintptr_t)resp1);
+    resp1_desc.addr = kernel_mmu_translate_fast((uintptr_t)resp1);
     resp1_desc.len = resp1_size;
     resp1_desc.flags = VIRTQ_DESC_F_WRITE;
 
@@ -315,8 +316,9 @@ void gpu_send_command(VirtioDevice *gpu_device,
     VirtioDescriptor chain1[3] = {cmd_desc, resp0_desc, resp1_desc};
     VirtioDescriptor *chain = resp0 == NULL ? chain0 : chain1;
     unsigned num_descriptors = resp0 == NULL ? 2 : 3;
-    virtio_create_job_with_data(gpu_device, 1, gpu_handle_job, resp1);
-    virtio_send_descriptor_chain(gpu_device, which_queue, chain, num_descriptors, true);
+    if (!virtio_send_job(gpu_device, which_queue, chain, num_descriptors, 1, gpu_handle_job, resp1)) {
+        warnf("gpu_send_command: Could not send command\n");
+    }
     // Wait until device_idx catches up 
     // debugf("GPU WAITING\n");
     // virtio_wait_for_descriptor(gpu_device, which_queue);
@@ -338,12 +340,12 @@ bool gpu_get_display_info(VirtioDevice *gpu_device,
     hdr.padding = 0;
 
     VirtioDescriptor hdr_desc;
-    hdr_desc.addr = kernel_mmu_translate((uintptr_t)&hdr);
+    hdr_desc.addr = kernel_mmu_translate_fast((uintptr_t)&hdr);
     hdr_desc.len = sizeof(hdr);
     hdr_desc.flags = VIRTQ_DESC_F_NEXT;
 
     VirtioDescriptor disp_resp_desc;
-    disp_resp_desc.addr = kernel_mmu_translate((uintptr_t)disp_resp);
+    disp_resp_desc.addr = kernel_mmu_translate_fast((uintptr_t)disp_resp);
     disp_resp_desc.len = sizeof(VirtioGpuDispInfoResp);
     disp_resp_desc.flags = VIRTQ_DESC_F_WRITE;
 
@@ -351,7 +353,7 @@ bool gpu_get_display_info(VirtioDevice *gpu_device,
 
     virtio_send_descriptor_chain(gpu_device, 0, chain, 2, true);
 
-    debugf("Internal desc_idx: %d\n", gpu_device->desc_idx);
+    debugf("Free descriptors: %d\n", gpu_device->num_free);
     debugf("Internal driver_idx: %d\n", gpu_device->driver_idx);
     debugf("Internal device_idx: %d\n", gpu_device->device_idx);
     debugf("Driver ring index: %d\n", gpu_device->driver->idx);
@@ -404,6 +406,39 @@ void gpu_fill_rect(Rectangle rect, Pixel color) {
     fill_rect(console.width, console.height, console.frame_buf, &rect, &color);
 }
 
+void gpu_blit_row(uint32_t x, uint32_t y, uint32_t width, const Pixel *src, uint32_t x_scale, uint32_t flags) {
+    Pixel *dst = console.frame_buf + (uint64_t)y * console.width + x;
+
+    if (flags & GPU_BLIT_ALPHA_SKIP) {
+        for (uint32_t i = 0; i < width; i++) {
+            const Pixel *p = &src[i / x_scale];
+            if (p->a != 0) {
+                dst[i] = *p;
+            }
+        }
+    } else if (x_scale == 1) {
+        memcpy(dst, src, width * sizeof(Pixel));
+    } else {
+        // Nearest-neighbour upscaling: every source pixel fills a run of x_scale pixels
+        uint32_t i = 0;
+        for (const Pixel *p = src; i + x_scale <= width; p++) {
+            for (uint32_t sx = 0; sx < x_scale; sx++) {
+                dst[i++] = *p;
+            }
+        }
+        // The last source pixel may be clipped part way through its run
+        for (const Pixel *p = &src[i / x_scale]; i < width; i++) {
+            dst[i] = *p;
+        }
+    }
+}
+
+void gpu_blit_copy_row(uint32_t x, uint32_t from_y, uint32_t to_y, uint32_t width) {
+    memcpy(console.frame_buf + (uint64_t)to_y * console.width + x,
+           console.frame_buf + (uint64_t)from_y * console.width + x,
+           width * sizeof(Pixel));
+}
+
 static inline void RVALS(Rectangle *r,
                          uint32_t x,
                          uint32_t y,
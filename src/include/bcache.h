@@ -0,0 +1,30 @@
+/*
+*   Buffer cache for filesystem blocks
+*/
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <virtio.h>
+
+void bcache_init(void);
+
+// Read `count` bytes starting at `offset` within a block of the given device.
+// The block is read from the disk on a miss and kept for later reads.
+// Returns false (and zeroes `data`) if the block could not be read.
+bool bcache_read(VirtioDevice *dev, uint64_t block, uint16_t block_size, uint32_t offset, void *data, uint32_t count);
+// Write `count` bytes starting at `offset` within a block. The block is marked dirty
+// and only written to the disk when it is evicted or synced. Returns false if
+// the rest of a partially written block could not be read.
+bool bcache_write(VirtioDevice *dev, uint64_t block, uint16_t block_size, uint32_t offset, const void *data, uint32_t count);
+// Bring `count` consecutive blocks into the cache, reading each run of missing
+// blocks with a single multi-sector request. Cached blocks are left alone.
+// Returns false if a read failed; the blocks it covered are not cached.
+bool bcache_prefetch(VirtioDevice *dev, uint64_t block, uint32_t count, uint16_t block_size);
+
+// Write every dirty block of the given device back to the disk.
+// If `dev` is NULL, every device is synced.
+void bcache_sync(VirtioDevice *dev);
+// Drop a block from the cache without writing it back. Use this after writing
+// the block with the block device directly.
+void bcache_invalidate(VirtioDevice *dev, uint64_t block);
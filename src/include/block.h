@@ -20,6 +20,14 @@
 #define VIRTIO_BLK_S_OK 0
 #define VIRTIO_BLK_S_IOERR 1
 #define VIRTIO_BLK_S_UNSUPP 2
+// Written into the status byte before submission; the device overwrites it.
+#define BLOCK_STATUS_PENDING 0xf
+// Written instead when the queue had no room; the packet can be sent again.
+#define BLOCK_STATUS_RETRY 0xe
+// Header, data and status
+#define BLOCK_REQUEST_DESCRIPTORS 3
+// PID 0 is reserved, so it marks a request nobody is sleeping on.
+#define BLOCK_NO_WAITER 0
 
 void block_device_init(void);
 
@@ -32,25 +40,36 @@ typedef struct BlockRequestPacket {
     // Multiple of cfg->blk_size
     // which will be 512.
     uint8_t *data;
-    uint8_t sector_count; // Number of sectors to read/write
+    uint32_t sector_count; // Number of sectors to read/write
     // Third descriptor
     uint8_t status;
 } BlockRequestPacket;
 
 
-void block_device_send_request(VirtioDevice *block_device, BlockRequestPacket *packet);
+// Submit a request and put the calling process to sleep until it completes.
+// Returns the status the device wrote (VIRTIO_BLK_S_OK on success).
+uint8_t block_device_send_request(VirtioDevice *block_device, BlockRequestPacket *packet);
+// Submit a request without waiting. The packet must stay alive until the device
+// interrupts; `waiter` (or BLOCK_NO_WAITER) is moved from PS_WAITING to PS_RUNNING
+// when it does. Several requests can be in flight at once. Returns false, with
+// the status set to BLOCK_STATUS_RETRY, if the queue is full; nothing was
+// submitted and the caller should try again once requests have completed.
+bool block_device_send_request_async(VirtioDevice *block_device, BlockRequestPacket *packet, uint16_t waiter);
+// Wait for a request submitted with block_device_send_request_async to finish.
+void block_device_wait_request(BlockRequestPacket *packet);
 
+// The sector functions return the request status (VIRTIO_BLK_S_OK on success).
 // THE DATA MUST BE PHYSICALLY CONTIGUOUS!
-void block_device_read_sector(VirtioDevice *block_device, uint64_t sector, uint8_t *data);
+uint8_t block_device_read_sector(VirtioDevice *block_device, uint64_t sector, uint8_t *data);
 
 // THE DATA MUST BE PHYSICALLY CONTIGUOUS!
-void block_device_write_sector(VirtioDevice *block_device, uint64_t sector, uint8_t *data);
+uint8_t block_device_write_sector(VirtioDevice *block_device, uint64_t sector, uint8_t *data);
 
 // THE DATA MUST BE PHYSICALLY CONTIGUOUS!
-void block_device_read_sectors(VirtioDevice *block_device, uint64_t sector, uint8_t *data, uint64_t count);
+uint8_t block_device_read_sectors(VirtioDevice *block_device, uint64_t sector, uint8_t *data, uint64_t count);
 
 // THE DATA MUST BE PHYSICALLY CONTIGUOUS!
-void block_device_write_sectors(VirtioDevice *block_device, uint64_t sector, uint8_t *data, uint64_t count);
+uint8_t block_device_write_sectors(VirtioDevice *block_device, uint64_t sector, uint8_t *data, uint64_t count);
 
 uint64_t block_device_get_sector_size(VirtioDevice *block_device);
 uint64_t block_device_get_sector_count(VirtioDevice *block_device);
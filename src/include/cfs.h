@@ -0,0 +1,56 @@
+/*
+*   Completely fair scheduler run queue
+*/
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Weight of a nice 0 process. A process's virtual runtime advances at
+// NICE_0_WEIGHT / weight times the rate of the time it really runs.
+#define NICE_0_WEIGHT 1024
+#define NICE_MIN      (-20)
+#define NICE_MAX      19
+
+struct Process;
+struct CfsQueue;
+
+// Red-black tree links, embedded in the Process so queueing never allocates
+typedef struct CfsNode {
+    struct CfsNode *parent, *left, *right;
+    bool red;
+    // The queue the process is on, or NULL
+    struct CfsQueue *queue;
+} CfsNode;
+
+// Processes waiting to run, ordered by vruntime and then by pid, so no two
+// processes ever compare equal.
+typedef struct CfsQueue {
+    CfsNode *root;
+    // The process that runs next, kept so picking it doesn't walk the tree
+    CfsNode *leftmost;
+    uint64_t nr_queued;
+    // The lowest vruntime on the queue, which never goes backwards. New and
+    // woken processes start here, so they can't get back the time they were
+    // away all at once.
+    uint64_t min_vruntime;
+} CfsQueue;
+
+void cfs_init(CfsQueue *q);
+// Queue a process that is on no queue, no earlier than min_vruntime.
+void cfs_enqueue(CfsQueue *q, struct Process *p);
+void cfs_dequeue(CfsQueue *q, struct Process *p);
+
+// The process with the lowest vruntime, the one with the highest, and the
+// one that comes after `p`. NULL if there is none.
+struct Process *cfs_first(const CfsQueue *q);
+struct Process *cfs_last(const CfsQueue *q);
+struct Process *cfs_next(const struct Process *p);
+
+// Move min_vruntime up to the queue's lowest vruntime.
+void cfs_update_min_vruntime(CfsQueue *q);
+
+// The weight of a nice level, clamped to NICE_MIN..NICE_MAX
+uint64_t cfs_weight(int nice);
+// How far `delta` of real running time moves a process's vruntime
+uint64_t cfs_scale(uint64_t delta, int nice);
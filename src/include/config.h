@@ -27,6 +27,22 @@
 // strides. Setting this number wrong might crash the SBI.
 #define MAX_ALLOWABLE_HARTS       4
 
+// The number of free single pages each hart keeps to itself
+#define PAGE_MAGAZINE_SIZE        64
+// How many pages a hart moves to or from the global page allocator at once
+#define PAGE_MAGAZINE_BATCH       32
+// Zeroed pages the idle process keeps ready for page_zalloc
+#define PAGE_ZERO_POOL_SIZE       256
+// The idle process stops zeroing pages ahead once fewer than this many are free
+#define PAGE_ZERO_POOL_MIN_FREE   1024
+
+// The number of free objects of each kmalloc size class a hart keeps to itself
+#define KMALLOC_CACHE_SIZE        32
+// How many objects a hart moves to or from the shared slabs at once
+#define KMALLOC_CACHE_BATCH       16
+// Completely free slabs each size class holds on to before giving pages back
+#define KMALLOC_EMPTY_SLABS       1
+
 // The MTIME register increments 10MHz
 #define VIRT_TIMER_FREQ           10000000
 
@@ -34,6 +50,36 @@
 #define CONTEXT_SWITCHES_PER_SEC  50
 
 #define CONTEXT_SWITCH_TIMER      (VIRT_TIMER_FREQ / CONTEXT_SWITCHES_PER_SEC)
+// Schedules between a hart evening out its run queue with the busiest one
+#define SCHED_BALANCE_TICKS       4
+
+// Pages in the stack each hart's trap handler runs on
+#define TRAP_STACK_PAGES          0x400
+
+// The number of filesystem blocks kept in memory by the buffer cache
+#define BCACHE_NUM_BUFFERS        4096
+// The number of hash chains used to find a cached block
+#define BCACHE_HASH_BUCKETS       256
+// The largest single request used to fill the cache with contiguous blocks
+#define BCACHE_MAX_RUN_BYTES      (64 * 1024)
+// The most zones read ahead of a sequential reader of an open file
+#define VFS_READAHEAD_MAX_ZONES   64
+// The number of inodes kept in memory by the inode table
+#define ICACHE_NUM_INODES         512
+// The number of hash chains used to find a cached inode
+#define ICACHE_HASH_BUCKETS       128
+// The number of name lookups kept in memory by the directory entry cache
+#define DCACHE_NUM_ENTRIES        512
+// The number of hash chains used to find a cached name lookup
+#define DCACHE_HASH_BUCKETS       128
+// Memory-mapped files kept in the page cache after their last mapping is gone
+#define PCACHE_NUM_IDLE_FILES     16
+
+// The number of executables whose read-only pages are kept loaded for new processes
+#define ELF_CACHE_NUM_IMAGES      8
+
+// The longest string (including the NUL) a syscall copies in from a process
+#define USER_STRING_MAX           1024
 
 // Search parameters for finding the OS_TARGET_MAGIC
 #define OS_TARGET_START           0x80010000UL
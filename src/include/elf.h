@@ -395,7 +395,25 @@ void elf_debug_header(Elf64_Ehdr header);
 
 void elf_debug_program_header(Elf64_Phdr header);
 
-int elf_create_process(Process *p, const uint8_t *elf);
+// Identifies the file an executable was read from, for the image cache.
+// `generation` is elf_cache_generation() from before the file was read, so an
+// image is not cached if the file was written while it was being read.
+typedef struct ElfImageKey {
+    VirtioDevice *dev;
+    uint32_t inode;
+    uint64_t generation;
+} ElfImageKey;
+
+// Load an ELF image into a process. If `key` is not NULL, the whole pages of
+// the text and rodata segments come from the image cache and are shared
+// read-only with every other process running the same file.
+int elf_create_process(Process *p, const uint8_t *elf, const ElfImageKey *key);
+
+// Drop the cached image of a file whose contents are changing. Processes
+// keep the pages they already have.
+void elf_cache_invalidate(VirtioDevice *dev, uint32_t inode);
+// Changes every time a cached file may have changed.
+uint64_t elf_cache_generation(void);
 
 int elf_load_process(Process *p, const uint8_t *elf);
 
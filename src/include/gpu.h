@@ -177,6 +177,16 @@ void stroke_rect(uint32_t screen_width,
                  const Pixel *line_color,
                  uint32_t line_size);
 void gpu_fill_rect(Rectangle rect, Pixel color);
+
+// Leave the frame buffer alone wherever the source pixel is fully transparent
+#define GPU_BLIT_ALPHA_SKIP (1 << 0)
+
+// Draw `width` frame buffer pixels of row `y` starting at column `x`, taking
+// each source pixel `x_scale` times. The caller clips to the screen first.
+void gpu_blit_row(uint32_t x, uint32_t y, uint32_t width, const Pixel *src, uint32_t x_scale, uint32_t flags);
+// Copy `width` pixels starting at column `x` from one frame buffer row to another,
+// which repeats a row that has already been drawn when scaling vertically.
+void gpu_blit_copy_row(uint32_t x, uint32_t from_y, uint32_t to_y, uint32_t width);
 Pixel *gpu_get_frame_buf();
 Rectangle *gpu_get_screen_rect();
 
@@ -12,10 +12,6 @@
 #include <stddef.h>
 #include <page.h>
 
-#define KERNEL_HEAP_START_VADDR 0x1c0ffee000UL
-#define KERNEL_HEAP_PAGES       ((HEAP_SIZE_IN_PAGES) / 2)
-#define KERNEL_HEAP_END_VADDR   (KERNEL_HEAP_START_VADDR + ((KERNEL_HEAP_PAGES) * 4096))
-
 // #define DEBUG_KMALLOC
 // #define DEBUG_HEAP
 
@@ -23,17 +19,18 @@
 /// a memory address to the start of these bytes.
 /// Your memory address may have more bytes than requested,
 /// however, you should never rely on that.
+/// The memory is physically contiguous and kernel_mmu_translate works on it.
 void *kmalloc(size_t bytes);
 void *kcalloc(size_t n, size_t bytes);
 
 #define kzalloc(bytes) \
     kcalloc(1, bytes)
 
-/// @brief Return memory back to the free list that was previously allocated by kmalloc.
+/// @brief Return memory back to the allocator that was previously allocated by kmalloc.
 void kfree(void *mem);
 
-/// @brief Before any allocations are made on the heap, this function must be called. Since MMU
-/// mappings will be made, this must be passed the mmu table.
+/// @brief Before any allocations are made on the heap, this function must be called.
+/// The page allocator must already be initialized.
 void heap_init(void);
 
 /// @brief Print out the heap statistics. This is mainly used to check for memory leaks.
@@ -41,3 +41,29 @@ void mutex_spinlock(Mutex *mutex);
  */
 void mutex_unlock(Mutex *mutex);
 
+
+/**
+ * @brief Take the kernel lock, which a hart holds while it runs a syscall
+ * or handles a page fault for a user process. Interrupts are off while
+ * we wait, so this keeps answering TLB shootdowns (see src/tlb.c), since
+ * the holder may be waiting on this hart.
+ *
+ * @param hart the hart taking the lock.
+ */
+void kernel_lock(int hart);
+
+/**
+ * @brief Release the kernel lock.
+ */
+void kernel_unlock(void);
+
+/**
+ * @brief Let go of the kernel lock if this hart holds it, so the other
+ * harts can run syscalls while this one waits on a device.
+ *
+ * @param hart the hart that is about to wait.
+ * @return true the lock was held and released, take it again with
+ * kernel_lock() when the wait is over.
+ * @return false this hart did not hold the lock.
+ */
+bool kernel_lock_drop(int hart);
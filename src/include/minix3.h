@@ -127,6 +127,13 @@ uint32_t minix3_get_next_free_inode(VirtioDevice *block_device);
 Inode minix3_get_inode(VirtioDevice *block_device, uint32_t inode);
 uint32_t minix3_get_inode_from_path(VirtioDevice *block_device, const char *path, bool get_parent);
 void minix3_put_inode(VirtioDevice *block_device, uint32_t inode, Inode data);
+// Pin an inode in the inode table, e.g. while a file is open.
+bool minix3_inode_acquire(VirtioDevice *block_device, uint32_t inode);
+// Drop a reference taken with minix3_inode_acquire. The inode is written back
+// when the last reference goes away.
+void minix3_inode_release(VirtioDevice *block_device, uint32_t inode);
+// Write back every dirty inode and block of the device (or all devices if NULL).
+void minix3_sync(VirtioDevice *block_device);
 uint32_t minix3_alloc_inode(VirtioDevice *block_device);
 
 bool minix3_has_zone(VirtioDevice *block_device, uint32_t zone);
@@ -137,6 +144,8 @@ void minix3_put_zone(VirtioDevice *block_device, uint32_t zone, uint8_t *data);
 uint32_t minix3_alloc_zone(VirtioDevice *block_device);
 
 void minix3_get_data(VirtioDevice *block_device, uint32_t inode, uint8_t *data, uint32_t offset, uint32_t count);
+// Same as minix3_get_data, but also pulls the next `readahead` zones of the file into the buffer cache.
+void minix3_get_data_with_readahead(VirtioDevice *block_device, uint32_t inode, uint8_t *data, uint32_t offset, uint32_t count, uint32_t readahead);
 void minix3_put_data(VirtioDevice *block_device, uint32_t inode, uint8_t *data, uint32_t offset, uint32_t count);
 uint64_t minix3_get_file_size(VirtioDevice *block_device, uint32_t inode);
 void minix3_read_file(VirtioDevice *block_device, uint32_t inode, uint8_t *data, uint32_t count);
@@ -158,6 +167,8 @@ uint32_t minix3_list_dir(VirtioDevice *block_device, uint32_t inode, DirEntry *e
 // Returns the inode number of the file with the given name in the given directory.
 // If the file does not exist, return INVALID_INODE.
 uint32_t minix3_find_dir_entry(VirtioDevice *block_device, uint32_t inode, const char *name);
+// Forget every cached name lookup in the given directory.
+void minix3_dentry_invalidate_dir(VirtioDevice *block_device, uint32_t dir);
 
 void minix3_traverse(VirtioDevice *block_device, uint32_t inode, char *root_path, void *data, uint32_t current_depth, uint32_t max_depth, void (*callback)(VirtioDevice *block_device, uint32_t inode, const char *path, char *entry_name, void *data, uint32_t depth));
 
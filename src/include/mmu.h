@@ -10,6 +10,7 @@
  */
 #pragma once
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define MMU_LEVEL_1G        2
@@ -31,6 +32,9 @@
 #define PB_GLOBAL           (1UL << 5)
 #define PB_ACCESS           (1UL << 6)
 #define PB_DIRTY            (1UL << 7)
+// One of the bits left for software: a read-only page that becomes a private
+// writable copy on the first store to it
+#define PB_COW              (1UL << 8)
 
 #define PB_USER_BOOL(x)     ((uint64_t)(!(x)) << 4)
 
@@ -59,6 +63,10 @@ extern PageTable *kernel_mmu_table;
 
 PageTable *mmu_table_create(void);
 
+// Map [start_virt, end_virt) to memory starting at start_phys. Both ends are
+// rounded out to a `lvl` sized page, but each step uses the biggest page (up to
+// 1G) that the addresses are aligned to, so large regions take few entries.
+// Returns the number of entries written, or 0 on failure.
 uint64_t mmu_map_range(PageTable *tab, 
                             uint64_t start_virt, 
                             uint64_t end_virt, 
@@ -71,12 +79,86 @@ uintptr_t mmu_translate(const PageTable *tab,
 
 uintptr_t kernel_mmu_translate(uintptr_t vaddr);
 
+// Print every step of a translation, including the valid entries of each
+// table on the way down. Only for debugging; nothing calls it by default.
+void mmu_translate_debug(const PageTable *tab, 
+                         uintptr_t vaddr);
+
+// The same walk as mmu_translate with no tracing, inlined into hot paths
+// such as syscalls and virtio descriptor setup.
+static inline __attribute__((always_inline))
+uintptr_t mmu_translate_fast(const PageTable *tab, uintptr_t vaddr)
+{
+    if (tab == NULL) {
+        return MMU_TRANSLATE_PAGE_FAULT;
+    }
+    for (int lvl = MMU_LEVEL_1G; lvl >= MMU_LEVEL_4K; lvl--) {
+        uint64_t pte = tab->entries[(vaddr >> (12 + 9 * lvl)) & 0x1FF];
+        if (!(pte & PB_VALID)) {
+            return MMU_TRANSLATE_PAGE_FAULT;
+        } else if (pte & (PB_READ | PB_WRITE | PB_EXECUTE)) {
+            // A leaf, which may be a 2M or 1G page above the last level
+            uint64_t page_mask = PAGE_SIZE_AT_LVL(lvl) - 1;
+            return (((pte & ~0x3FFUL) << 2) & ~page_mask) | (vaddr & page_mask);
+        }
+        tab = (const PageTable *)((pte & ~0x3FFUL) << 2);
+    }
+    return MMU_TRANSLATE_PAGE_FAULT;
+}
+
+static inline __attribute__((always_inline))
+uintptr_t kernel_mmu_translate_fast(uintptr_t vaddr)
+{
+    return mmu_translate_fast(kernel_mmu_table, vaddr);
+}
+
+// Remembers the page tables used by the last translation, so translating a
+// neighbouring address only has to read the levels that actually differ.
+// A cursor is only good while the tables it walked are not unmapped or freed.
+typedef struct MmuCursor {
+    const PageTable *root;
+    // The table at each level below the root, and the start of the range it covers
+    const PageTable *tables[MMU_LEVEL_1G];
+    uintptr_t bases[MMU_LEVEL_1G];
+} MmuCursor;
+
+void mmu_cursor_init(MmuCursor *cursor, const PageTable *tab);
+// Translate like mmu_translate. If `bits` is not NULL, the permission bits of
+// the leaf entry are stored in it.
+uintptr_t mmu_cursor_translate(MmuCursor *cursor, uintptr_t vaddr, uint64_t *bits);
+
+// None of the functions below flush the TLB. Whoever changes a table that
+// may be in use flushes it afterwards, see tlb.h.
 bool mmu_map(PageTable *tab, 
              uintptr_t vaddr, 
              uintptr_t paddr, 
              unsigned char lvl, 
              uintptr_t bits);
 
+// Copy the kernel's PB_GLOBAL root entries into `tab`, so a new address space
+// shares the kernel's mappings (and the tables under them) instead of building
+// its own. None of the functions below touch or free global entries.
+void mmu_link_kernel(PageTable *tab);
+
+// Find the 4K leaf entry that maps `vaddr`, or NULL if there is none or it
+// is mapped by a huge page. The entry may be changed in place, then flushed.
+uint64_t *mmu_find_leaf(PageTable *tab, uintptr_t vaddr);
+
+// Remove the 4K mapping of `vaddr` and return the page it mapped, or
+// MMU_TRANSLATE_PAGE_FAULT if there was none. Huge pages are left alone.
+// The caller has to flush the TLB before the old page is reused.
+uintptr_t mmu_unmap(PageTable *tab, uintptr_t vaddr);
+
+// Map every user page of `src` into `dst` at the same address. Writable pages
+// become read-only and PB_COW in both tables, huge ones split into 4K pages
+// first. Who owns the pages is up to the caller. Returns false if out of memory.
+bool mmu_share_user(PageTable *dst, PageTable *src);
+
+// Remove every user mapping, leaving the kernel mappings and the tables themselves.
+void mmu_unmap_user(PageTable *tab);
+
+// Free a page table and every table below it. The memory that leaves map,
+// whatever their size, is left alone.
 void mmu_free(PageTable *tab);
 
 void debug_page_table(PageTable *tab, uint8_t lvl);
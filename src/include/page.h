@@ -12,6 +12,7 @@
 
 #include <symbols.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 /**
  * @brief Align value x up to the power of two value y. This returns
@@ -72,6 +73,39 @@ void *page_znalloc(uint64_t n);
  */
 void page_free(void *p);
 
+/**
+ * @brief Give an allocated page one more owner, for pages shared copy-on-write.
+ * Every owner calls page_free, and only the last one really frees the page.
+ * For an allocation of several pages, only its first page counts.
+ *
+ * @param p The page-aligned, physical address of the allocated page.
+ */
+void page_ref(void *p);
+
+/**
+ * @brief Check if anyone besides the caller still owns a page.
+ *
+ * @param p The page-aligned, physical address of the allocated page.
+ * @return true if page_free would only drop an owner.
+ */
+bool page_is_shared(void *p);
+
+/**
+ * @brief Turn an allocation of n pages into n allocations of one page each,
+ * so that every page can be shared and freed on its own.
+ *
+ * @param p The address page_nalloc or page_znalloc returned.
+ */
+void page_split(void *p);
+
+/**
+ * @brief Zero one free page and add it to the pool page_zalloc takes from.
+ * Meant for the idle process, so the clearing happens off the allocation path.
+ *
+ * @return false if the pool is full or free memory is low, so there is nothing to do.
+ */
+bool page_zero_pool_refill(void);
+
 /**
  * @brief Counts the number of free (unallocated) pages.
  *
@@ -86,9 +120,25 @@ uint64_t page_count_free(void);
  */
 uint64_t page_count_taken(void);
 
+typedef struct PageCacheStats {
+    // Single page allocations served straight from a hart's magazine
+    uint64_t hits;
+    // Times a magazine was empty and took a batch from the global allocator
+    uint64_t refills;
+    // Times a magazine was full and gave a batch back
+    uint64_t drains;
+} PageCacheStats;
+
+/**
+ * @brief Sum the per-hart page cache counters over every hart.
+ */
+PageCacheStats page_cache_get_stats(void);
+void page_cache_debug(void);
+
 #define PAGE_SIZE 4096
 
 #define HEAP_SIZE_IN_BYTES (uint64_t)(sym_end(heap) - sym_start(heap))
 #define HEAP_SIZE_IN_PAGES (HEAP_SIZE_IN_BYTES / PAGE_SIZE)
-#define BK_SIZE_IN_BYTES ALIGN_UP_POT(HEAP_SIZE_IN_PAGES / 4, PAGE_SIZE)
+// A 32-bit allocation size, a 32-bit share count and an 8-bit free block order for every page
+#define BK_SIZE_IN_BYTES ALIGN_UP_POT(HEAP_SIZE_IN_PAGES * (2 * sizeof(uint32_t) + sizeof(uint8_t)), PAGE_SIZE)
 #define BK_SIZE_IN_PAGES (BK_SIZE_IN_BYTES / PAGE_SIZE)
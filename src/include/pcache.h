@@ -0,0 +1,50 @@
+/*
+*   Page cache for memory-mapped files
+*/
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <virtio.h>
+
+typedef struct PageCacheFile {
+    VirtioDevice *dev;
+    uint32_t inode;
+    // The file's size as the cache knows it. Mappings never grow the file, but
+    // writes and later mappings of a bigger file do.
+    uint64_t size;
+    uint64_t num_pages;
+    // One page per 4K of the file, NULL until the page is first needed
+    void **pages;
+    // Pages that were stored to through a shared mapping since the file was cached
+    bool *dirty;
+    // Mappings of the file. Files nobody maps stay cached until they are the
+    // least recently used of more than PCACHE_NUM_IDLE_FILES idle ones.
+    uint64_t users;
+    // Least recently used order, most recent at the head
+    struct PageCacheFile *lru_prev, *lru_next;
+} PageCacheFile;
+
+// Find the cached file for an inode, or start caching it, and count one more
+// user of it. A cached file that is now `size` bytes long is grown to match,
+// or cached again if nothing is using it. Returns NULL if memory is out.
+PageCacheFile *pcache_get(VirtioDevice *dev, uint32_t inode, uint64_t size);
+// Count one more user of a file that already has one, such as a forked mapping.
+void pcache_ref(PageCacheFile *file);
+// Drop a user. The dirty pages are written back when the last one goes away.
+void pcache_put(PageCacheFile *file);
+
+// Get page `index` of the file, reading it from the disk the first time. The
+// page stays put for as long as the file has users, so it can be mapped
+// without a reference of its own. Returns NULL if the page is past the end
+// of the file or memory is out.
+void *pcache_get_page(PageCacheFile *file, uint64_t index);
+// Remember that page `index` has to be written back.
+void pcache_mark_dirty(PageCacheFile *file, uint64_t index);
+
+// Write the dirty pages of an inode to the disk, if it is cached.
+void pcache_writeback(VirtioDevice *dev, uint32_t inode);
+// Copy data written to an inode without going through the cache into the
+// cached pages, so mappings see it. Also drops the file's cached executable
+// image (see elf_cache_invalidate).
+void pcache_update(VirtioDevice *dev, uint32_t inode, uint64_t offset, const void *data, uint64_t count);
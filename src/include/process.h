@@ -19,6 +19,7 @@
 #include <mmu.h>
 #include <kmalloc.h>
 #include <lock.h>
+#include <cfs.h>
 
 #define ENV_VARIABLE_MAX_SIZE (1024)
 
@@ -27,10 +28,14 @@
 // Define much larger stack and heap
 #define USER_STACK_TOP    0x0000000008000000UL
 #define USER_STACK_BOTTOM 0x0000000000100000UL
-#define USER_HEAP_TOP    0xfc0ffeef000UL
-#define USER_HEAP_BOTTOM 0xfc0ffee0000UL
+// The most the heap can grow to with brk. It has to be a valid Sv39 address.
+#define USER_HEAP_TOP    0x0000000040000000UL
+#define USER_HEAP_BOTTOM 0x0000000010000000UL
 // #define USER_HEAP_TOP    0x00000000000a0000UL
 // #define USER_HEAP_BOTTOM 0x0000000000080000UL
+// Where files are mapped with mmap, the 1G above the heap
+#define USER_MMAP_TOP    0x0000000080000000UL
+#define USER_MMAP_BOTTOM 0x0000000040000000UL
 
 #define ABS(x) ((x) < 0 ? -(x) : (x))
 
@@ -57,8 +62,30 @@ typedef enum ProcessState {
 } ProcessState;
 
 
+#define PROT_READ   1
+#define PROT_WRITE  2
+
+// Stores reach the file and every other mapping of it
+#define MAP_SHARED  1
+// Stores go to copies of the pages that only this mapping sees
+#define MAP_PRIVATE 2
+
+struct PageCacheFile;
+
+typedef struct MmapRegion {
+    uintptr_t start;
+    uint64_t length;
+    // Where in the file the region starts, a multiple of the page size
+    uint64_t offset;
+    int prot;
+    int flags;
+    struct PageCacheFile *file;
+    // The copies a MAP_PRIVATE region made of pages it stored to
+    List *private_pages;
+} MmapRegion;
+
 void trap_frame_debug(TrapFrame *frame);
-TrapFrame *trap_frame_new(bool is_user, PageTable *page_table, uint64_t pid);
+TrapFrame *trap_frame_new(bool is_user, PageTable *page_table);
 void trap_frame_free(TrapFrame *frame);
 
 void trap_frame_set_stack_pointer(TrapFrame *frame, uint64_t stack_pointer);
@@ -70,6 +97,8 @@ typedef struct RCB {
     List *stack_pages;
     List *heap_pages;
     List *file_descriptors;
+    // MmapRegions, in no particular order
+    List *mmaps;
     Map *environemnt;
     PageTable *ptable;
 } RCB;
@@ -93,11 +122,17 @@ typedef struct Process {
     
     // Process stats
     uint64_t sleep_until;
+    // Time spent running, and when the process last started running
     uint64_t runtime;
     uint64_t ran_at;
-    uint64_t priority;
     uint64_t quantum;
 
+    // Scheduling (see src/cfs.c). The vruntime only changes while the
+    // process is on no run queue.
+    int nice;
+    uint64_t vruntime;
+    CfsNode sched_node;
+
     uint8_t *entry_point;
 
     // Memory
@@ -121,6 +156,13 @@ typedef struct Process {
     // Resources
     RCB rcb;
     uint64_t break_size;
+
+    // The ASID with the generation it belongs to, see tlb.h
+    uint64_t asid;
+    // Harts that may have TLB entries under the ASID, and the ones among
+    // them that have to flush it before running the process again
+    uint64_t tlb_harts;
+    uint64_t tlb_stale;
 } Process;
 
 void process_debug(Process *p);
@@ -133,6 +175,57 @@ void process_put_env(Process *p, const char *var, const char *value);
 */
 Process *process_new(ProcessMode mode);
 int process_free(Process *p);
+/**
+ * Map a zeroed page under `vaddr` if it lies in the process's stack or below
+ * its break and has not been touched yet. Returns false if the address is
+ * outside both, in the stack's guard page, already mapped, or memory is out.
+*/
+bool process_fault_in(Process *p, uintptr_t vaddr);
+/**
+ * Move the end of the process's heap to `addr` and return the new break.
+ * Pages above a lowered break are freed. If `addr` is outside the heap's
+ * reserved range (such as 0), nothing changes and the current break is returned.
+*/
+uintptr_t process_brk(Process *p, uintptr_t addr);
+/**
+ * Give the process its own copy of a PB_COW page that `vaddr` is in and make
+ * it writable. Returns false if the page is not copy-on-write or memory is out.
+*/
+bool process_fault_cow(Process *p, uintptr_t vaddr);
+/**
+ * Map `length` bytes of `file` starting at `offset` somewhere between
+ * USER_MMAP_BOTTOM and USER_MMAP_TOP. The region takes over the caller's use
+ * of `file`. Nothing is mapped yet, see process_fault_mmap. Returns the
+ * address of the region, or 0 (keeping `file` with the caller) if there is
+ * no room or memory is out.
+*/
+uintptr_t process_mmap(Process *p, struct PageCacheFile *file, uint64_t length, int prot, int flags, uint64_t offset);
+/**
+ * Remove the mapped files that lie in [addr, addr + length). Returns 0, or
+ * -EINVAL if a region is only partly in the range (in which case nothing changes).
+*/
+int process_munmap(Process *p, uintptr_t addr, uint64_t length);
+/**
+ * Map the page of a mapped file that `vaddr` is in, or give a store to it
+ * what it needs: a shared region marks the page dirty and makes it writable,
+ * a private one copies it. Returns false if `vaddr` is not in a region, the
+ * access is not allowed, the page is past the end of the file, or memory is out.
+*/
+bool process_fault_mmap(Process *p, uintptr_t vaddr, bool write);
+/**
+ * Create a copy of `parent` that resumes where the parent's trap frame left
+ * off, with 0 in A0. The pages are shared copy-on-write, not copied. The child
+ * is not scheduled yet. Returns NULL if memory is out.
+*/
+Process *process_fork(Process *parent);
+/**
+ * Replace the process's image, stack and heap with a new ELF image, keeping
+ * its PID, environment and page table. `key` is passed on to elf_create_process.
+ * Returns 0, or non-zero if `elf` is not a valid ELF file (in which case the
+ * process is left alone).
+*/
+struct ElfImageKey;
+int process_exec(Process *p, const uint8_t *elf, const struct ElfImageKey *key);
 bool process_run(Process *p, uint32_t hart);
 
 void process_map_init();
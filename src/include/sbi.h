@@ -28,6 +28,8 @@
 #define SBI_SVCALL_WHOAMI       (11)
 
 #define SBI_SVCALL_POWEROFF     (12)
+
+#define SBI_SVCALL_SEND_IPI     (13)
 // The following calls are helpers to make the ECALL to the SBI.
 
 /**
@@ -69,6 +71,14 @@ int sbi_hart_get_status(unsigned int hart);
  */
 int sbi_hart_start(unsigned int hart, unsigned long target, unsigned long scratch, unsigned long satp);
 
+/**
+ * @brief Raise a supervisor software interrupt (SSIP) on a started HART.
+ *
+ * @param hart the HART to interrupt.
+ * @return 0 (false) if the HART is not started or 1 (true) if it was sent.
+ */
+int sbi_send_ipi(unsigned int hart);
+
 /**
  * @brief Stop the current HART. This function should not return as the HART running it
  * will go park.
@@ -126,6 +136,31 @@ unsigned long sbi_rtc_get_time(void);
  */
 int sbi_whoami(void);
 
+/**
+ * @brief Get the currently executing HART without asking the SBI. main and
+ * the trap handler keep its number in tp, which the kernel has no other use
+ * for. The trampoline loads tp from the frame on the way out, so supervisor
+ * processes get the hart in their frame from process_run.
+ *
+ * @return the MHARTID value
+ */
+static inline int hart_id(void)
+{
+    long hart;
+    asm volatile("mv %0, tp" : "=r"(hart));
+    return hart;
+}
+
+/**
+ * @brief Record the currently executing HART for hart_id().
+ *
+ * @param hart the MHARTID value from sbi_whoami()
+ */
+static inline void hart_id_set(int hart)
+{
+    asm volatile("mv tp, %0" : : "r"((long)hart));
+}
+
 /**
  * @brief Get the total number of HARTs on the system (maximum of MAX_ALLOWABLE_HARTS).
  *
@@ -11,16 +11,20 @@ Process *sched_get_idle_process();
 void idle_process_main();
 void sched_invoke(Process *p, int hart);
 
-//initialize scheduler tree
+//initialize the run queues
 void sched_init();
 
-//adds node to scheduler tree
+//adds process to the run queue of an idle or lightly loaded hart
 void sched_add(Process *p);
 
-//removes node from scheduler tree - used if process gets manually killed
+// Put the running process `p` to sleep until the time `until`. It leaves the
+// hart at its next schedule. Returns false if memory is out.
+bool sched_sleep(Process *p, uint64_t until);
+
+//removes process from its run queue or sleep queue - used if process gets manually killed
 void sched_remove(Process *p);
 
-//get process with the lowest vruntime
+//take the next process to run off this hart's queue, stealing one if it is empty
 Process *sched_get_next();
 
 void sched_handle_timer_interrupt(int hart);
@@ -0,0 +1,28 @@
+/*
+*   Address space IDs and TLB shootdowns
+*/
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <process.h>
+
+// Find out how many ASID bits the MMU has. Must be called once the kernel's
+// satp is set, before any process runs.
+void tlb_init(void);
+
+// Make sure `p` has an ASID that is good in the current generation and put it
+// in the process's satp. `hart` is the hart about to run it, and any stale
+// entries it has for the ASID are flushed.
+void tlb_activate(Process *p, int hart);
+
+// Flush one page of `p`'s address space on every hart that may cache it.
+// The hart running `p` (if any) has flushed by the time this returns.
+void tlb_flush_page(Process *p, uintptr_t vaddr);
+// Like tlb_flush_page, for the whole address space of `p`.
+void tlb_flush_process(Process *p);
+// Flush the kernel's own translations on every hart after kernel_mmu_table changed.
+void tlb_flush_kernel(void);
+
+// Called for a supervisor software interrupt, which is how flushes reach other harts.
+void tlb_handle_ipi(int hart);
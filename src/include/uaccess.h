@@ -1,23 +1,41 @@
 /**
- * @file symbols.h
- * @author Stephen Marz (sgm@utk.edu)
- * @brief Utilities to read linker script exports.
- * @version 0.1
- * @date 2022-05-19
- * 
- * @copyright Copyright (c) 2022
- * 
+ * @file uaccess.h
+ * @brief Copying memory in and out of a process's address space.
  */
 #pragma once
 
-typedef struct PageTable PageTable;
+#include <stdbool.h>
+#include <mmu.h>
 
-unsigned long copy_from(void *dst, 
-                        const PageTable *from_table, 
-                        const void *from, 
-                        unsigned long size);
+// Walks a range of user memory a physically contiguous piece at a time.
+typedef struct UserCursor {
+    MmuCursor mmu;
+    uintptr_t vaddr;
+    uintptr_t end;
+    // Every page in the range must have all of these bits
+    uint64_t required_bits;
+} UserCursor;
 
-unsigned long copy_to(void *to, 
-                      const PageTable *to_table, 
-                      const void *src, 
-                      unsigned long size);
+// Start walking `size` bytes at `vaddr`. If `write` is true, the pages must be writable.
+void user_cursor_init(UserCursor *cursor, const PageTable *table, const void *vaddr, unsigned long size, bool write);
+// Get the next physically contiguous piece of the range in `paddr`.
+// Returns its length, 0 at the end of the range, or -EFAULT on an unmapped page.
+long user_cursor_next(UserCursor *cursor, void **paddr);
+
+// Both return 0, or -EFAULT if any part of the user range is not mapped.
+long copy_from_user(void *dst, 
+                    const PageTable *from_table, 
+                    const void *from, 
+                    unsigned long size);
+
+long copy_to_user(void *to, 
+                  const PageTable *to_table, 
+                  const void *src, 
+                  unsigned long size);
+
+// Copy a NUL-terminated string of at most `size` bytes, including the NUL.
+// Returns the length of the string, -EFAULT, or -ENAMETOOLONG if it does not fit.
+long strncpy_from_user(char *dst, 
+                       const PageTable *from_table, 
+                       const char *from, 
+                       unsigned long size);
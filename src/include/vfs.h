@@ -56,8 +56,18 @@ typedef struct File {
     bool is_char_device;
     uint16_t major;
     uint16_t minor;
+
+    // Sequential read detection: where the next read is expected to start,
+    // and how many zones past it to pull into the buffer cache.
+    off_t readahead_offset;
+    uint32_t readahead;
 } File;
 
+// Hold the filesystem across several calls. The hart that holds it may take
+// it again, and it lets go of the kernel lock while it waits.
+void fs_lock(void);
+void fs_unlock(void);
+
 void vfs_init(void);
 void vfs_print_mounted_devices(void);
 void vfs_print_open_files(void);
@@ -210,9 +210,14 @@ typedef struct VirtioDevice {
     void *priv;
     struct Vector *jobs;
 
-    uint16_t desc_idx;
+    // Head of the list of free descriptors, linked through their `next` fields.
+    uint16_t free_head;
+    // How many descriptors are on the free list.
+    uint16_t num_free;
     uint16_t driver_idx;
     uint16_t device_idx;
+    // The head descriptor (used ring id) of the last chain we received.
+    uint16_t used_id;
 
     bool ready;
     Mutex lock;
@@ -246,7 +251,9 @@ void virtio_acquire_device(VirtioDevice *dev);
 // Performed by virtio_handle_interrupt
 void virtio_release_device(VirtioDevice *dev);
 
-// Get the next scheduled job ID
+// Get the next scheduled job ID. This is the head descriptor the next chain
+// will be written to, which is what the device hands back in the used ring.
+// Another hart can take that head first, so use virtio_send_job when it may.
 uint64_t virtio_get_next_job_id(VirtioDevice *dev);
 // Get a job's ID from its index in the scheduled jobs
 uint64_t virtio_get_job_id_by_index(VirtioDevice *dev, uint64_t index);
@@ -332,6 +339,9 @@ void virtio_send_one_descriptor(VirtioDevice *device, uint16_t which_queue, Virt
 // The descriptor will contain a physical address.
 VirtioDescriptor virtio_receive_one_descriptor(VirtioDevice *device, uint16_t which_queue, bool wait_for_descriptor);
 
+// Do we have room for a chain of `count` descriptors?
+bool virtio_has_free_descriptors(VirtioDevice *device, uint16_t count);
+
 // This checks if a device has sent us a descriptor on a given queue, ready to be received.
 bool virtio_has_received_descriptor(VirtioDevice *device, uint16_t which_queue);
 
@@ -341,7 +351,13 @@ uint16_t virtio_receive_descriptor_chain(VirtioDevice *device, uint16_t which_qu
 
 // Send an array of descriptors to a given virtio-device's queue, and optionally notify it when finished. This will automatically set the `next`
 // and VIRTIO_F_NEXT field of the `flag` bits of the descriptors to setup the chain. These descriptors must use physical addresses.
-void virtio_send_descriptor_chain(VirtioDevice *device, uint16_t which_queue, VirtioDescriptor *descriptors, uint16_t num_descriptors, bool notify_device_when_done);
+// Returns false if there are not enough free descriptors for the chain.
+bool virtio_send_descriptor_chain(VirtioDevice *device, uint16_t which_queue, VirtioDescriptor *descriptors, uint16_t num_descriptors, bool notify_device_when_done);
+// Send a chain like virtio_send_descriptor_chain and notify the device, with a
+// job for it keyed by the head descriptor the chain took. Both happen under
+// the device lock, so the completion finds the job on whichever hart reaps it.
+// Returns false, with no job made, if there are not enough free descriptors.
+bool virtio_send_job(VirtioDevice *device, uint16_t which_queue, VirtioDescriptor *descriptors, uint16_t num_descriptors, uint64_t pid_id, void (*callback)(struct VirtioDevice *device, struct Job *job), void *data);
 
 // Wait for the given device's queue to update with a descriptor.
 void virtio_wait_for_descriptor(VirtioDevice *device, uint16_t which_queue);
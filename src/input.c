@@ -76,7 +76,7 @@ bool is_initialized() {
 void input_device_receive_buffer_init(InputDevice *input_dev) {
     for (int i = 0; i < INPUT_EVENT_BUFFER_SIZE; i++) {
         VirtioDescriptor recv_buf_desc;
-        recv_buf_desc.addr = kernel_mmu_translate((uintptr_t)&input_dev->event_buffer[i]);
+        recv_buf_desc.addr = kernel_mmu_translate_fast((uintptr_t)&input_dev->event_buffer[i]);
         recv_buf_desc.flags = VIRTQ_DESC_F_WRITE;
         recv_buf_desc.len = sizeof(VirtioInputEvent);
         recv_buf_desc.next = 0;
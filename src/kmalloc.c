@@ -1,294 +1,345 @@
 #include <kmalloc.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <util.h>
-#include <mmu.h>
 #include <page.h>
+#include <lock.h>
+#include <config.h>
+#include <csr.h>
+#include <sbi.h>
 #include <debug.h>
 
-// The heap virtual address will NOT map 1-to-1 with physical addresses.
-
-typedef struct Block {
-    void *addr;
-    struct Block *next;
-    size_t size;
-} Block;
-
-typedef struct {
-    Block *free;   // first free block
-    Block *used;   // first used block
-    Block *fresh;  // first available blank block
-    size_t top;    // top free addr
-} Heap;
-
-static Heap *heap             = NULL;
-static const void *heap_limit = NULL;
-static size_t heap_split_thresh;
-static size_t heap_alignment;
-static size_t heap_max_blocks;
-
-/**
- * If compaction is enabled, inserts block
- * into free list, sorted by addr.
- * If disabled, add block has new head of
- * the free list.
+/*
+ * Small objects come from slabs: a single page cut into equal objects of one
+ * size class, with a SlabHeader at the start of the page. Because a slab is
+ * exactly one page, kfree finds the header by rounding the pointer down to
+ * the page, so a free never searches for anything.
+ *
+ * Each hart keeps a few free objects of every class in front of the slabs.
+ * A hart only touches its own cache, with interrupts off, and takes the
+ * class lock once per batch when the cache runs empty or full.
+ *
+ * Anything bigger than the largest class gets whole pages straight from the
+ * page allocator. Those pointers are page aligned, while slab objects never
+ * are (the header is in the way), which is how kfree tells them apart.
+ *
+ * Page allocator memory is identity mapped in the kernel, so everything
+ * handed out here is physically contiguous and safe to give to a device.
  */
-static void insert_block(Block *block)
+
+#define SLAB_MAGIC       0x51AB51AB
+
+typedef struct SlabHeader {
+    // Links in the class's list of slabs that have a free object
+    struct SlabHeader *next;
+    struct SlabHeader *prev;
+    struct SizeClass *cls;
+    // Free objects, linked through their first word
+    void *free;
+    // Objects that are not on `free` (including those in hart caches)
+    uint32_t in_use;
+    uint32_t magic;
+} SlabHeader;
+
+#define SLAB_HEADER_SIZE ALIGN_UP_POT(sizeof(SlabHeader), 16)
+
+typedef struct SizeClass {
+    Mutex lock;
+    uint32_t size;
+    uint32_t per_slab;
+    SlabHeader *partial;
+    uint64_t num_slabs;
+    uint64_t num_empty;
+    uint64_t in_use;
+} SizeClass;
+
+typedef struct ObjectCache {
+    uint64_t count;
+    void *objects[KMALLOC_CACHE_SIZE];
+} ObjectCache;
+
+// Tuned so the common kernel objects (ListElem, MapElem, Job, TrapFrame,
+// Process) waste little, while still fitting a few objects in a page
+static const uint32_t class_sizes[] = {16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024};
+
+#define NUM_CLASSES      (sizeof(class_sizes) / sizeof(class_sizes[0]))
+#define MAX_SMALL_SIZE   1024
+#define CLASS_GRANULE    16
+
+static SizeClass classes[NUM_CLASSES];
+// The class for each multiple of CLASS_GRANULE bytes
+static uint8_t class_of[MAX_SMALL_SIZE / CLASS_GRANULE + 1];
+static ObjectCache caches[MAX_ALLOWABLE_HARTS][NUM_CLASSES];
+
+static Mutex large_lock = MUTEX_UNLOCKED;
+static uint64_t large_allocs;
+
+static void slab_unlink(SizeClass *cls, SlabHeader *slab)
 {
-    Block *ptr  = heap->free;
-    Block *prev = NULL;
-    while (ptr != NULL) {
-        if ((size_t)block->addr <= (size_t)ptr->addr) {
-            break;
-        }
-        prev = ptr;
-        ptr  = ptr->next;
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        cls->partial = slab->next;
     }
-    if (prev != NULL) {
-        prev->next = block;
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
     }
-    else {
-        heap->free = block;
-    }
-    block->next = ptr;
+    slab->next = slab->prev = NULL;
 }
 
-#ifndef TA_DISABLE_COMPACT
-static void release_blocks(Block *scan, Block *to)
+static void slab_push(SizeClass *cls, SlabHeader *slab)
 {
-    Block *scan_next;
-    while (scan != to) {
-        scan_next   = scan->next;
-        scan->next  = heap->fresh;
-        heap->fresh = scan;
-        scan->addr  = 0;
-        scan->size  = 0;
-        scan        = scan_next;
+    slab->prev = NULL;
+    slab->next = cls->partial;
+    if (cls->partial != NULL) {
+        cls->partial->prev = slab;
     }
+    cls->partial = slab;
 }
 
-static void compact()
+// Carve a fresh page into objects. Must be called with the class lock held.
+static SlabHeader *slab_new(SizeClass *cls)
 {
-    Block *ptr = heap->free;
-    Block *prev;
-    Block *scan;
-    while (ptr != NULL) {
-        prev = ptr;
-        scan = ptr->next;
-        while (scan != NULL && (size_t)prev->addr + prev->size == (size_t)scan->addr) {
-            prev = scan;
-            scan = scan->next;
-        }
-        if (prev != ptr) {
-            size_t new_size = (size_t)prev->addr - (size_t)ptr->addr + prev->size;
-            ptr->size       = new_size;
-            Block *next     = prev->next;
-            // make merged blocks available
-            release_blocks(ptr->next, prev->next);
-            // relink
-            ptr->next = next;
-        }
-        ptr = ptr->next;
+    SlabHeader *slab = (SlabHeader *)page_alloc();
+    if (slab == NULL) {
+        return NULL;
+    }
+    slab->cls = cls;
+    slab->magic = SLAB_MAGIC;
+    slab->in_use = 0;
+    slab->free = NULL;
+    uint8_t *objects = (uint8_t *)slab + SLAB_HEADER_SIZE;
+    for (uint32_t i = cls->per_slab; i > 0; i--) {
+        void *obj = objects + (i - 1) * cls->size;
+        *(void **)obj = slab->free;
+        slab->free = obj;
     }
+    slab_push(cls, slab);
+    cls->num_slabs++;
+    cls->num_empty++;
+    return slab;
 }
-#endif
 
-static bool init(const void *base, const void *limit, const size_t heap_blocks,
-                 const size_t split_thresh, const size_t alignment)
+// Take one object out of the class's slabs. Must be called with the class lock held.
+static void *slab_take(SizeClass *cls)
 {
-    heap              = (Heap *)base;
-    heap_limit        = limit;
-    heap_split_thresh = split_thresh;
-    heap_alignment    = alignment;
-    heap_max_blocks   = heap_blocks;
-
-    heap->free        = NULL;
-    heap->used        = NULL;
-    heap->fresh       = (Block *)(heap + 1);
-    heap->top         = (size_t)(heap->fresh + heap_blocks);
-
-    Block *block      = heap->fresh;
-    size_t i          = heap_max_blocks - 1;
-    while (i--) {
-        block->next = block + 1;
-        block++;
+    SlabHeader *slab = cls->partial;
+    if (slab == NULL && (slab = slab_new(cls)) == NULL) {
+        return NULL;
+    }
+    void *obj = slab->free;
+    slab->free = *(void **)obj;
+    if (slab->in_use++ == 0) {
+        cls->num_empty--;
     }
-    block->next = NULL;
-    return true;
+    if (slab->free == NULL) {
+        // Full slabs are on no list until something in them is freed
+        slab_unlink(cls, slab);
+    }
+    cls->in_use++;
+    return obj;
 }
 
-static bool free(const void *free)
+// Put one object back in its slab. Must be called with the class lock held.
+static void slab_give(SizeClass *cls, void *obj)
 {
-    Block *block = heap->used;
-    Block *prev  = NULL;
-    while (block != NULL) {
-        if (free == block->addr) {
-            if (prev) {
-                prev->next = block->next;
-            }
-            else {
-                heap->used = block->next;
-            }
-            insert_block(block);
-            compact();
-            return true;
+    SlabHeader *slab = (SlabHeader *)ALIGN_DOWN_POT((uint64_t)obj, PAGE_SIZE);
+    if (slab->free == NULL) {
+        slab_push(cls, slab);
+    }
+    *(void **)obj = slab->free;
+    slab->free = obj;
+    cls->in_use--;
+    if (--slab->in_use == 0) {
+        if (cls->num_empty >= KMALLOC_EMPTY_SLABS) {
+            slab_unlink(cls, slab);
+            slab->magic = 0;
+            page_free(slab);
+            cls->num_slabs--;
+        } else {
+            cls->num_empty++;
         }
-        prev  = block;
-        block = block->next;
     }
-    return false;
 }
 
-static Block *alloc_block(size_t num)
+// Get the calling hart's caches, or NULL if it has none
+static ObjectCache *hart_caches(void)
 {
-    Block *ptr  = heap->free;
-    Block *prev = NULL;
-    size_t top  = heap->top;
-    num         = (num + heap_alignment - 1) & -heap_alignment;
-    while (ptr != NULL) {
-        const int is_top = ((size_t)ptr->addr + ptr->size >= top) &&
-                           ((size_t)ptr->addr + num <= (size_t)heap_limit);
-        if (is_top || ptr->size >= num) {
-            if (prev != NULL) {
-                prev->next = ptr->next;
-            }
-            else {
-                heap->free = ptr->next;
-            }
-            ptr->next  = heap->used;
-            heap->used = ptr;
-            if (is_top) {
-                ptr->size = num;
-                heap->top = (size_t)ptr->addr + num;
-            }
-            else if (heap->fresh != NULL) {
-                size_t excess = ptr->size - num;
-                if (excess >= heap_split_thresh) {
-                    ptr->size    = num;
-                    Block *split = heap->fresh;
-                    heap->fresh  = split->next;
-                    split->addr  = (void *)((size_t)ptr->addr + num);
-                    split->size  = excess;
-                    insert_block(split);
-                    compact();
-                }
+    int hart = hart_id();
+    if (hart < 0 || hart >= MAX_ALLOWABLE_HARTS) {
+        return NULL;
+    }
+    return caches[hart];
+}
+
+static void *small_alloc(uint64_t c)
+{
+    SizeClass *cls = &classes[c];
+    ObjectCache *hart = hart_caches();
+    void *obj = NULL;
+
+    if (hart == NULL) {
+        mutex_spinlock(&cls->lock);
+        obj = slab_take(cls);
+        mutex_unlock(&cls->lock);
+        return obj;
+    }
+
+    uint64_t sstatus;
+    CSR_READ(sstatus, "sstatus");
+    IRQ_OFF();
+
+    ObjectCache *cache = &hart[c];
+    if (cache->count == 0) {
+        mutex_spinlock(&cls->lock);
+        while (cache->count < KMALLOC_CACHE_BATCH) {
+            void *fresh = slab_take(cls);
+            if (fresh == NULL) {
+                break;
             }
-            return ptr;
+            cache->objects[cache->count++] = fresh;
         }
-        prev = ptr;
-        ptr  = ptr->next;
+        mutex_unlock(&cls->lock);
     }
-    // no matching free blocks
-    // see if any other blocks available
-    size_t new_top = top + num;
-    if (heap->fresh != NULL && new_top <= (size_t)heap_limit) {
-        ptr         = heap->fresh;
-        heap->fresh = ptr->next;
-        ptr->addr   = (void *)top;
-        ptr->next   = heap->used;
-        ptr->size   = num;
-        heap->used  = ptr;
-        heap->top   = new_top;
-        return ptr;
+    if (cache->count > 0) {
+        obj = cache->objects[--cache->count];
     }
-    return NULL;
+
+    if (sstatus & SSTATUS_SIE) IRQ_ON();
+    return obj;
 }
 
-static void *alloc(size_t num)
+static void small_free(SizeClass *cls, void *obj)
 {
-    Block *block = alloc_block(num);
-    if (block != NULL) {
-        return block->addr;
+    uint64_t c = cls - classes;
+    ObjectCache *hart = hart_caches();
+
+    if (hart == NULL) {
+        mutex_spinlock(&cls->lock);
+        slab_give(cls, obj);
+        mutex_unlock(&cls->lock);
+        return;
     }
-    return NULL;
-}
 
-static void *calloc(size_t num, size_t size)
-{
-    num *= size;
-    Block *block = alloc_block(num);
-    if (block != NULL) {
-        memset(block->addr, 0, num);
-        return block->addr;
+    uint64_t sstatus;
+    CSR_READ(sstatus, "sstatus");
+    IRQ_OFF();
+
+    ObjectCache *cache = &hart[c];
+    if (cache->count == KMALLOC_CACHE_SIZE) {
+        mutex_spinlock(&cls->lock);
+        for (uint64_t i = 0; i < KMALLOC_CACHE_BATCH; i++) {
+            slab_give(cls, cache->objects[--cache->count]);
+        }
+        mutex_unlock(&cls->lock);
     }
-    return NULL;
+    cache->objects[cache->count++] = obj;
+
+    if (sstatus & SSTATUS_SIE) IRQ_ON();
 }
 
-static size_t count_blocks(Block *ptr)
+static void *large_alloc(size_t bytes)
 {
-    size_t num = 0;
-    while (ptr != NULL) {
-        num++;
-        ptr = ptr->next;
+    void *mem = page_nalloc(ALIGN_UP_TO_PAGE(bytes) / PAGE_SIZE);
+    if (mem != NULL) {
+        mutex_spinlock(&large_lock);
+        large_allocs++;
+        mutex_unlock(&large_lock);
     }
-    return num;
-}
-static size_t heap_num_free()
-{
-    return count_blocks(heap->free);
-}
-static size_t heap_num_used()
-{
-    return count_blocks(heap->used);
+    return mem;
 }
-static size_t heap_num_fresh()
-{
-    return count_blocks(heap->fresh);
-}
-static bool heap_check()
+
+static void large_free(void *mem)
 {
-    return heap_max_blocks == heap_num_free() + heap_num_used() + heap_num_fresh();
+    page_free(mem);
+    mutex_spinlock(&large_lock);
+    large_allocs--;
+    mutex_unlock(&large_lock);
 }
 
 void heap_print_stats(void)
 {
-    debugf(
-        "HEAP\n~~~~\nFree blocks:    %lu\nUsed blocks:    %lu\nFresh blocks:   %lu\nHeap "
-        "check:     %s\n",
-        heap_num_free(), heap_num_used(), heap_num_fresh(), heap_check() ? "good" : "bad");
+    debugf("HEAP\n~~~~\n");
+    for (uint64_t c = 0; c < NUM_CLASSES; c++) {
+        SizeClass *cls = &classes[c];
+        uint64_t cached = 0;
+        for (int h = 0; h < MAX_ALLOWABLE_HARTS; h++) {
+            cached += caches[h][c].count;
+        }
+        mutex_spinlock(&cls->lock);
+        debugf("%4u bytes: %lu slabs (%lu empty), %lu used, %lu cached\n", cls->size,
+               cls->num_slabs, cls->num_empty, cls->in_use - cached, cached);
+        mutex_unlock(&cls->lock);
+    }
+    debugf("Large:      %lu allocations\n", large_allocs);
 }
+
 void *kmalloc(size_t sz)
 {
+    void *mem;
+    if (sz <= MAX_SMALL_SIZE) {
+        mem = small_alloc(class_of[(sz + CLASS_GRANULE - 1) / CLASS_GRANULE]);
+    } else {
+        mem = large_alloc(sz);
+    }
 #ifdef DEBUG_KMALLOC
-    debugf("[kmalloc]: %lu/%lu/%lu %d\n", heap_num_free(), heap_num_used(), heap_num_fresh(),
-           heap_check());
+    debugf("[kmalloc]: %lu bytes at %p\n", sz, mem);
 #endif
-    return alloc(sz);
+    return mem;
 }
+
 void *kcalloc(size_t n, size_t sz)
 {
-#ifdef DEBUG_KMALLOC
-    debugf("[kcalloc]: %lu/%lu/%lu %d\n", heap_num_free(), heap_num_used(), heap_num_fresh(),
-           heap_check());
-#endif
-    return calloc(n, sz);
+    if (sz != 0 && n > (size_t)-1 / sz) {
+        return NULL;
+    }
+    void *mem = kmalloc(n * sz);
+    if (mem != NULL) {
+        memset(mem, 0, n * sz);
+    }
+    return mem;
 }
+
 void kfree(void *m)
 {
-    if (m != NULL) {
-        free(m);
-    }
 #ifdef DEBUG_KMALLOC
-    debugf("[kfree]: %lu/%lu/%lu %d\n", heap_num_free(), heap_num_used(), heap_num_fresh(),
-           heap_check());
+    debugf("[kfree]: %p\n", m);
 #endif
+    if (m == NULL) {
+        return;
+    }
+    if (((uint64_t)m & (PAGE_SIZE - 1)) == 0) {
+        large_free(m);
+        return;
+    }
+    SlabHeader *slab = (SlabHeader *)ALIGN_DOWN_POT((uint64_t)m, PAGE_SIZE);
+    if (slab->magic != SLAB_MAGIC) {
+        warnf("kfree: %p was not allocated by kmalloc\n", m);
+        return;
+    }
+    small_free(slab->cls, m);
 }
 
 void heap_init(void)
 {
 #ifdef DEBUG_HEAP
-    debugf("[heap_init]: Prior to kernel alloc: Taken: %d, Free: %d\n", page_count_taken(),
-           page_count_free());
-#endif
-    void *start = page_znalloc(KERNEL_HEAP_PAGES);
-#ifdef DEBUG_HEAP
-    debugf("[heap_init]: Heap start at 0x%08lx\n", start);
-    debugf("[heap_init]: After to kernel alloc: Taken: %d, Free: %d\n", page_count_taken(),
-           page_count_free());
+    debugf("[heap_init]: Taken: %d, Free: %d\n", page_count_taken(), page_count_free());
 #endif
-
-    mmu_map_range(kernel_mmu_table, KERNEL_HEAP_START_VADDR, KERNEL_HEAP_END_VADDR, (uint64_t)start,
-                  MMU_LEVEL_4K, PB_READ | PB_WRITE);
-    init((void *)KERNEL_HEAP_START_VADDR, (void *)KERNEL_HEAP_END_VADDR, KERNEL_HEAP_PAGES / 4, 16,
-         8);
-
+    uint64_t c = 0;
+    for (uint64_t g = 0; g <= MAX_SMALL_SIZE / CLASS_GRANULE; g++) {
+        while (class_sizes[c] < g * CLASS_GRANULE) {
+            c++;
+        }
+        class_of[g] = c;
+    }
+    for (c = 0; c < NUM_CLASSES; c++) {
+        classes[c].lock = MUTEX_UNLOCKED;
+        classes[c].size = class_sizes[c];
+        classes[c].per_slab = (PAGE_SIZE - SLAB_HEADER_SIZE) / class_sizes[c];
+        classes[c].partial = NULL;
+        classes[c].num_slabs = 0;
+        classes[c].num_empty = 0;
+        classes[c].in_use = 0;
+    }
+    memset(caches, 0, sizeof(caches));
 }
@@ -11,6 +11,7 @@
 #include <config.h>
 #include <lock.h>
 #include <compiler.h>
+#include <tlb.h>
 
 bool mutex_trylock(Mutex *mutex)
 {
@@ -32,3 +33,31 @@ void mutex_unlock(Mutex *mutex)
 {
     asm volatile("amoswap.w.rl zero, zero, (%0)" : : "r"(mutex));
 }
+
+// The filesystem, the GPU and the rest of what the syscalls reach were
+// written for one hart, so only one hart at a time gets past this.
+static Mutex kernel_mutex = MUTEX_UNLOCKED;
+static volatile int kernel_owner = -1;
+
+void kernel_lock(int hart)
+{
+    while (!mutex_trylock(&kernel_mutex)) {
+        tlb_handle_ipi(hart);
+    }
+    kernel_owner = hart;
+}
+
+void kernel_unlock(void)
+{
+    kernel_owner = -1;
+    mutex_unlock(&kernel_mutex);
+}
+
+bool kernel_lock_drop(int hart)
+{
+    if (kernel_owner != hart) {
+        return false;
+    }
+    kernel_unlock();
+    return true;
+}
@@ -20,6 +20,7 @@
 #include <elf.h>
 #include <process.h>
 #include <sched.h>
+#include <tlb.h>
 
 // Global MMU table for the kernel. This is used throughout
 // the kernel.
@@ -52,8 +53,10 @@ static void init_systems(void)
     // mmu_map_range(pt, sym_start(bss), sym_end(bss), sym_start(bss), MMU_LEVEL_4K, PB_READ | PB_WRITE);
     // mmu_map_range(pt, sym_start(stack), sym_end(stack), sym_start(stack), MMU_LEVEL_4K, PB_READ | PB_WRITE);
 
+    // Global, so every process links these same entries into its page table
+    // (see mmu_link_kernel) and they survive address space switches in the TLB
     mmu_map_range(pt, sym_end(memory), sym_end(memory) + 0x1000000000UL, sym_end(memory), MMU_LEVEL_1G,
-                  PB_READ | PB_WRITE | PB_EXECUTE);
+                  PB_READ | PB_WRITE | PB_EXECUTE | PB_GLOBAL);
     // // PLIC
     // mmu_map_range(pt, sym_start(memory) + 0x40000000, sym_end(memory), sym_start(memory) + 0x40000000, MMU_LEVEL_1G,
     //               PB_READ | PB_WRITE | PB_EXECUTE);
@@ -80,6 +83,7 @@ static void init_systems(void)
     CSR_WRITE("satp", SATP_KERNEL); 
     SFENCE_ALL();
     debugf("MMU enabled\n");
+    tlb_init();
 
 #endif
 
@@ -134,7 +138,8 @@ static void init_systems(void)
     CSR_READ(kernel_trap_frame->sstatus, "sstatus");
     CSR_READ(kernel_trap_frame->sie, "sie");
     // kernel_trap_frame->satp = kernel_mmu_table
-    kernel_trap_frame->trap_stack = (uint64_t)page_znalloc(0x400);
+    // The stack grows down from the end of the pages
+    kernel_trap_frame->trap_stack = (uint64_t)page_znalloc(TRAP_STACK_PAGES) + TRAP_STACK_PAGES * PAGE_SIZE_4K;
     CSR_WRITE("sscratch", kernel_trap_frame);
     trap_frame_debug(kernel_trap_frame);
 
@@ -211,6 +216,9 @@ static void console(void);
 #endif
 void main(unsigned int hart)
 {
+    // Allocators pick this hart's caches with hart_id() from here on
+    hart_id_set(hart);
+
     // Initialize the page allocator
     // Allocate and zero the kernel's page table.
 
@@ -270,10 +278,10 @@ void main(unsigned int hart)
     vfs_close(elf_file);
 
     Process *p = process_new(PM_USER);
-    elf_create_process(p, elfcon);
+    elf_create_process(p, elfcon, NULL);
 
     p->state = PS_RUNNING;
-    p->priority = 1;
+    p->nice = 0;
     p->hart = sbi_whoami();
     // p->frame->sstatus = SSTATUS_SPP_BIT | SSTATUS_SPIE_BIT;
     // sched_add(p);
@@ -1,5 +1,6 @@
 #include <minix3.h>
 #include <block.h>
+#include <bcache.h>
 #include <debug.h>
 #include <stdint.h>
 #include <util.h>
@@ -7,6 +8,8 @@
 #include <path.h>
 #include <map.h>
 #include <trap.h>
+#include <lock.h>
+#include <config.h>
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 #define max(a, b) ((a) > (b) ? (a) : (b))
@@ -41,34 +44,181 @@ void debug_dir_entry(DirEntry entry) {
     #endif
 }
 
+// Directory entry cache. This maps (device, directory inode, name) to the
+// inode the name refers to. Names that are not in the directory are cached
+// too (as INVALID_INODE) so repeated misses don't rescan the directory.
+typedef struct CachedDirEntry {
+    VirtioDevice *dev;
+    uint32_t dir;
+    uint32_t inode;
+    char name[sizeof(((DirEntry *)0)->name) + 1];
+    bool valid;
+
+    struct CachedDirEntry *hash_next;
+    struct CachedDirEntry *lru_prev, *lru_next;
+} CachedDirEntry;
+
+static CachedDirEntry dentry_table[DCACHE_NUM_ENTRIES];
+static CachedDirEntry *dentry_hash[DCACHE_HASH_BUCKETS];
+static CachedDirEntry *dentry_lru_head, *dentry_lru_tail;
+static Mutex dentry_table_lock = MUTEX_UNLOCKED;
+static bool dentry_table_ready = false;
+
+static uint32_t minix3_dentry_hash(VirtioDevice *block_device, uint32_t dir, const char *name) {
+    uint64_t hash = 5381;
+    for (const char *c = name; *c != '\0'; c++) {
+        hash = hash * 33 + (uint8_t)*c;
+    }
+    return (hash ^ ((uint64_t)block_device >> 4) ^ (dir * 2654435761U)) % DCACHE_HASH_BUCKETS;
+}
+
+static void minix3_dentry_lru_unlink(CachedDirEntry *entry) {
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else dentry_lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else dentry_lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void minix3_dentry_lru_push(CachedDirEntry *entry, bool front) {
+    if (front) {
+        entry->lru_prev = NULL;
+        entry->lru_next = dentry_lru_head;
+        if (dentry_lru_head) dentry_lru_head->lru_prev = entry;
+        dentry_lru_head = entry;
+        if (dentry_lru_tail == NULL) dentry_lru_tail = entry;
+    } else {
+        entry->lru_next = NULL;
+        entry->lru_prev = dentry_lru_tail;
+        if (dentry_lru_tail) dentry_lru_tail->lru_next = entry;
+        dentry_lru_tail = entry;
+        if (dentry_lru_head == NULL) dentry_lru_head = entry;
+    }
+}
+
+static void minix3_dentry_table_init(void) {
+    if (dentry_table_ready) {
+        return;
+    }
+    memset(dentry_table, 0, sizeof(dentry_table));
+    memset(dentry_hash, 0, sizeof(dentry_hash));
+    dentry_lru_head = dentry_lru_tail = NULL;
+    for (uint32_t i=0; i<DCACHE_NUM_ENTRIES; i++) {
+        minix3_dentry_lru_push(&dentry_table[i], false);
+    }
+    dentry_table_ready = true;
+}
+
+static void minix3_dentry_drop(CachedDirEntry *entry) {
+    CachedDirEntry **link = &dentry_hash[minix3_dentry_hash(entry->dev, entry->dir, entry->name)];
+    while (*link != NULL) {
+        if (*link == entry) {
+            *link = entry->hash_next;
+            break;
+        }
+        link = &(*link)->hash_next;
+    }
+    entry->hash_next = NULL;
+    entry->valid = false;
+    // Reuse dropped entries first
+    minix3_dentry_lru_unlink(entry);
+    minix3_dentry_lru_push(entry, false);
+}
+
+// Look up `name` in the directory `dir`, consulting the dentry cache first.
+static uint32_t minix3_lookup(VirtioDevice *block_device, uint32_t dir, const char *name) {
+    mutex_spinlock(&dentry_table_lock);
+    minix3_dentry_table_init();
+    uint32_t bucket = minix3_dentry_hash(block_device, dir, name);
+    for (CachedDirEntry *entry = dentry_hash[bucket]; entry != NULL; entry = entry->hash_next) {
+        if (entry->dev == block_device && entry->dir == dir && strcmp(entry->name, name) == 0) {
+            minix3_dentry_lru_unlink(entry);
+            minix3_dentry_lru_push(entry, true);
+            uint32_t inode = entry->inode;
+            mutex_unlock(&dentry_table_lock);
+            debugf("minix3_lookup: Cached %s in %u is %u\n", name, dir, inode);
+            return inode;
+        }
+    }
+    mutex_unlock(&dentry_table_lock);
+
+    uint32_t inode = minix3_find_dir_entry(block_device, dir, name);
+
+    mutex_spinlock(&dentry_table_lock);
+    CachedDirEntry *entry = dentry_lru_tail;
+    if (entry->valid) {
+        minix3_dentry_drop(entry);
+    }
+    entry->dev = block_device;
+    entry->dir = dir;
+    entry->inode = inode;
+    strncpy(entry->name, name, sizeof(entry->name) - 1);
+    entry->name[sizeof(entry->name) - 1] = '\0';
+    entry->valid = true;
+    entry->hash_next = dentry_hash[bucket];
+    dentry_hash[bucket] = entry;
+    minix3_dentry_lru_unlink(entry);
+    minix3_dentry_lru_push(entry, true);
+    mutex_unlock(&dentry_table_lock);
+    return inode;
+}
+
+void minix3_dentry_invalidate_dir(VirtioDevice *block_device, uint32_t dir) {
+    mutex_spinlock(&dentry_table_lock);
+    minix3_dentry_table_init();
+    for (uint32_t i=0; i<DCACHE_NUM_ENTRIES; i++) {
+        CachedDirEntry *entry = &dentry_table[i];
+        if (entry->valid && entry->dev == block_device && entry->dir == dir) {
+            minix3_dentry_drop(entry);
+        }
+    }
+    mutex_unlock(&dentry_table_lock);
+}
+
 // Return the inode number from path.
 // If get_parent is true, return the inode number of the parent.
 // If given path /dir0/dir1file, return inode of /dir0/dir1/
 uint32_t minix3_get_inode_from_path(VirtioDevice *block_device, const char *path, bool get_parent) {
     // TODO: Add support for relative path.
     debugf("Getting inode from path %s\n", path);
-    List *path_items = path_split(path);
 
     uint32_t parent = 1; // Root inode
 
-    uint32_t i = 0, num_items = list_size(path_items);
+    // Count the path items first so we know which one is the last
+    uint32_t num_items = 0;
+    for (const char *cursor = path; *cursor != '\0';) {
+        while (*cursor == '/') cursor++;
+        num_items++;
+        while (*cursor != '\0' && *cursor != '/') cursor++;
+    }
     debugf("num_items = %u\n", num_items);
-    ListElem *elem;
-    list_for_each(path_items, elem) {
 
-        char *name = (char *)list_elem_value(elem);
-        debugf("Getting inode from relative path %s, num_items = %u\n", name, num_items);
-        if (strcmp(name, "/") == 0 || strcmp(name, "") == 0) {
+    // Walk the path in place, one name at a time
+    char name[sizeof(((DirEntry *)0)->name) + 1];
+    uint32_t i = 0;
+    const char *cursor = path;
+    while (*cursor != '\0') {
+        while (*cursor == '/') cursor++;
+        size_t length = 0;
+        while (cursor[length] != '\0' && cursor[length] != '/') length++;
+
+        if (length == 0) {
             debugf("Skipping root\n");
             return parent;
         }
-        debugf("i = %u, num_items = %u\n", i, num_items);
         if (get_parent && i == num_items - 1) {
             debugf("Returning parent inode %u\n", parent);
             return parent;
         }
+        if (length >= sizeof(name)) {
+            warnf("minix3_get_inode_from_path: Name in %s is too long\n", path);
+            return INVALID_INODE;
+        }
+        memcpy(name, cursor, length);
+        name[length] = '\0';
+
         debugf("Getting child %s of inode %u\n", name, parent);
-        uint32_t child = minix3_find_dir_entry(block_device, parent, name);
+        uint32_t child = minix3_lookup(block_device, parent, name);
         debugf("Got child %u\n", child);
         
         if (child == INVALID_INODE) {
@@ -76,7 +226,7 @@ uint32_t minix3_get_inode_from_path(VirtioDevice *block_device, const char *path
             return INVALID_INODE;
         }
         parent = child;
-        debugf("Got child %u\n", child);
+        cursor += length;
         i++;
     }
 
@@ -413,6 +563,8 @@ SuperBlock minix3_get_superblock(VirtioDevice *block_device) {
 void minix3_put_superblock(VirtioDevice *block_device, SuperBlock superblock) {
     // Put the superblock
     block_device_write_bytes(block_device, 1024, (uint8_t *)&superblock, sizeof(SuperBlock));
+    // Don't let the buffer cache hand out the old copy
+    bcache_invalidate(block_device, 1024 / minix3_get_block_size(block_device));
 }
 
 
@@ -491,13 +643,18 @@ void minix3_load_device(VirtioDevice *block_device) {
     }
 }
 
+// All block reads and writes go through the buffer cache
 void minix3_get_blocks(VirtioDevice *block_device, uint32_t start_block, uint8_t *data, uint16_t count) {
-    // SuperBlock sb = minix3_get_superblock();
-    block_device_read_bytes(block_device, start_block * minix3_get_block_size(block_device), data, minix3_get_block_size(block_device) * count);
+    uint16_t block_size = minix3_get_block_size(block_device);
+    for (uint16_t i=0; i<count; i++) {
+        bcache_read(block_device, start_block + i, block_size, 0, data + i * block_size, block_size);
+    }
 }
 void minix3_put_blocks(VirtioDevice *block_device, uint32_t start_block, uint8_t *data, uint16_t count) {
-    // SuperBlock sb = minix3_get_superblock();
-    block_device_write_bytes(block_device, start_block * minix3_get_block_size(block_device), data, minix3_get_block_size(block_device) * count);
+    uint16_t block_size = minix3_get_block_size(block_device);
+    for (uint16_t i=0; i<count; i++) {
+        bcache_write(block_device, start_block + i, block_size, 0, data + i * block_size, block_size);
+    }
 }
 
 void minix3_get_block(VirtioDevice *block_device, uint32_t block, uint8_t *data) {
@@ -559,8 +716,145 @@ uint32_t minix3_get_next_free_inode(VirtioDevice *block_device) {
     return 0;
 }
 
-static uint32_t last_inode = 0; // Last inode number we looked up
-static Inode last_inode_data; // Data of the last inode
+// In-memory inode table. Inodes are found by hashing (device, inode) and
+// kept in least recently used order. Referenced inodes (open files) are
+// never evicted, and dirty inodes are written back when they are evicted,
+// released, or synced.
+typedef struct CachedInode {
+    VirtioDevice *dev;
+    uint32_t inode;
+    Inode data;
+    uint32_t refcount;
+    bool valid;
+    bool dirty;
+
+    struct CachedInode *hash_next;
+    struct CachedInode *lru_prev, *lru_next;
+} CachedInode;
+
+static CachedInode inode_table[ICACHE_NUM_INODES];
+static CachedInode *inode_hash[ICACHE_HASH_BUCKETS];
+static CachedInode *inode_lru_head, *inode_lru_tail;
+static Mutex inode_table_lock = MUTEX_UNLOCKED;
+static bool inode_table_ready = false;
+
+static uint32_t minix3_inode_hash(VirtioDevice *block_device, uint32_t inode) {
+    return (((uint64_t)block_device >> 4) ^ (inode * 2654435761U)) % ICACHE_HASH_BUCKETS;
+}
+
+static void minix3_inode_lru_unlink(CachedInode *entry) {
+    if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+    else inode_lru_head = entry->lru_next;
+    if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+    else inode_lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void minix3_inode_lru_push_front(CachedInode *entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = inode_lru_head;
+    if (inode_lru_head) inode_lru_head->lru_prev = entry;
+    inode_lru_head = entry;
+    if (inode_lru_tail == NULL) inode_lru_tail = entry;
+}
+
+static void minix3_inode_table_init(void) {
+    if (inode_table_ready) {
+        return;
+    }
+    memset(inode_table, 0, sizeof(inode_table));
+    memset(inode_hash, 0, sizeof(inode_hash));
+    inode_lru_head = inode_lru_tail = NULL;
+    for (uint32_t i=0; i<ICACHE_NUM_INODES; i++) {
+        minix3_inode_lru_push_front(&inode_table[i]);
+    }
+    inode_table_ready = true;
+}
+
+static void minix3_inode_hash_remove(CachedInode *entry) {
+    CachedInode **link = &inode_hash[minix3_inode_hash(entry->dev, entry->inode)];
+    while (*link != NULL) {
+        if (*link == entry) {
+            *link = entry->hash_next;
+            break;
+        }
+        link = &(*link)->hash_next;
+    }
+    entry->hash_next = NULL;
+}
+
+static CachedInode *minix3_inode_find(VirtioDevice *block_device, uint32_t inode) {
+    for (CachedInode *entry = inode_hash[minix3_inode_hash(block_device, inode)]; entry != NULL; entry = entry->hash_next) {
+        if (entry->dev == block_device && entry->inode == inode) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+// Read an inode from the inode table on disk (through the buffer cache).
+static Inode minix3_read_inode(VirtioDevice *block_device, uint32_t inode) {
+    SuperBlock sb = minix3_get_superblock(block_device);
+    Inode data;
+    uint64_t offset = minix3_get_inode_byte_offset(block_device, sb, inode);
+
+    // Inodes never straddle a block, so this is a single cached block
+    uint16_t block_size = minix3_get_block_size(block_device);
+    bcache_read(block_device, offset / block_size, block_size, offset % block_size, &data, sizeof(Inode));
+    return data;
+}
+
+// Write an inode to the inode table on disk (through the buffer cache).
+static void minix3_write_inode(VirtioDevice *block_device, uint32_t inode, Inode *data) {
+    SuperBlock sb = minix3_get_superblock(block_device);
+    uint64_t offset = minix3_get_inode_byte_offset(block_device, sb, inode);
+
+    // debugf("Putting inode %u at offset %u (%x)...\n", inode, offset, offset);
+    uint16_t block_size = minix3_get_block_size(block_device);
+    bcache_write(block_device, offset / block_size, block_size, offset % block_size, data, sizeof(Inode));
+}
+
+static void minix3_inode_writeback(CachedInode *entry) {
+    if (entry->valid && entry->dirty) {
+        debugf("minix3_inode_writeback: Writing back inode %u\n", entry->inode);
+        minix3_write_inode(entry->dev, entry->inode, &entry->data);
+        entry->dirty = false;
+    }
+}
+
+// Find an inode in the table, loading it from disk if needed.
+// Returns NULL if every slot is referenced. Must be called with the lock held.
+static CachedInode *minix3_inode_lookup(VirtioDevice *block_device, uint32_t inode, bool load) {
+    minix3_inode_table_init();
+    CachedInode *entry = minix3_inode_find(block_device, inode);
+    if (entry == NULL) {
+        // Recycle the least recently used inode nobody holds
+        for (entry = inode_lru_tail; entry != NULL && entry->refcount > 0; entry = entry->lru_prev) {
+        }
+        if (entry == NULL) {
+            warnf("minix3_inode_lookup: Inode table is full of referenced inodes\n");
+            return NULL;
+        }
+        if (entry->valid) {
+            minix3_inode_writeback(entry);
+            minix3_inode_hash_remove(entry);
+        }
+        entry->dev = block_device;
+        entry->inode = inode;
+        entry->dirty = false;
+        entry->refcount = 0;
+        if (load) {
+            entry->data = minix3_read_inode(block_device, inode);
+        }
+        entry->valid = true;
+        uint32_t bucket = minix3_inode_hash(block_device, inode);
+        entry->hash_next = inode_hash[bucket];
+        inode_hash[bucket] = entry;
+    }
+    minix3_inode_lru_unlink(entry);
+    minix3_inode_lru_push_front(entry);
+    return entry;
+}
 
 Inode minix3_get_inode(VirtioDevice *block_device, uint32_t inode) {
     minix3_load_device(block_device);
@@ -568,17 +862,11 @@ Inode minix3_get_inode(VirtioDevice *block_device, uint32_t inode) {
         warnf("minix3_get_inode: Invalid inode %u\n", inode);
         return (Inode){0};
     }
-    else if (inode == last_inode) {
-        return last_inode_data;
-    }
-    SuperBlock sb = minix3_get_superblock(block_device);
-    Inode data;
-    uint64_t offset = minix3_get_inode_byte_offset(block_device, sb, inode);
 
-    // block_device_read_bytes(offset, (uint8_t*)&data, sizeof(Inode));
-    block_device_read_bytes(block_device, offset, (uint8_t*)&data, sizeof(Inode));
-    last_inode_data = data;
-    last_inode = inode;
+    mutex_spinlock(&inode_table_lock);
+    CachedInode *entry = minix3_inode_lookup(block_device, inode, true);
+    Inode data = entry != NULL ? entry->data : minix3_read_inode(block_device, inode);
+    mutex_unlock(&inode_table_lock);
     return data;
 }
 
@@ -588,11 +876,55 @@ void minix3_put_inode(VirtioDevice *block_device, uint32_t inode, Inode data) {
         warnf("minix3_put_inode: Invalid inode %u\n", inode);
         return;
     }
-    SuperBlock sb = minix3_get_superblock(block_device);
-    uint64_t offset = minix3_get_inode_byte_offset(block_device, sb, inode);
 
-    // debugf("Putting inode %u at offset %u (%x)...\n", inode, offset, offset);
-    block_device_write_bytes(block_device, offset, (uint8_t*)&data, sizeof(Inode));
+    mutex_spinlock(&inode_table_lock);
+    CachedInode *entry = minix3_inode_lookup(block_device, inode, false);
+    if (entry != NULL) {
+        entry->data = data;
+        entry->dirty = true;
+    } else {
+        minix3_write_inode(block_device, inode, &data);
+    }
+    mutex_unlock(&inode_table_lock);
+}
+
+bool minix3_inode_acquire(VirtioDevice *block_device, uint32_t inode) {
+    if (inode == INVALID_INODE) {
+        return false;
+    }
+    minix3_load_device(block_device);
+    mutex_spinlock(&inode_table_lock);
+    CachedInode *entry = minix3_inode_lookup(block_device, inode, true);
+    if (entry != NULL) {
+        entry->refcount++;
+    }
+    mutex_unlock(&inode_table_lock);
+    return entry != NULL;
+}
+
+void minix3_inode_release(VirtioDevice *block_device, uint32_t inode) {
+    mutex_spinlock(&inode_table_lock);
+    minix3_inode_table_init();
+    CachedInode *entry = minix3_inode_find(block_device, inode);
+    if (entry == NULL || entry->refcount == 0) {
+        warnf("minix3_inode_release: Inode %u is not held\n", inode);
+    } else if (--entry->refcount == 0) {
+        // Last reference is gone, write the inode back
+        minix3_inode_writeback(entry);
+    }
+    mutex_unlock(&inode_table_lock);
+}
+
+void minix3_sync(VirtioDevice *block_device) {
+    mutex_spinlock(&inode_table_lock);
+    minix3_inode_table_init();
+    for (uint32_t i=0; i<ICACHE_NUM_INODES; i++) {
+        if (block_device == NULL || inode_table[i].dev == block_device) {
+            minix3_inode_writeback(&inode_table[i]);
+        }
+    }
+    mutex_unlock(&inode_table_lock);
+    bcache_sync(block_device);
 }
 
 // Allocate a free inode.
@@ -661,245 +993,116 @@ void minix3_read_file(VirtioDevice *block_device, uint32_t inode, uint8_t *data,
     minix3_get_data(block_device, inode, data, 0, count);
 }
 
-void minix3_get_data(VirtioDevice *block_device, uint32_t inode, uint8_t *data, uint32_t offset, uint32_t count) {
-    debugf("minix3_get_data: Getting data from inode %u, offset %u, count %u\n", inode, offset, count);
-    // First, get the inode
-    Inode inode_data = minix3_get_inode(block_device, inode);
-    debugf("minix3_get_data: Got inode %u\n", inode);
-    
-
-    uint8_t zone_data[minix3_get_zone_size(block_device)];
-
-    // The cursor is the current position in the data buffer
-    uint32_t buffer_cursor = 0;
-    uint32_t file_cursor = 0;
+// Read one zone number out of an indirect zone. A zero zone is a hole.
+static uint32_t minix3_get_indirect_entry(VirtioDevice *block_device, uint32_t zone, uint32_t index) {
+    if (zone == 0) {
+        return 0;
+    }
+    uint32_t entry = 0;
+    uint16_t zone_size = minix3_get_zone_size(block_device);
+    bcache_read(block_device, zone, zone_size, index * sizeof(uint32_t), &entry, sizeof(uint32_t));
+    return entry;
+}
 
-    // Now, get the data
+// Map the index of a zone within a file to the zone on disk.
+// Returns 0 if the zone is a hole (or past what the inode can address).
+static uint32_t minix3_map_zone(VirtioDevice *block_device, Inode *inode_data, uint32_t index) {
+    uint64_t per_zone = minix3_get_zone_size(block_device) / sizeof(uint32_t);
     // The first 7 zones are direct zones
-    for (uint32_t direct_zone=0; direct_zone<7; direct_zone++) {
-        uint32_t zone = inode_data.zones[direct_zone];
-        if (zone == 0) {
-            debugf("No direct zone #%d = %d\n", direct_zone, zone);
-            continue;
-        } else {
-            debugf("Direct zone #%d = %d\n", direct_zone, zone);
-        }
-        memset(zone_data, 0, minix3_get_zone_size(block_device));
-
-        if (file_cursor + minix3_get_zone_size(block_device) < offset) {
-            // We're not at the offset yet
-            file_cursor += minix3_get_zone_size(block_device);
-            continue;
-        } else if (file_cursor < offset) {
-            // We're in the middle of the offset
-            // Read the zone into the buffer
-            debugf("Reading first direct zone %d\n", zone);
-            minix3_get_zone(block_device, zone, zone_data);
-            debugf("Read first direct zone %d\n", zone);
-            // Copy the remaining data into the buffer
-            size_t remaining = min(count, minix3_get_zone_size(block_device) - (offset - file_cursor));
-            memcpy(data, zone_data + offset - file_cursor, remaining);
-            buffer_cursor += remaining;
-            file_cursor = offset + remaining;
-            continue;
-        }
-        debugf("file_cursor = %u, offset = %u\n", file_cursor, offset);
-
-        // Read the zone into the buffer
-        minix3_get_zone(block_device, zone, zone_data);
-
-        // If the cursor is past the amount of data we want, we're done
-        if (buffer_cursor + minix3_get_zone_size(block_device) > count) {
-            debugf("Reading last direct zone %d\n", zone);
-            // Copy the remaining data into the buffer
-            memcpy(data + buffer_cursor, zone_data, count - buffer_cursor);
-            // We're done
-            return;
-        } else {
-            debugf("Reading direct zone %d\n", zone);
-            // Copy the entire zone into the buffer
-            memcpy(data + buffer_cursor, zone_data, minix3_get_zone_size(block_device));
-        }
-        buffer_cursor += minix3_get_zone_size(block_device);
+    if (index < 7) {
+        return inode_data->zones[index];
     }
-
-    debugf("Done with direct zones\n");
+    uint64_t i = index - 7;
     // The next zone is an indirect zone
-    if (inode_data.zones[7] != 0) {
-        debugf("Reading indirect zone %d\n", inode_data.zones[7]);
-        uint32_t indirect_zones[minix3_get_zone_size(block_device) / sizeof(uint32_t)];
-        minix3_get_zone(block_device, inode_data.zones[7], (uint8_t*)indirect_zones);
-        
-
-        for (uint32_t indirect_zone=0; indirect_zone<minix3_get_zone_size(block_device) / sizeof(uint32_t); indirect_zone++) {
-            uint32_t zone = indirect_zones[indirect_zone];
-            debugf("Zone #%d\n", indirect_zone);
-            if (zone == 0) {
-                debugf("No indirect zone %d\n", indirect_zone);
-            } else {
-                debugf("Reading indirect zone %d\n", zone);
-            }
-            
-
-            if (file_cursor + minix3_get_zone_size(block_device) < offset) {
-                // We're not at the offset yet
-                file_cursor += minix3_get_zone_size(block_device);
-                continue;
-            } else if (file_cursor < offset) {
-                // We're in the middle of the offset
-                // Read the zone into the buffer
-                minix3_get_zone(block_device, zone, zone_data);
-                // Copy the remaining data into the buffer
-                size_t remaining = min(count, minix3_get_zone_size(block_device) - (offset - file_cursor));
-                memcpy(data, zone_data + offset - file_cursor, remaining);
-                buffer_cursor += remaining;
-                file_cursor = offset + remaining;
-                continue;
-            }
-            
-            memset(zone_data, 0, minix3_get_zone_size(block_device));
-
-            // Read the zone into the buffer
-            minix3_get_zone(block_device, zone, zone_data);
-            // If the cursor is past the amount of data we want, we're done
-            if (buffer_cursor + minix3_get_zone_size(block_device) > count) {
-                // Copy the remaining data into the buffer
-                memcpy(data + buffer_cursor, zone_data, count - buffer_cursor);
-                // We're done
-                return;
-            } else {
-                // Copy the entire zone into the buffer
-                memcpy(data + buffer_cursor, zone_data, minix3_get_zone_size(block_device));
-            }
-            buffer_cursor += minix3_get_zone_size(block_device);
-        }
-    } else {
-        debugf("No indirect zone\n");
+    if (i < per_zone) {
+        return minix3_get_indirect_entry(block_device, inode_data->zones[7], i);
     }
-
+    i -= per_zone;
     // The next zone is a double indirect zone
-    if (inode_data.zones[8] != 0) {
-        debugf("Reading double indirect zone %d\n", inode_data.zones[8]);
-        uint32_t double_indirect_zones[minix3_get_zone_size(block_device) / sizeof(uint32_t)];
-        // We're done
-        minix3_get_zone(block_device, inode_data.zones[8], (uint8_t*)double_indirect_zones);
-
-        for (uint32_t double_indirect_zone=0; double_indirect_zone<minix3_get_zone_size(block_device) / sizeof(uint32_t); double_indirect_zone++) {
-            uint32_t indirect_zone = double_indirect_zones[double_indirect_zone];
-            if (indirect_zone == 0) continue;
-
-            uint32_t indirect_zones[minix3_get_zone_size(block_device) / sizeof(uint32_t)];
-            minix3_get_zone(block_device, indirect_zone, (uint8_t*)indirect_zones);
-
-            for (uint32_t indirect_zone=0; indirect_zone<minix3_get_zone_size(block_device) / sizeof(uint32_t); indirect_zone++) {
-                uint32_t zone = indirect_zones[indirect_zone];
-                if (zone == 0) {
-                    debugf("No double indirect zone %d\n", indirect_zone);
-                    continue;
-                }
-                debugf("Reading double indirect zone %d\n", zone);
+    if (i < per_zone * per_zone) {
+        uint32_t indirect = minix3_get_indirect_entry(block_device, inode_data->zones[8], i / per_zone);
+        return minix3_get_indirect_entry(block_device, indirect, i % per_zone);
+    }
+    i -= per_zone * per_zone;
+    // The next zone is a triple indirect zone
+    if (i < per_zone * per_zone * per_zone) {
+        uint32_t double_indirect = minix3_get_indirect_entry(block_device, inode_data->zones[9], i / (per_zone * per_zone));
+        uint32_t indirect = minix3_get_indirect_entry(block_device, double_indirect, (i / per_zone) % per_zone);
+        return minix3_get_indirect_entry(block_device, indirect, i % per_zone);
+    }
+    return 0;
+}
 
-                if (file_cursor + minix3_get_zone_size(block_device) < offset) {
-                    // We're not at the offset yet
-                    file_cursor += minix3_get_zone_size(block_device);
-                    continue;
-                } else if (file_cursor < offset) {
-                    // We're in the middle of the offset
-                    // Read the zone into the buffer
-                    minix3_get_zone(block_device, zone, zone_data);
-                    // Copy the remaining data into the buffer
-                    size_t remaining = min(count, minix3_get_zone_size(block_device) - (offset - file_cursor));
-                    memcpy(data, zone_data + offset - file_cursor, remaining);
-                    buffer_cursor += remaining;
-                    file_cursor = offset + remaining;
-                    continue;
-                }
-                
-                // Read the zone into the buffer
-                memset(zone_data, 0, minix3_get_zone_size(block_device));
-                minix3_get_zone(block_device, zone, zone_data);
+// Bring a run of physically contiguous zones into the buffer cache with as few
+// requests as possible, then copy out the part of it the caller asked for.
+static void minix3_read_zone_run(VirtioDevice *block_device, uint32_t first_zone, uint32_t first_index, uint32_t length,
+                                 uint8_t *data, uint32_t offset, uint32_t count) {
+    uint16_t zone_size = minix3_get_zone_size(block_device);
+    if (first_zone != 0) {
+        bcache_prefetch(block_device, first_zone, length, zone_size);
+    }
 
-                // If the cursor is past the amount of data we want, we're done
-                if (buffer_cursor + minix3_get_zone_size(block_device) > count) {
-                    // Copy the remaining data into the buffer
-                    memcpy(data + buffer_cursor, zone_data, count - buffer_cursor);
-                    // We're done
-                    return;
-                } else {
-                    // Copy the entire zone into the buffer
-                    memcpy(data + buffer_cursor, zone_data, minix3_get_zone_size(block_device));
-                }
-                buffer_cursor += minix3_get_zone_size(block_device);
-            }
+    for (uint32_t i=0; i<length; i++) {
+        uint64_t zone_start = (uint64_t)(first_index + i) * zone_size;
+        uint64_t zone_end = zone_start + zone_size;
+        // Only copy the overlap between this zone and [offset, offset + count)
+        uint64_t from = zone_start > offset ? zone_start : offset;
+        uint64_t to = zone_end < (uint64_t)offset + count ? zone_end : (uint64_t)offset + count;
+        if (from >= to) {
+            continue;
+        }
+        if (first_zone == 0) {
+            // A hole reads back as zeros
+            memset(data + (from - offset), 0, to - from);
+        } else {
+            bcache_read(block_device, first_zone + i, zone_size, from - zone_start, data + (from - offset), to - from);
         }
-    } else {
-        debugf("No double indirect zone\n");
     }
+}
 
-    // The next zone is a triple indirect zone
-    if (inode_data.zones[9] != 0) {
-        uint32_t triple_indirect_zones[minix3_get_zone_size(block_device) / sizeof(uint32_t)];
-        minix3_get_zone(block_device, inode_data.zones[9], (uint8_t*)triple_indirect_zones);
-
-        for (uint32_t triple_indirect_zone=0; triple_indirect_zone<minix3_get_zone_size(block_device) / sizeof(uint32_t); triple_indirect_zone++) {
-            uint32_t double_indirect_zone = triple_indirect_zones[triple_indirect_zone];
-            if (double_indirect_zone == 0) continue;
-            uint32_t double_indirect_zones[minix3_get_zone_size(block_device) / sizeof(uint32_t)];
-            minix3_get_zone(block_device, double_indirect_zone, (uint8_t*)double_indirect_zones);
-
-            for (uint32_t double_indirect_zone=0; double_indirect_zone<minix3_get_zone_size(block_device) / sizeof(uint32_t); double_indirect_zone++) {
-                uint32_t indirect_zone = double_indirect_zones[double_indirect_zone];
-                if (indirect_zone == 0) continue;
-                uint32_t indirect_zones[minix3_get_zone_size(block_device) / sizeof(uint32_t)];
-                minix3_get_zone(block_device, indirect_zone, (uint8_t*)indirect_zones);
+void minix3_get_data(VirtioDevice *block_device, uint32_t inode, uint8_t *data, uint32_t offset, uint32_t count) {
+    minix3_get_data_with_readahead(block_device, inode, data, offset, count, 0);
+}
 
-                for (uint32_t indirect_zone=0; indirect_zone<minix3_get_zone_size(block_device) / sizeof(uint32_t); indirect_zone++) {
-                    uint32_t zone = indirect_zones[indirect_zone];
-                    if (zone == 0) continue;
-                    debugf("Reading triple indirect zone %d\n", zone);
-                    
-                    if (file_cursor + minix3_get_zone_size(block_device) < offset) {
-                        // We're not at the offset yet
-                        file_cursor += minix3_get_zone_size(block_device);
-                        continue;
-                    } else if (file_cursor < offset) {
-                        // We're in the middle of the offset
-                        // Read the zone into the buffer
-                        minix3_get_zone(block_device, zone, zone_data);
-                        // Copy the remaining data into the buffer
-                        size_t remaining = min(count, minix3_get_zone_size(block_device) - (offset - file_cursor));
-                        memcpy(data, zone_data + offset - file_cursor, remaining);
-                        buffer_cursor += remaining;
-                        file_cursor = offset + remaining;
-                        continue;
-                    }
-                
-                    
-                    // Read the zone into the buffer
-                    memset(zone_data, 0, minix3_get_zone_size(block_device));
-                    minix3_get_zone(block_device, zone, zone_data);
+void minix3_get_data_with_readahead(VirtioDevice *block_device, uint32_t inode, uint8_t *data, uint32_t offset, uint32_t count, uint32_t readahead) {
+    debugf("minix3_get_data: Getting data from inode %u, offset %u, count %u\n", inode, offset, count);
+    if (count == 0) {
+        return;
+    }
+    Inode inode_data = minix3_get_inode(block_device, inode);
+    uint16_t zone_size = minix3_get_zone_size(block_device);
+
+    uint32_t first_index = offset / zone_size;
+    uint32_t end_index = (uint32_t)(((uint64_t)offset + count - 1) / zone_size) + 1;
+    // Read ahead of what was asked for, but not past the end of the file
+    uint32_t file_zones = (inode_data.size + zone_size - 1) / zone_size;
+    uint32_t fetch_end = end_index + readahead;
+    if (fetch_end > file_zones) {
+        fetch_end = file_zones > end_index ? file_zones : end_index;
+    }
 
-                    // If the cursor is past the amount of data we want, we're done
-                    if (buffer_cursor + minix3_get_zone_size(block_device) > count) {
-                        // Copy the remaining data into the buffer
-                        memcpy(data + buffer_cursor, zone_data, count - buffer_cursor);
-                        // We're done
-                        return;
-                    } else {
-                        // Copy the entire zone into the buffer
-                        memcpy(data + buffer_cursor, zone_data, minix3_get_zone_size(block_device));
-                    }
-                    buffer_cursor += minix3_get_zone_size(block_device);
-                }
-            }
+    uint32_t max_run = BCACHE_MAX_RUN_BYTES / zone_size;
+    uint32_t run_zone = 0, run_index = first_index, run_length = 0;
+    for (uint32_t index = first_index; index < fetch_end; index++) {
+        uint32_t zone = minix3_map_zone(block_device, &inode_data, index);
+        bool extends_run = run_length > 0 && run_length < max_run
+            && (zone == 0 ? run_zone == 0 : run_zone != 0 && zone == run_zone + run_length);
+        if (extends_run) {
+            run_length++;
+            continue;
         }
-    } else {
-        debugf("No triple indirect zone\n");
+        if (run_length > 0) {
+            minix3_read_zone_run(block_device, run_zone, run_index, run_length, data, offset, count);
+        }
+        run_zone = zone;
+        run_index = index;
+        run_length = 1;
+    }
+    if (run_length > 0) {
+        minix3_read_zone_run(block_device, run_zone, run_index, run_length, data, offset, count);
     }
-
-    // If we get here, we've read all the data we can
-    return;
 }
+
 void minix3_put_data(VirtioDevice *block_device, uint32_t inode, uint8_t *data, uint32_t offset, uint32_t count) {
     // First, get the inode
     Inode inode_data = minix3_get_inode(block_device, inode);
@@ -1211,6 +1414,8 @@ void minix3_put_dir_entry(VirtioDevice *block_device, uint32_t inode, uint32_t e
     debugf("Putting entry %u to inode %u\n", entry, inode);
 
     minix3_put_data(block_device, inode, (uint8_t*)&data, entry * sizeof(DirEntry), sizeof(DirEntry));
+    // Creating or linking a name changes what lookups in this directory return
+    minix3_dentry_invalidate_dir(block_device, inode);
 }
 
 
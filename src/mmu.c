@@ -43,6 +43,24 @@ static inline bool is_leaf(uint64_t pte)
     return (pte & 0xE) != 0;
 }
 
+// Replace a 1G or 2M leaf with a table of leaves one level down that map the
+// same memory with the same permissions.
+static bool mmu_split(uint64_t *entry, uint8_t lvl)
+{
+    PageTable *table = mmu_table_create();
+    if (table == NULL) {
+        return false;
+    }
+    uint64_t paddr = (*entry & ~0x3FFUL) << 2;
+    uint64_t bits = *entry & 0x3FF;
+    uint64_t step = PAGE_SIZE_AT_LVL(lvl) / 512;
+    for (uint64_t j = 0; j < (PAGE_SIZE / 8); j++) {
+        table->entries[j] = ((paddr + j * step) >> 2) | bits;
+    }
+    *entry = (uint64_t)table >> 2 | PB_VALID;
+    return true;
+}
+
 bool mmu_map(PageTable *tab, uint64_t vaddr, uint64_t paddr, uint8_t lvl, uint64_t bits)
 {
     if (tab == NULL || lvl > MMU_LEVEL_1G || (bits & 0xE) == 0) {
@@ -66,7 +84,14 @@ bool mmu_map(PageTable *tab, uint64_t vaddr, uint64_t paddr, uint8_t lvl, uint64
     for (i = MMU_LEVEL_1G; i > lvl; i--) {
         uint64_t pte = pt->entries[vpn[i]];
 
-        if (!is_valid(pte)) {
+        if (is_valid(pte) && is_leaf(pte)) {
+            // A huge page covers this address, so break it up before mapping inside it
+            debugf("mmu_map: entry %d in page table at 0x%08lx is a lvl %d leaf\n", vpn[i], pt, i);
+            if (!mmu_split(&pt->entries[vpn[i]], i)) {
+                debugf("mmu_map: could not split lvl %d leaf", i);
+                return false;
+            }
+        } else if (!is_valid(pte)) {
             debugf("mmu_map: entry %d in page table at 0x%08lx is invalid\n", vpn[i], pt);
             PageTable *new_pt = mmu_table_create();
             if (new_pt == NULL) {
@@ -90,6 +115,10 @@ bool mmu_map(PageTable *tab, uint64_t vaddr, uint64_t paddr, uint8_t lvl, uint64
                              ppn[0] << PTE_PPN0_BIT;
     
     debugf("mmu_map: ppn_leaf == 0x%x\n", (ppn_leaf << 2));
+    if (is_valid(pt->entries[vpn[i]]) && !is_leaf(pt->entries[vpn[i]])) {
+        // A huge page replaces everything that was mapped below it
+        mmu_free((PageTable *)((pt->entries[vpn[i]] & ~0x3FF) << 2));
+    }
     if (pt->entries[vpn[i]] != (ppn_leaf | bits | PB_VALID) && pt->entries[vpn[i]] != 0) {
         debugf("Warning: overwriting page table entry at 0x%08lx (was %p, now %p)\n", &pt->entries[vpn[i]], pt->entries[vpn[i]], ppn_leaf | bits | PB_VALID);
     }
@@ -101,6 +130,114 @@ bool mmu_map(PageTable *tab, uint64_t vaddr, uint64_t paddr, uint8_t lvl, uint64
     return true;
 }
 
+void mmu_link_kernel(PageTable *tab)
+{
+    if (kernel_mmu_table == NULL) {
+        // The MMU is off, so there is nothing to share
+        return;
+    }
+    for (uint64_t j = 0; j < (PAGE_SIZE / 8); j++) {
+        uint64_t entry = kernel_mmu_table->entries[j];
+        if (is_valid(entry) && (entry & PB_GLOBAL)) {
+            tab->entries[j] = entry;
+        }
+    }
+}
+
+uint64_t *mmu_find_leaf(PageTable *tab, uintptr_t vaddr)
+{
+    for (int lvl = MMU_LEVEL_1G; lvl >= MMU_LEVEL_4K; lvl--) {
+        uint64_t *entry = &tab->entries[(vaddr >> (ADDR_0_BIT + 9 * lvl)) & 0x1FF];
+        if (!is_valid(*entry)) {
+            return NULL;
+        } else if (is_leaf(*entry)) {
+            if (lvl != MMU_LEVEL_4K) {
+                debugf("mmu_find_leaf: 0x%08lx is inside a lvl %d page\n", vaddr, lvl);
+                return NULL;
+            }
+            return entry;
+        }
+        tab = (PageTable *)((*entry & ~0x3FF) << 2);
+    }
+    return NULL;
+}
+
+uintptr_t mmu_unmap(PageTable *tab, uintptr_t vaddr)
+{
+    uint64_t *entry = mmu_find_leaf(tab, vaddr);
+    if (entry == NULL) {
+        return MMU_TRANSLATE_PAGE_FAULT;
+    }
+    uint64_t paddr = (*entry & ~0x3FF) << 2;
+    *entry = 0;
+    return paddr;
+}
+
+// Share the user pages below one table, see mmu_share_user. `base` is the
+// first virtual address the table covers.
+static bool mmu_share_table(PageTable *dst, PageTable *src, uint64_t base, int lvl)
+{
+    for (uint64_t j = 0; j < (PAGE_SIZE / 8); j++) {
+        uint64_t *entry = &src->entries[j];
+        uint64_t vaddr = base + (j << (ADDR_0_BIT + 9 * lvl));
+        if (lvl == MMU_LEVEL_1G && j >= 256) {
+            // Sv39 addresses copy bit 38 into every bit above it
+            vaddr |= 0xFFFFFF8000000000UL;
+        }
+        if (!is_valid(*entry) || (*entry & PB_GLOBAL)) {
+            // The kernel's mappings are linked into `dst` already
+            continue;
+        } else if (is_leaf(*entry)) {
+            if (!(*entry & PB_USER)) {
+                continue;
+            }
+            if (lvl == MMU_LEVEL_4K || !(*entry & PB_WRITE)) {
+                if (*entry & PB_WRITE) {
+                    *entry = (*entry & ~PB_WRITE) | PB_COW;
+                }
+                if (!mmu_map(dst, vaddr, (*entry & ~0x3FF) << 2, lvl, *entry & 0x3FE)) {
+                    return false;
+                }
+                continue;
+            }
+            // Pages are copied one 4K page at a time
+            if (!mmu_split(entry, lvl)) {
+                return false;
+            }
+        }
+        if (lvl > MMU_LEVEL_4K && !mmu_share_table(dst, (PageTable *)((*entry & ~0x3FF) << 2), vaddr, lvl - 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool mmu_share_user(PageTable *dst, PageTable *src)
+{
+    return mmu_share_table(dst, src, 0, MMU_LEVEL_1G);
+}
+
+static void mmu_unmap_user_table(PageTable *tab, int lvl)
+{
+    for (uint64_t j = 0; j < (PAGE_SIZE / 8); j++) {
+        uint64_t entry = tab->entries[j];
+        if (!is_valid(entry) || (entry & PB_GLOBAL)) {
+            continue;
+        } else if (is_leaf(entry)) {
+            if (entry & PB_USER) {
+                tab->entries[j] = 0;
+            }
+        } else if (lvl > MMU_LEVEL_4K) {
+            mmu_unmap_user_table((PageTable *)((entry & ~0x3FF) << 2), lvl - 1);
+        }
+    }
+}
+
+void mmu_unmap_user(PageTable *tab)
+{
+    mmu_unmap_user_table(tab, MMU_LEVEL_1G);
+}
+
 void mmu_free(PageTable *tab) 
 { 
     uint64_t entry; 
@@ -112,75 +249,111 @@ void mmu_free(PageTable *tab)
 
     for (i = 0; i < (PAGE_SIZE / 8); i++) { 
         entry = tab->entries[i]; 
-        if (entry & PB_VALID) {
+        // Leaves (of any size) point at memory owned by whoever mapped it,
+        // and global tables belong to the kernel (see mmu_link_kernel)
+        if (is_valid(entry) && !is_leaf(entry) && !(entry & PB_GLOBAL)) {
             mmu_free((PageTable *)((entry & ~0x3FF) << 2)); // Recurse into the next level
         }
         tab->entries[i] = 0; 
     } 
 
     page_free(tab); 
-    SFENCE_ALL();
 }
 
 uint64_t mmu_translate(const PageTable *tab, uint64_t vaddr) 
 { 
+#ifdef MMU_DEBUG
+    mmu_translate_debug(tab, vaddr);
+#endif
+    return mmu_translate_fast(tab, vaddr);
+}
 
-    debugf("mmu_translate: page table at 0x%016lx\n", tab);
-    debugf("mmu_translate: vaddr == 0x%016lx\n", vaddr);
-
-    if (tab == NULL) { 
-        debugf("mmu_translate: tab == NULL\n");
-        return MMU_TRANSLATE_PAGE_FAULT; 
-    } 
+void mmu_translate_debug(const PageTable *tab, uint64_t vaddr)
+{
+    infof("mmu_translate_debug: page table at 0x%016lx, vaddr == 0x%016lx\n", tab, vaddr);
+    if (tab == NULL) {
+        infof("mmu_translate_debug: tab == NULL\n");
+        return;
+    }
 
-    // Extract the virtual page numbers
-    uint64_t vpn[] = {(vaddr >> ADDR_0_BIT) & 0x1FF, 
-                      (vaddr >> ADDR_1_BIT) & 0x1FF, 
-                      (vaddr >> ADDR_2_BIT) & 0x1FF};
-    debugf("mmu_translate: vpn[0] == 0x%03lx\n", vpn[0]);
-    debugf("mmu_translate: vpn[1] == 0x%03lx\n", vpn[1]);
-    debugf("mmu_translate: vpn[2] == 0x%03lx\n", vpn[2]);
-
-    uint64_t lvl = MMU_LEVEL_1G;
-    // Traverse the page table hierarchy using the virtual page numbers
-    for (uint64_t i = MMU_LEVEL_1G; i >= MMU_LEVEL_4K; i--) {
-        // Iterate through and print the page table entries
-        debugf("mmu_translate: tab->entries == 0x%08lx\n", tab->entries);
+    for (int lvl = MMU_LEVEL_1G; lvl >= MMU_LEVEL_4K; lvl--) {
+        uint64_t vpn = (vaddr >> (ADDR_0_BIT + 9 * lvl)) & 0x1FF;
+        infof("mmu_translate_debug: level %d table at 0x%016lx, vpn == 0x%03lx\n", lvl, tab, vpn);
+        // Dump every valid entry at this level
         for (uint64_t j = 0; j < (PAGE_SIZE / 8); j++) {
             if (tab->entries[j] & PB_VALID) {
-                debugf("mmu_translate: tab->entries[%x] == 0x%0lx\n", j, tab->entries[j]);
+                infof("mmu_translate_debug:   entries[%x] == 0x%0lx\n", j, tab->entries[j]);
             }
         }
 
-        if (!(tab->entries[vpn[i]] & PB_VALID)) {
-            debugf("mmu_translate: entry %x in page table at 0x%08lx is invalid\n", vpn[i], tab);
-            return MMU_TRANSLATE_PAGE_FAULT; // Entry is not valid
-        } else if (!is_leaf(tab->entries[vpn[i]])) {
-            debugf("mmu_translate: entry %x in page table at 0x%08lx is a branch to 0x%08lx\n", vpn[i], tab, (tab->entries[vpn[i]] & ~0x3FF) << 2);
-            tab = (PageTable *)((tab->entries[vpn[i]] & ~0x3FF) << 2);
-        } else {
-            debugf("mmu_translate: entry %x in page table at 0x%08lx is a leaf\n", vpn[i], tab);
-            lvl = i;
-            break; // Entry is a leaf
+        uint64_t pte = tab->entries[vpn];
+        if (!is_valid(pte)) {
+            infof("mmu_translate_debug: entry %x is invalid\n", vpn);
+            return;
+        } else if (is_leaf(pte)) {
+            uint64_t page_mask = PAGE_SIZE_AT_LVL(lvl) - 1;
+            infof("mmu_translate_debug: entry %x is a leaf, paddr == 0x%016lx\n", vpn, (((pte & ~0x3FF) << 2) & ~page_mask) | (vaddr & page_mask));
+            return;
         }
+        infof("mmu_translate_debug: entry %x is a branch to 0x%016lx\n", vpn, (pte & ~0x3FF) << 2);
+        tab = (const PageTable *)((pte & ~0x3FF) << 2);
     }
+}
 
-    debugf("mmu_translate: vaddr == 0x%08lx\n", vaddr);
+uint64_t kernel_mmu_translate(uint64_t vaddr) 
+{ 
+    return kernel_mmu_translate_fast(vaddr); 
+}
 
-    uint64_t page_mask = PAGE_SIZE_AT_LVL(lvl) - 1;
-    
-    // Extract the physical address from the final page table entry
-    uint64_t paddr = ((tab->entries[vpn[lvl]] & ~0x3FF) << 2) & ~page_mask;
+void mmu_cursor_init(MmuCursor *cursor, const PageTable *tab)
+{
+    cursor->root = tab;
+    for (int i = 0; i < MMU_LEVEL_1G; i++) {
+        cursor->tables[i] = NULL;
+        cursor->bases[i] = 0;
+    }
+}
 
-    uint64_t result = paddr | (vaddr & page_mask);
-    debugf("mmu_translate: paddr == 0x%08lx\n", result);
+uint64_t mmu_cursor_translate(MmuCursor *cursor, uint64_t vaddr, uint64_t *bits)
+{
+    if (cursor->root == NULL) {
+        return MMU_TRANSLATE_PAGE_FAULT;
+    }
 
-    return result; // Combine with the offset within the page
-}
+    // Start from the deepest table we already walked through for this range
+    const PageTable *tab = cursor->root;
+    int lvl = MMU_LEVEL_1G;
+    for (int i = MMU_LEVEL_4K; i < MMU_LEVEL_1G; i++) {
+        if (cursor->tables[i] != NULL
+            && ALIGN_DOWN_POT(vaddr, (uint64_t)PAGE_SIZE_AT_LVL(i + 1)) == cursor->bases[i]) {
+            tab = cursor->tables[i];
+            lvl = i;
+            break;
+        }
+    }
 
-uint64_t kernel_mmu_translate(uint64_t vaddr) 
-{ 
-    return mmu_translate(kernel_mmu_table, vaddr); 
+    const uint64_t vpn[] = {(vaddr >> ADDR_0_BIT) & 0x1FF, 
+                            (vaddr >> ADDR_1_BIT) & 0x1FF, 
+                            (vaddr >> ADDR_2_BIT) & 0x1FF};
+    while (true) {
+        uint64_t pte = tab->entries[vpn[lvl]];
+        if (!is_valid(pte)) {
+            return MMU_TRANSLATE_PAGE_FAULT;
+        } else if (is_leaf(pte)) {
+            if (bits != NULL) {
+                *bits = pte & 0x3FF;
+            }
+            uint64_t page_mask = PAGE_SIZE_AT_LVL(lvl) - 1;
+            return (((pte & ~0x3FF) << 2) & ~page_mask) | (vaddr & page_mask);
+        } else if (lvl == MMU_LEVEL_4K) {
+            // A branch at the last level is malformed
+            return MMU_TRANSLATE_PAGE_FAULT;
+        }
+        tab = (const PageTable *)((pte & ~0x3FF) << 2);
+        lvl--;
+        cursor->tables[lvl] = tab;
+        cursor->bases[lvl] = ALIGN_DOWN_POT(vaddr, (uint64_t)PAGE_SIZE_AT_LVL(lvl + 1));
+    }
 }
 
 uint64_t mmu_map_range(PageTable *tab, 
@@ -194,19 +367,28 @@ uint64_t mmu_map_range(PageTable *tab,
     start_virt            = ALIGN_DOWN_POT(start_virt, PAGE_SIZE_AT_LVL(lvl));
     start_phys            = ALIGN_DOWN_POT(start_phys, PAGE_SIZE_AT_LVL(lvl));
     end_virt              = ALIGN_UP_POT(end_virt, PAGE_SIZE_AT_LVL(lvl));
-    infof("mmu_map_range: start_phys = 0x%08lx\n", start_phys);
-    infof("mmu_map_range: start_virt = 0x%08lx\n", start_virt);
-    infof("mmu_map_range: end_virt   = 0x%08lx\n", end_virt);
+    debugf("mmu_map_range: start_phys = 0x%08lx\n", start_phys);
+    debugf("mmu_map_range: start_virt = 0x%08lx\n", start_virt);
+    debugf("mmu_map_range: end_virt   = 0x%08lx\n", end_virt);
     
     uint64_t num_bytes    = end_virt - start_virt;
-    infof("mmu_map_range: mapping = 0x%lx bytes\n", num_bytes);
+    debugf("mmu_map_range: mapping = 0x%lx bytes\n", num_bytes);
     uint64_t pages_mapped = 0;
 
     uint64_t i;
     for (i = 0; i < num_bytes; i += PAGE_SIZE_AT_LVL(lvl)) {
+        // Use the biggest page that both addresses are aligned to and that
+        // does not run past the end, so large regions need few entries
+        for (lvl = MMU_LEVEL_1G; lvl > MMU_LEVEL_4K; lvl--) {
+            uint64_t page_mask = PAGE_SIZE_AT_LVL(lvl) - 1;
+            if (((start_virt + i) & page_mask) == 0 && ((start_phys + i) & page_mask) == 0
+                && num_bytes - i >= (uint64_t)PAGE_SIZE_AT_LVL(lvl)) {
+                break;
+            }
+        }
         // infof("mmu_map_range: mapping %d bytes for page %d\n", PAGE_SIZE_AT_LVL(lvl), i / PAGE_SIZE_AT_LVL(lvl));
         if (!mmu_map(tab, start_virt + i, start_phys + i, lvl, bits)) {
-            debugf("mmu_map_range: failed to map page %d\n", i / PAGE_SIZE_AT_LVL(lvl));
+            debugf("mmu_map_range: failed to map page %d\n", pages_mapped);
             break;
         }
         pages_mapped += 1;
@@ -216,7 +398,6 @@ uint64_t mmu_map_range(PageTable *tab,
         return 0;
     }
     debugf("mmu_map_range: mapped %d pages\n", pages_mapped);
-    SFENCE_ALL();
     return pages_mapped;
 } 
 
@@ -6,6 +6,9 @@
 #include <symbols.h>
 #include <debug.h>
 #include <mmu.h>
+#include <config.h>
+#include <csr.h>
+#include <sbi.h>
 
 // #define PAGE_DEBUG
 #ifdef PAGE_DEBUG
@@ -17,40 +20,138 @@
 // Do NOT hold the lock any longer than you have to!
 Mutex page_lock;
 
-// Bookkeeping calculation
-// #define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((a) - 1))
+/*
+ * Pages are handed out by a binary buddy allocator. Free memory is kept as
+ * blocks of 2^order pages on one list per order, and a freed block merges
+ * with its buddy (the other half of the block it was split from) whenever
+ * that buddy is free too.
+ *
+ * The bookkeeping area at the start of the heap holds, for every page:
+ *   - alloc_count: on the first page of an allocation, how many pages it has
+ *   - free_order:  on the first page of a free block, the block's order
+ *   - share_count: on the first page of an allocation, how many owners it
+ *                  has besides the one that allocated it (see page_ref)
+ *
+ * Single pages are the bulk of the traffic (page tables, trap frames), so
+ * each hart keeps a magazine of free single pages in front of the buddy
+ * allocator. A hart only touches its own magazine, with interrupts off, and
+ * takes `page_lock` once per batch when the magazine runs empty or full.
+ * Pages sitting in a magazine are free for page_free's purposes
+ * (alloc_count is 0) but are not on any buddy free list, and the buddy
+ * allocator still counts them as taken.
+ *
+ * Zeroed single pages wait in `zero_pool` the same way. The idle process
+ * clears them one at a time (page_zero_pool_refill), so page_zalloc usually
+ * hands out a page without touching it. When memory runs out, the pool is
+ * given back to the buddy allocator before an allocation fails.
+ */
+
+// Enough for 2^PAGE_MAX_ORDER pages (4 TiB), far more than any heap we get
+#define PAGE_MAX_ORDER   30
+#define PAGE_NOT_FREE    0xFF
+
+typedef struct FreeBlock {
+    struct FreeBlock *next;
+    struct FreeBlock *prev;
+} FreeBlock;
 
 static uint8_t *bookkeeping;  // Pointer to the bookkeeping area
+static uint32_t *alloc_count;
+static uint32_t *share_count;
+static uint8_t *free_order;
+static FreeBlock *free_lists[PAGE_MAX_ORDER + 1];
 
-// For some reason, the macros didn't work for me, so I used the static functions like Marz said and it works.
-static void set_taken(uint64_t index)
-{
-    bookkeeping[index / 4] |= (1 << ((index % 4) * 2));
+// The first page the buddy allocator manages, and how many follow it.
+// Buddies are found relative to `first_page`, so blocks are aligned to it.
+static uint64_t first_page;
+static uint64_t num_pages;
+
+// Kept separately so they can be checked against each other
+static uint64_t free_pages;
+static uint64_t taken_pages;
+
+typedef struct PageMagazine {
+    uint64_t count;
+    uint64_t pages[PAGE_MAGAZINE_SIZE];
+    PageCacheStats stats;
+} PageMagazine;
+
+static PageMagazine magazines[MAX_ALLOWABLE_HARTS];
+
+// Taken before page_lock when both are needed
+static Mutex zero_lock = MUTEX_UNLOCKED;
+static uint64_t zero_pool[PAGE_ZERO_POOL_SIZE];
+static uint64_t zero_count;
+
+uint64_t page_to_index(void *page) {
+    return ((uint64_t)page - (uint64_t)bookkeeping) / PAGE_SIZE;
 }
 
-static void clear_taken(uint64_t index)
-{
-    bookkeeping[index / 4] &= ~(1 << ((index % 4) * 2));
+void *index_to_page(uint64_t idx) {
+    return (void*)(idx * PAGE_SIZE + (uint64_t)bookkeeping);
 }
 
-static int is_taken(uint64_t index)
+static void free_list_push(uint64_t index, uint8_t order)
 {
-    return bookkeeping[index / 4] & (1 << ((index % 4) * 2));
+    FreeBlock *block = (FreeBlock *)index_to_page(index);
+    block->prev = NULL;
+    block->next = free_lists[order];
+    if (block->next != NULL) {
+        block->next->prev = block;
+    }
+    free_lists[order] = block;
+    free_order[index] = order;
 }
 
-static void set_last(uint64_t index)
+static void free_list_remove(uint64_t index)
 {
-    bookkeeping[index / 4] |= (1 << ((index % 4) * 2 + 1));
+    FreeBlock *block = (FreeBlock *)index_to_page(index);
+    uint8_t order = free_order[index];
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        free_lists[order] = block->next;
+    }
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    }
+    free_order[index] = PAGE_NOT_FREE;
 }
 
-static void clear_last(uint64_t index)
+// Free a block of 2^order pages, merging it with its buddies as far as possible.
+// Must be called with the lock held.
+static void buddy_free(uint64_t index, uint8_t order)
 {
-    bookkeeping[index / 4] &= ~(1 << ((index % 4) * 2 + 1));
+    free_pages += 1UL << order;
+    while (order < PAGE_MAX_ORDER) {
+        uint64_t buddy = first_page + ((index - first_page) ^ (1UL << order));
+        if (buddy + (1UL << order) > first_page + num_pages || free_order[buddy] != order) {
+            break;
+        }
+        free_list_remove(buddy);
+        if (buddy < index) {
+            index = buddy;
+        }
+        order++;
+    }
+    free_list_push(index, order);
 }
 
-static int is_last(uint64_t index)
+// Free an arbitrary run of pages as the largest aligned blocks that fit.
+// Must be called with the lock held.
+static void buddy_free_range(uint64_t index, uint64_t count)
 {
-    return bookkeeping[index / 4] & (1 << ((index % 4) * 2 + 1));
+    uint64_t end = index + count;
+    while (index < end) {
+        uint8_t order = 0;
+        while (order < PAGE_MAX_ORDER
+               && ((index - first_page) & ((2UL << order) - 1)) == 0
+               && index + (2UL << order) <= end) {
+            order++;
+        }
+        buddy_free(index, order);
+        index += 1UL << order;
+    }
 }
 
 void page_init(void)
@@ -63,11 +164,21 @@ void page_init(void)
 
     // Initialize the bookkeeping area
     memset(bookkeeping, 0, BK_SIZE_IN_BYTES);
-    // Mark the bookkeeping pages as taken
-    for (uint64_t i = 0; i < BK_SIZE_IN_PAGES; i++) {
-        set_taken(i);
+    alloc_count = (uint32_t *)bookkeeping;
+    share_count = alloc_count + HEAP_SIZE_IN_PAGES;
+    free_order = (uint8_t *)(share_count + HEAP_SIZE_IN_PAGES);
+    memset(free_order, PAGE_NOT_FREE, HEAP_SIZE_IN_PAGES);
+    for (int i = 0; i <= PAGE_MAX_ORDER; i++) {
+        free_lists[i] = NULL;
     }
-    set_last(BK_SIZE_IN_PAGES-1);
+
+    // The bookkeeping pages are taken, everything after them is free
+    alloc_count[0] = BK_SIZE_IN_PAGES;
+    taken_pages = BK_SIZE_IN_PAGES;
+    free_pages = 0;
+    first_page = BK_SIZE_IN_PAGES;
+    num_pages = HEAP_SIZE_IN_PAGES - BK_SIZE_IN_PAGES;
+    buddy_free_range(first_page, num_pages);
 
     debugf("page_init: bookkeeping area initialized\n");
     debugf("page_init: bookkeeping area starts at 0x%08lx\n", bookkeeping);
@@ -81,107 +192,223 @@ void page_init(void)
     logf(LOG_INFO, "  Bookkeeping size: 0x%lx bytes, %lu pages\n", BK_SIZE_IN_BYTES, BK_SIZE_IN_PAGES);
     logf(LOG_INFO, "  Taken pages: %lu\n", page_count_taken());
     logf(LOG_INFO, "  Free pages: %lu\n", page_count_free());
-    
-    // This code tests the page allocator
-    // void *a = page_nalloc(1);
-
-    // logf(LOG_INFO, "Page Init: 0x%08lx -> 0x%08lx\n", bookkeeping, bookkeeping + BK_SIZE_IN_BYTES);
-    // logf(LOG_INFO, "  Heap size: 0x%lx bytes, %lu pages\n", HEAP_SIZE_IN_BYTES, HEAP_SIZE_IN_PAGES);
-    // logf(LOG_INFO, "  Bookkeeping size: 0x%lx bytes, %lu pages\n", BK_SIZE_IN_BYTES, BK_SIZE_IN_PAGES);
-    // logf(LOG_INFO, "  Taken pages: %lu\n", page_count_taken());
-    // logf(LOG_INFO, "  Free pages: %lu\n", page_count_free());
-
-    // void *b = page_nalloc(2);
-
-    // logf(LOG_INFO, "Page Init: 0x%08lx -> 0x%08lx\n", bookkeeping, bookkeeping + BK_SIZE_IN_BYTES);
-    // logf(LOG_INFO, "  Heap size: 0x%lx bytes, %lu pages\n", HEAP_SIZE_IN_BYTES, HEAP_SIZE_IN_PAGES);
-    // logf(LOG_INFO, "  Bookkeeping size: 0x%lx bytes, %lu pages\n", BK_SIZE_IN_BYTES, BK_SIZE_IN_PAGES);
-    // logf(LOG_INFO, "  Taken pages: %lu\n", page_count_taken());
-    // logf(LOG_INFO, "  Free pages: %lu\n", page_count_free());
-
-    // void *c = page_nalloc(4);
-
-    // logf(LOG_INFO, "Page Init: 0x%08lx -> 0x%08lx\n", bookkeeping, bookkeeping + BK_SIZE_IN_BYTES);
-    // logf(LOG_INFO, "  Heap size: 0x%lx bytes, %lu pages\n", HEAP_SIZE_IN_BYTES, HEAP_SIZE_IN_PAGES);
-    // logf(LOG_INFO, "  Bookkeeping size: 0x%lx bytes, %lu pages\n", BK_SIZE_IN_BYTES, BK_SIZE_IN_PAGES);
-    // logf(LOG_INFO, "  Taken pages: %lu\n", page_count_taken());
-    // logf(LOG_INFO, "  Free pages: %lu\n", page_count_free());
-
-    // page_free(a);
-
-    // logf(LOG_INFO, "Page Init: 0x%08lx -> 0x%08lx\n", bookkeeping, bookkeeping + BK_SIZE_IN_BYTES);
-    // logf(LOG_INFO, "  Heap size: 0x%lx bytes, %lu pages\n", HEAP_SIZE_IN_BYTES, HEAP_SIZE_IN_PAGES);
-    // logf(LOG_INFO, "  Bookkeeping size: 0x%lx bytes, %lu pages\n", BK_SIZE_IN_BYTES, BK_SIZE_IN_PAGES);
-    // logf(LOG_INFO, "  Taken pages: %lu\n", page_count_taken());
-    // logf(LOG_INFO, "  Free pages: %lu\n", page_count_free());
-
-    // page_free(b);
-
-    // logf(LOG_INFO, "Page Init: 0x%08lx -> 0x%08lx\n", bookkeeping, bookkeeping + BK_SIZE_IN_BYTES);
-    // logf(LOG_INFO, "  Heap size: 0x%lx bytes, %lu pages\n", HEAP_SIZE_IN_BYTES, HEAP_SIZE_IN_PAGES);
-    // logf(LOG_INFO, "  Bookkeeping size: 0x%lx bytes, %lu pages\n", BK_SIZE_IN_BYTES, BK_SIZE_IN_PAGES);
-    // logf(LOG_INFO, "  Taken pages: %lu\n", page_count_taken());
-    // logf(LOG_INFO, "  Free pages: %lu\n", page_count_free());
-
-    // page_free(c);
-
-    // logf(LOG_INFO, "Page Init: 0x%08lx -> 0x%08lx\n", bookkeeping, bookkeeping + BK_SIZE_IN_BYTES);
-    // logf(LOG_INFO, "  Heap size: 0x%lx bytes, %lu pages\n", HEAP_SIZE_IN_BYTES, HEAP_SIZE_IN_PAGES);
-    // logf(LOG_INFO, "  Bookkeeping size: 0x%lx bytes, %lu pages\n", BK_SIZE_IN_BYTES, BK_SIZE_IN_PAGES);
-    // logf(LOG_INFO, "  Taken pages: %lu\n", page_count_taken());
-    // logf(LOG_INFO, "  Free pages: %lu\n", page_count_free());
 }
 
 
-void *page_nalloc(uint64_t n)
+// Allocate n contiguous pages and return the index of the first one, or 0 if
+// there is no block big enough. Must be called with the lock held.
+static uint64_t buddy_alloc(uint64_t n)
 {
-    if (n <= 0) {
-        return NULL;
+    // The smallest block that holds n pages
+    uint8_t order = 0;
+    while ((1UL << order) < n) {
+        order++;
     }
 
-    mutex_spinlock(&page_lock);
+    // Take a block from the smallest list that has one
+    uint8_t found = order;
+    while (found <= PAGE_MAX_ORDER && free_lists[found] == NULL) {
+        found++;
+    }
+    if (found > PAGE_MAX_ORDER) {
+        debugf("buddy_alloc: no block of %lu pages left\n", n);
+        return 0;
+    }
+    uint64_t index = page_to_index(free_lists[found]);
+    free_list_remove(index);
+    free_pages -= 1UL << found;
+
+    // Split it down, putting the upper halves back on the free lists
+    while (found > order) {
+        found--;
+        free_list_push(index + (1UL << found), found);
+        free_pages += 1UL << found;
+    }
 
-    uint64_t start = 0;
-    uint64_t consecutive = 0;
+    // Give back the pages past n, so odd sizes don't waste up to half the block
+    if (n < (1UL << order)) {
+        buddy_free_range(index + n, (1UL << order) - n);
+    }
+    taken_pages += n;
+    return index;
+}
 
-    for (uint64_t i = 0; i < HEAP_SIZE_IN_PAGES; i++) {
-        if (!is_taken(i) && !is_last(i)) {
-            if (consecutive == 0) {
-                start = i;
-            }
+// Get the calling hart's magazine, or NULL if it has none
+static PageMagazine *page_magazine(void)
+{
+    int hart = hart_id();
+    if (hart < 0 || hart >= MAX_ALLOWABLE_HARTS) {
+        return NULL;
+    }
+    return &magazines[hart];
+}
 
-            consecutive++;
-
-            if (consecutive >= n) {
-                // debugf("page_nalloc: found %d consecutive pages starting at 0x%08lx\n", n, start);
-                for (int j = 0; j < n; j++) {
-                    // debugf("page_nalloc: marking page 0x%08lx as taken\n", start + j);
-                    set_taken(start + j);
-                    if (j == n - 1) {
-                        set_last(start + j);
-                    }
-                }
-                // debugf("page_nalloc: marking page 0x%08lx as last\n", start + n - 1);
-
-                mutex_unlock(&page_lock);
-                // debugf("Found free %d pages at #%d, %d\n", n, start, i);
-                void *result = (void*)((uint64_t)bookkeeping + ((uint64_t)start * PAGE_SIZE));
-
-                debugf("Found %d free pages at %p\n", n, result);
-                // Print remaining pages
-                uint64_t remaining = page_count_free();
-                debugf("Remaining pages: %lu\n", remaining);
-
-                return result;
+// Take a single page from this hart's magazine, refilling it from the
+// buddy allocator in one batch if it is empty. Returns 0 if memory is out.
+static uint64_t page_magazine_alloc(PageMagazine *mag)
+{
+    uint64_t sstatus;
+    CSR_READ(sstatus, "sstatus");
+    IRQ_OFF();
+
+    if (mag->count == 0) {
+        mutex_spinlock(&page_lock);
+        while (mag->count < PAGE_MAGAZINE_BATCH) {
+            uint64_t index = buddy_alloc(1);
+            if (index == 0) {
+                break;
             }
-        } else {
-            // debugf("page_nalloc: page 0x%08lx is taken\n", i);
-            consecutive = 0;
+            mag->pages[mag->count++] = index;
         }
+        mutex_unlock(&page_lock);
+        mag->stats.refills++;
+    } else {
+        mag->stats.hits++;
     }
 
-    mutex_unlock(&page_lock);
-    return NULL;
+    uint64_t index = 0;
+    if (mag->count > 0) {
+        index = mag->pages[--mag->count];
+        alloc_count[index] = 1;
+    }
+
+    if (sstatus & SSTATUS_SIE) IRQ_ON();
+    return index;
+}
+
+// Put a single page in this hart's magazine, giving a batch back to the
+// buddy allocator first if the magazine is full.
+static void page_magazine_free(PageMagazine *mag, uint64_t index)
+{
+    uint64_t sstatus;
+    CSR_READ(sstatus, "sstatus");
+    IRQ_OFF();
+
+    if (mag->count == PAGE_MAGAZINE_SIZE) {
+        mutex_spinlock(&page_lock);
+        for (uint64_t i = 0; i < PAGE_MAGAZINE_BATCH; i++) {
+            buddy_free(mag->pages[--mag->count], 0);
+        }
+        taken_pages -= PAGE_MAGAZINE_BATCH;
+        mutex_unlock(&page_lock);
+        mag->stats.drains++;
+    }
+    mag->pages[mag->count++] = index;
+
+    if (sstatus & SSTATUS_SIE) IRQ_ON();
+}
+
+// Allocate n pages from this hart's magazine or the buddy allocator.
+// Returns 0 if memory is out.
+static uint64_t page_alloc_index(uint64_t n)
+{
+    uint64_t index = 0;
+    PageMagazine *mag = n == 1 ? page_magazine() : NULL;
+    if (mag != NULL) {
+        index = page_magazine_alloc(mag);
+    } else {
+        mutex_spinlock(&page_lock);
+        index = buddy_alloc(n);
+        if (index != 0) {
+            alloc_count[index] = n;
+        }
+        mutex_unlock(&page_lock);
+    }
+    return index;
+}
+
+// Take a zeroed page out of the pool. Returns 0 if it is empty.
+static uint64_t page_zero_pool_take(void)
+{
+    uint64_t sstatus;
+    CSR_READ(sstatus, "sstatus");
+    IRQ_OFF();
+
+    uint64_t index = 0;
+    mutex_spinlock(&zero_lock);
+    if (zero_count > 0) {
+        index = zero_pool[--zero_count];
+    }
+    mutex_unlock(&zero_lock);
+
+    if (sstatus & SSTATUS_SIE) IRQ_ON();
+    return index;
+}
+
+// Give every page in the zero pool back to the buddy allocator and
+// return how many there were.
+static uint64_t page_zero_pool_drain(void)
+{
+    uint64_t sstatus;
+    CSR_READ(sstatus, "sstatus");
+    IRQ_OFF();
+
+    mutex_spinlock(&zero_lock);
+    uint64_t n = zero_count;
+    if (n > 0) {
+        mutex_spinlock(&page_lock);
+        while (zero_count > 0) {
+            buddy_free(zero_pool[--zero_count], 0);
+        }
+        taken_pages -= n;
+        mutex_unlock(&page_lock);
+    }
+    mutex_unlock(&zero_lock);
+
+    if (sstatus & SSTATUS_SIE) IRQ_ON();
+    return n;
+}
+
+bool page_zero_pool_refill(void)
+{
+    if (__atomic_load_n(&zero_count, __ATOMIC_RELAXED) >= PAGE_ZERO_POOL_SIZE
+        || page_count_free() < __atomic_load_n(&zero_count, __ATOMIC_RELAXED) + PAGE_ZERO_POOL_MIN_FREE) {
+        return false;
+    }
+    // Not page_nalloc, which would empty the pool again when memory is out
+    uint64_t index = page_alloc_index(1);
+    if (index == 0) {
+        return false;
+    }
+    // The slow part, done with interrupts on so the idle process stays preemptible
+    memset(index_to_page(index), 0, PAGE_SIZE);
+
+    uint64_t sstatus;
+    CSR_READ(sstatus, "sstatus");
+    IRQ_OFF();
+    mutex_spinlock(&zero_lock);
+    bool added = zero_count < PAGE_ZERO_POOL_SIZE;
+    if (added) {
+        alloc_count[index] = 0;
+        zero_pool[zero_count++] = index;
+    }
+    mutex_unlock(&zero_lock);
+    if (sstatus & SSTATUS_SIE) IRQ_ON();
+
+    if (!added) {
+        page_free(index_to_page(index));
+    }
+    return added;
+}
+
+void *page_nalloc(uint64_t n)
+{
+    if (n <= 0 || n > num_pages) {
+        return NULL;
+    }
+
+    uint64_t index = page_alloc_index(n);
+    if (index == 0 && page_zero_pool_drain() > 0) {
+        // The zeroed pages were the last free memory
+        index = page_alloc_index(n);
+    }
+    if (index == 0) {
+        return NULL;
+    }
+
+    void *result = index_to_page(index);
+    debugf("Found %d free pages at %p\n", n, result);
+    return result;
 }
 
 void *page_znalloc(uint64_t n)
@@ -190,6 +417,13 @@ void *page_znalloc(uint64_t n)
         return NULL;
     }
     
+    if (n == 1) {
+        uint64_t index = page_zero_pool_take();
+        if (index != 0) {
+            alloc_count[index] = 1;
+            return index_to_page(index);
+        }
+    }
     void *mem = page_nalloc(n);
     if (mem) {
         // debugf("page_znalloc: zeroing out %d pages starting at 0x%08lx\n", n, mem);
@@ -198,85 +432,125 @@ void *page_znalloc(uint64_t n)
     return mem;
 }
 
-uint64_t page_to_index(void *page) {
-    return ((uint64_t)page - (uint64_t)bookkeeping) / PAGE_SIZE;
-}
-
-void *index_to_page(uint64_t idx) {
-    return (void*)(idx * PAGE_SIZE + (uint64_t)bookkeeping);
-}
-
 void page_free(void *p)
 {
     if (p == NULL) {
         return;
     }
     /* Free the page */
-    // uint64_t x = ((uint64_t)p - (uint64_t)bookkeeping) / PAGE_SIZE;
     uint64_t x = page_to_index(p);
     // debugf("page_free: freeing page %lu at address 0x%p\n", x, p);
+    if (x < first_page || x >= first_page + num_pages) {
+        debugf("page_free: %p is not a heap page\n", p);
+        return;
+    }
 
-    mutex_spinlock(&page_lock);
-
-
-    if (!is_taken(x)) {
+    // Only the owner of an allocation clears its count, so this is safe to read unlocked
+    uint64_t n = alloc_count[x];
+    if (n == 0) {
         // logf(LOG_ERROR, "page_free: page 0x%08lx is already free!\n", x);
-        mutex_unlock(&page_lock);
         return;
     }
-
-    // Clear all the pages starting at the index until the last page
-    while (is_taken(x) && !is_last(x)) {
-        clear_taken(x);
-        x++;
+    // A shared page only loses an owner. The count is only ever 0 again once
+    // no one else can see the page, so the free below cannot race with it.
+    uint32_t shared = __atomic_load_n(&share_count[x], __ATOMIC_ACQUIRE);
+    while (shared > 0) {
+        if (__atomic_compare_exchange_n(&share_count[x], &shared, shared - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return;
+        }
     }
-    clear_taken(x);
-    clear_last(x);
+    alloc_count[x] = 0;
 
+    PageMagazine *mag = n == 1 ? page_magazine() : NULL;
+    if (mag != NULL) {
+        page_magazine_free(mag, x);
+        return;
+    }
 
+    mutex_spinlock(&page_lock);
+    taken_pages -= n;
+    buddy_free_range(x, n);
     mutex_unlock(&page_lock);
 }
 
-uint64_t page_count_free(void)
+void page_ref(void *p)
 {
-    uint64_t ret = 0;
+    uint64_t x = page_to_index(p);
+    if (p == NULL || x < first_page || x >= first_page + num_pages || alloc_count[x] == 0) {
+        debugf("page_ref: %p is not an allocated page\n", p);
+        return;
+    }
+    __atomic_fetch_add(&share_count[x], 1, __ATOMIC_ACQ_REL);
+}
 
-    /* Count free pages in the bookkeeping area */
+bool page_is_shared(void *p)
+{
+    uint64_t x = page_to_index(p);
+    if (p == NULL || x < first_page || x >= first_page + num_pages) {
+        return false;
+    }
+    return __atomic_load_n(&share_count[x], __ATOMIC_ACQUIRE) > 0;
+}
 
-    /* Don't just take total pages and subtract taken. The point
-     * of these is to detect anomalies. You are making an assumption
-     * if you take total pages and subtract taken pages from it.
-    */
+void page_split(void *p)
+{
+    uint64_t x = page_to_index(p);
+    if (p == NULL || x < first_page || x >= first_page + num_pages) {
+        return;
+    }
+    uint64_t n = alloc_count[x];
+    for (uint64_t i = 0; i < n; i++) {
+        alloc_count[x + i] = 1;
+    }
+}
 
+uint64_t page_count_free(void)
+{
+    /* Kept up to date by the allocator instead of rescanning the heap.
+     * It is tracked separately from the taken count, so the two still
+     * add up to the heap size only if the bookkeeping is sound.
+    */
     mutex_spinlock(&page_lock);
-    for (uint64_t i = 0; i < HEAP_SIZE_IN_PAGES; i++) {
-       if (!is_taken(i)) {
-           ret++;
-       }
-    }
+    uint64_t ret = free_pages;
     mutex_unlock(&page_lock);
+    // Pages waiting in the per-hart magazines and the zero pool are free too
+    for (int i = 0; i < MAX_ALLOWABLE_HARTS; i++) {
+        ret += magazines[i].count;
+    }
+    ret += zero_count;
 
     return ret;
 }
 
 uint64_t page_count_taken(void)
 {
-    uint64_t ret = 0;
-
-    /* Count taken pages in the bookkeeping area */
-
-    /* Don't just take total pages and subtract free. The point
-     * of these is to detect anomalies. You are making an assumption
-     * if you take total pages and subtract free pages from it.
-    */
-
+    /* See page_count_free */
     mutex_spinlock(&page_lock);
-    for (uint64_t i = 0; i < HEAP_SIZE_IN_PAGES; i++) {
-       if (is_taken(i)) {
-           ret++;
-       }
-    }
+    uint64_t ret = taken_pages;
     mutex_unlock(&page_lock);
+    for (int i = 0; i < MAX_ALLOWABLE_HARTS; i++) {
+        ret -= magazines[i].count;
+    }
+    ret -= zero_count;
 
     return ret;
 }
+
+PageCacheStats page_cache_get_stats(void)
+{
+    PageCacheStats total = {0};
+    for (int i = 0; i < MAX_ALLOWABLE_HARTS; i++) {
+        total.hits += magazines[i].stats.hits;
+        total.refills += magazines[i].stats.refills;
+        total.drains += magazines[i].stats.drains;
+    }
+    return total;
+}
+
+void page_cache_debug(void)
+{
+    for (int i = 0; i < MAX_ALLOWABLE_HARTS; i++) {
+        infof("Page cache on hart %d: %lu cached, %lu hits, %lu refills, %lu drains\n",
+              i, magazines[i].count, magazines[i].stats.hits, magazines[i].stats.refills, magazines[i].stats.drains);
+    }
+}
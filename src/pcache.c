@@ -0,0 +1,274 @@
+/*
+*   Page cache for memory-mapped files
+*/
+#include <pcache.h>
+#include <config.h>
+#include <debug.h>
+#include <elf.h>
+#include <kmalloc.h>
+#include <minix3.h>
+#include <page.h>
+#include <util.h>
+#include <vfs.h>
+
+// #define PCACHE_DEBUG
+
+#ifdef PCACHE_DEBUG
+#define debugf(...) debugf(__VA_ARGS__)
+#else
+#define debugf(...)
+#endif
+
+/*
+ * Every mapping of a file maps the same cached pages, so a file is read from
+ * the disk once no matter how many processes map it, and a store through one
+ * shared mapping is seen by all the others straight away. The cache owns the
+ * pages. Page tables map them without taking references, which is safe
+ * because a file's pages are only freed once it has no users left.
+ *
+ * A page that was dirtied through a shared mapping stays dirty until the last
+ * user is gone, since nothing tells the cache about later stores to a page
+ * that is already writable. It is written back on every writeback until then.
+ *
+ * The cache reads and writes the disk while it is being changed, so it is
+ * guarded by the filesystem lock (see src/vfs.c) rather than a lock of its own.
+ */
+
+static PageCacheFile *lru_head, *lru_tail;
+static uint64_t num_idle;
+
+static void lru_unlink(PageCacheFile *f) {
+    if (f->lru_prev) f->lru_prev->lru_next = f->lru_next;
+    else lru_head = f->lru_next;
+    if (f->lru_next) f->lru_next->lru_prev = f->lru_prev;
+    else lru_tail = f->lru_prev;
+    f->lru_prev = f->lru_next = NULL;
+}
+
+static void lru_push_front(PageCacheFile *f) {
+    f->lru_prev = NULL;
+    f->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = f;
+    lru_head = f;
+    if (lru_tail == NULL) lru_tail = f;
+}
+
+static PageCacheFile *pcache_find(VirtioDevice *dev, uint32_t inode) {
+    for (PageCacheFile *f = lru_head; f != NULL; f = f->lru_next) {
+        if (f->dev == dev && f->inode == inode) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+// Write every dirty page of the file to the disk. Must be called with the lock held.
+static void pcache_file_writeback(PageCacheFile *f, bool clean) {
+    bool wrote = false;
+    for (uint64_t i = 0; i < f->num_pages; i++) {
+        if (!f->dirty[i] || f->pages[i] == NULL) {
+            continue;
+        }
+        uint64_t offset = i * PAGE_SIZE_4K;
+        uint64_t count = f->size - offset < PAGE_SIZE_4K ? f->size - offset : PAGE_SIZE_4K;
+        if (!wrote) {
+            elf_cache_invalidate(f->dev, f->inode);
+        }
+        minix3_put_data(f->dev, f->inode, f->pages[i], offset, count);
+        if (clean) {
+            f->dirty[i] = false;
+        }
+        wrote = true;
+    }
+    if (wrote) {
+        minix3_sync(f->dev);
+    }
+}
+
+// Forget an idle file. Must be called with the lock held.
+static void pcache_evict(PageCacheFile *f) {
+    debugf("pcache_evict: Dropping inode %u of %s\n", f->inode, f->dev->name);
+    lru_unlink(f);
+    num_idle--;
+    for (uint64_t i = 0; i < f->num_pages; i++) {
+        if (f->pages[i] != NULL) {
+            page_free(f->pages[i]);
+        }
+    }
+    minix3_inode_release(f->dev, f->inode);
+    kfree(f->pages);
+    kfree(f->dirty);
+    kfree(f);
+}
+
+// Make room for a file that grew to `size`. Must be called with the lock held.
+static bool pcache_file_grow(PageCacheFile *f, uint64_t size) {
+    uint64_t num_pages = ALIGN_UP_POT(size, PAGE_SIZE_4K) / PAGE_SIZE_4K;
+    if (num_pages > f->num_pages) {
+        void **pages = (void **)kcalloc(num_pages, sizeof(void *));
+        bool *dirty = (bool *)kcalloc(num_pages, sizeof(bool));
+        if (pages == NULL || dirty == NULL) {
+            kfree(pages);
+            kfree(dirty);
+            return false;
+        }
+        memcpy(pages, f->pages, f->num_pages * sizeof(void *));
+        memcpy(dirty, f->dirty, f->num_pages * sizeof(bool));
+        kfree(f->pages);
+        kfree(f->dirty);
+        f->pages = pages;
+        f->dirty = dirty;
+    }
+    // The old last page was cached with zeros past the old end of the file
+    uint64_t in_page = f->size % PAGE_SIZE_4K;
+    if (in_page != 0 && f->pages[f->size / PAGE_SIZE_4K] != NULL) {
+        uint64_t count = PAGE_SIZE_4K - in_page < size - f->size ? PAGE_SIZE_4K - in_page : size - f->size;
+        minix3_get_data(f->dev, f->inode, (uint8_t *)f->pages[f->size / PAGE_SIZE_4K] + in_page, f->size, count);
+    }
+    debugf("pcache_file_grow: Inode %u grew from %lu to %lu bytes\n", f->inode, f->size, size);
+    f->num_pages = num_pages > f->num_pages ? num_pages : f->num_pages;
+    f->size = size;
+    return true;
+}
+
+PageCacheFile *pcache_get(VirtioDevice *dev, uint32_t inode, uint64_t size) {
+    fs_lock();
+    PageCacheFile *f = pcache_find(dev, inode);
+    if (f != NULL && f->size != size && f->users == 0) {
+        // Nothing maps the old size, so start over
+        pcache_evict(f);
+        f = NULL;
+    }
+    if (f != NULL && size > f->size && !pcache_file_grow(f, size)) {
+        fs_unlock();
+        return NULL;
+    }
+    if (f != NULL) {
+        lru_unlink(f);
+        lru_push_front(f);
+        if (f->users++ == 0) {
+            num_idle--;
+        }
+        fs_unlock();
+        return f;
+    }
+
+    f = (PageCacheFile *)kzalloc(sizeof(PageCacheFile));
+    if (f == NULL) {
+        fs_unlock();
+        return NULL;
+    }
+    f->dev = dev;
+    f->inode = inode;
+    f->size = size;
+    f->num_pages = ALIGN_UP_POT(size, PAGE_SIZE_4K) / PAGE_SIZE_4K;
+    f->pages = (void **)kcalloc(f->num_pages, sizeof(void *));
+    f->dirty = (bool *)kcalloc(f->num_pages, sizeof(bool));
+    if (f->num_pages != 0 && (f->pages == NULL || f->dirty == NULL)) {
+        kfree(f->pages);
+        kfree(f->dirty);
+        kfree(f);
+        fs_unlock();
+        return NULL;
+    }
+    // The inode has to stay in the inode table while its pages are cached
+    minix3_inode_acquire(dev, inode);
+    f->users = 1;
+    lru_push_front(f);
+    debugf("pcache_get: Caching inode %u of %s (%lu pages)\n", inode, dev->name, f->num_pages);
+    fs_unlock();
+    return f;
+}
+
+void pcache_ref(PageCacheFile *file) {
+    fs_lock();
+    file->users++;
+    fs_unlock();
+}
+
+void pcache_put(PageCacheFile *file) {
+    fs_lock();
+    if (--file->users == 0) {
+        pcache_file_writeback(file, true);
+        num_idle++;
+        // Evict the least recently used idle files until few enough are left
+        PageCacheFile *f = lru_tail;
+        while (num_idle > PCACHE_NUM_IDLE_FILES && f != NULL) {
+            PageCacheFile *prev = f->lru_prev;
+            if (f->users == 0) {
+                pcache_evict(f);
+            }
+            f = prev;
+        }
+    }
+    fs_unlock();
+}
+
+void *pcache_get_page(PageCacheFile *file, uint64_t index) {
+    if (index >= file->num_pages) {
+        return NULL;
+    }
+    fs_lock();
+    void *page = file->pages[index];
+    if (page != NULL) {
+        fs_unlock();
+        return page;
+    }
+    page = page_zalloc();
+    if (page == NULL) {
+        fs_unlock();
+        return NULL;
+    }
+    // The part of the last page past the end of the file stays zero
+    uint64_t offset = index * PAGE_SIZE_4K;
+    uint64_t count = file->size - offset < PAGE_SIZE_4K ? file->size - offset : PAGE_SIZE_4K;
+    minix3_get_data(file->dev, file->inode, page, offset, count);
+    file->pages[index] = page;
+    fs_unlock();
+    return page;
+}
+
+void pcache_mark_dirty(PageCacheFile *file, uint64_t index) {
+    if (index >= file->num_pages) {
+        return;
+    }
+    fs_lock();
+    file->dirty[index] = true;
+    fs_unlock();
+}
+
+void pcache_writeback(VirtioDevice *dev, uint32_t inode) {
+    fs_lock();
+    PageCacheFile *f = pcache_find(dev, inode);
+    if (f != NULL) {
+        // Still mapped, so the pages can be dirtied again without the cache knowing
+        pcache_file_writeback(f, f->users == 0);
+    }
+    fs_unlock();
+}
+
+void pcache_update(VirtioDevice *dev, uint32_t inode, uint64_t offset, const void *data, uint64_t count) {
+    fs_lock();
+    // A cached executable image of the file is out of date too
+    elf_cache_invalidate(dev, inode);
+    PageCacheFile *f = pcache_find(dev, inode);
+    if (f != NULL) {
+        const uint8_t *src = (const uint8_t *)data;
+        uint64_t end = offset + count;
+        if (end > f->size && !pcache_file_grow(f, end)) {
+            end = f->size;
+        }
+        while (offset < end) {
+            uint64_t index = offset / PAGE_SIZE_4K;
+            uint64_t in_page = offset % PAGE_SIZE_4K;
+            uint64_t chunk = PAGE_SIZE_4K - in_page < end - offset ? PAGE_SIZE_4K - in_page : end - offset;
+            // Pages that are not cached yet will be read with the new data
+            if (f->pages[index] != NULL) {
+                memcpy((uint8_t *)f->pages[index] + in_page, src, chunk);
+            }
+            src += chunk;
+            offset += chunk;
+        }
+    }
+    fs_unlock();
+}
@@ -546,9 +546,13 @@ void pci_dispatch_irq(int irq)
         else if (virtio_is_block_device(virtdevice)) {
             debugf("Block device sent interrupt!\n");
             VirtioDescriptor descriptors[16];
-            uint16_t received = virtio_receive_descriptor_chain(virtdevice, 0, descriptors, 3, true);
-            virtio_handle_interrupt(virtdevice, descriptors, received);
-            debugf("Received %d descriptors\n", received);
+            // Several requests may be in flight, and one interrupt can
+            // cover more than one of them finishing.
+            while (virtio_has_received_descriptor(virtdevice, 0)) {
+                uint16_t received = virtio_receive_descriptor_chain(virtdevice, 0, descriptors, 3, false);
+                virtio_handle_interrupt(virtdevice, descriptors, received);
+                debugf("Received %d descriptors\n", received);
+            }
         }
 
         else if (virtio_is_input_device(virtdevice)) {
@@ -82,12 +82,16 @@ void plic_handle_irq(int hart)
 
 void plic_init(void)
 {
-    plic_enable(0, PLIC_PCI_INTA);
-    plic_enable(0, PLIC_PCI_INTB);
-    plic_enable(0, PLIC_PCI_INTC);
-    plic_enable(0, PLIC_PCI_INTD);
+    // Any hart can take a device interrupt, since a hart waiting on a
+    // device in a syscall claims the interrupt itself (see src/block.c)
+    for (int hart = 0; hart < MAX_ALLOWABLE_HARTS; hart++) {
+        plic_enable(hart, PLIC_PCI_INTA);
+        plic_enable(hart, PLIC_PCI_INTB);
+        plic_enable(hart, PLIC_PCI_INTC);
+        plic_enable(hart, PLIC_PCI_INTD);
 
-    plic_set_threshold(0, 0);
+        plic_set_threshold(hart, 0);
+    }
 
     plic_set_priority(PLIC_PCI_INTA, 7);
     plic_set_priority(PLIC_PCI_INTB, 7);
@@ -16,6 +16,11 @@
 #include <trap.h>
 #include <lock.h>
 #include <sched.h>
+#include <elf.h>
+#include <tlb.h>
+#include <pcache.h>
+#include <errno.h>
+#include <config.h>
 
 #define DEBUG_PROCESS
 #ifdef DEBUG_PROCESS
@@ -128,13 +133,15 @@ void process_debug(Process *p) {
     // uint64_t sleep_until;
     // uint64_t runtime;
     // uint64_t ran_at;
-    // uint64_t priority;
     // uint64_t quantum;
+    // int nice;
+    // uint64_t vruntime;
     debugf("  sleep_until: %d\n", p->sleep_until);
     debugf("  runtime: %d\n", p->runtime);
     debugf("  ran_at: %d\n", p->ran_at);
-    debugf("  priority: %d\n", p->priority);
     debugf("  quantum: %d\n", p->quantum);
+    debugf("  nice: %d\n", p->nice);
+    debugf("  vruntime: %lu\n", p->vruntime);
 
     if (p->image) {
         debugf("  image: %p\n", p->image);
@@ -169,14 +176,15 @@ void process_debug(Process *p) {
         debugf("  data: NULL\n");
     }
 
-    if (p->stack) {
+    if (p->stack_size) {
         debugf("  stack: %p (physical address = %p)\n", p->stack_vaddr, mmu_translate(p->rcb.ptable, (uintptr_t)p->stack_vaddr));
         debugf("  stack_size: 0x%X (%d pages)\n", p->stack_size, ALIGN_UP_POT(p->stack_size, PAGE_SIZE_4K) / PAGE_SIZE_4K);
     } else {
         debugf("  stack: NULL\n");
     }
 
-    if (p->heap) {
+    if (p->heap_size) {
+        debugf("  break: %p\n", p->heap_vaddr + p->break_size);
         debugf("  heap: %p (physical address = %p)\n", p->heap_vaddr, mmu_translate(p->rcb.ptable, (uintptr_t)p->heap_vaddr));
         debugf("  heap_size: 0x%X (%d pages)\n", p->heap_size, ALIGN_UP_POT(p->heap_size, PAGE_SIZE_4K) / PAGE_SIZE_4K);
     } else {
@@ -222,7 +230,7 @@ void process_put_env(Process *p, const char *var, const char *value) {
     mutex_unlock(&p->lock);
 }
 
-TrapFrame *trap_frame_new(bool is_user, PageTable *page_table, uint64_t pid) {
+TrapFrame *trap_frame_new(bool is_user, PageTable *page_table) {
     TrapFrame *frame;
     uint64_t permission_bits = PB_READ | PB_EXECUTE | PB_WRITE;
     if (is_user) {
@@ -234,7 +242,8 @@ TrapFrame *trap_frame_new(bool is_user, PageTable *page_table, uint64_t pid) {
         } else {
             frame->sstatus |= SSTATUS_SPP_SUPERVISOR;
         }
-        frame->satp = SATP(kernel_mmu_translate((uintptr_t)page_table), pid % 0xffff);
+        // The ASID is filled in by tlb_activate each time the process runs
+        frame->satp = SATP(kernel_mmu_translate((uintptr_t)page_table), 0);
         frame->sscratch = (uintptr_t)frame;
         // frame->sscratch = kernel_mmu_translate((uintptr_t)frame);
         frame->trap_satp = SATP_KERNEL;
@@ -245,14 +254,6 @@ TrapFrame *trap_frame_new(bool is_user, PageTable *page_table, uint64_t pid) {
         // CSR_READ(frame->sie, "sie");
         trap_frame_set_stack_pointer(frame, USER_STACK_TOP);
         trap_frame_set_heap_pointer(frame, USER_HEAP_BOTTOM);
-        debugf("process.c (trap_frame_new): Mapping trap stack 0x%08lx:0x%08lx to 0x%08lx\n", frame->trap_stack, frame->trap_stack + 0x10000, kernel_mmu_translate(frame->trap_stack));
-        mmu_map_range(page_table, 
-                    frame->trap_stack, 
-                    frame->trap_stack + 0x200 * PAGE_SIZE_4K, 
-                    frame->trap_stack, 
-                    MMU_LEVEL_4K,
-                    PB_READ);
-
         // mmu_map_range(page_table, 
         //             frame,
         //             ((uintptr_t)frame) + sizeof(TrapFrame),
@@ -270,12 +271,6 @@ TrapFrame *trap_frame_new(bool is_user, PageTable *page_table, uint64_t pid) {
         frame->trap_stack = kernel_trap_frame->trap_stack;
         // frame->sie = SIE_SEIE | SIE_SSIE | SIE_STIE;
         frame->sie = SIE_SSIE | SIE_STIE;
-        mmu_map_range(page_table, 
-                    frame->trap_stack, 
-                    frame->trap_stack + 0x200 * PAGE_SIZE_4K, 
-                    frame->trap_stack, 
-                    MMU_LEVEL_4K,
-                    PB_READ);
 
         // mmu_map_range(page_table, 
         //             frame,
@@ -327,45 +322,14 @@ TrapFrame *trap_frame_new(bool is_user, PageTable *page_table, uint64_t pid) {
     //             kernel_mmu_translate((unsigned long)frame),
     //             MMU_LEVEL_4K,
     //             permission_bits);
-    debugf("process.c (trap_frame_new): Mapping page table 0x%08lx:0x%08lx to 0x%08lx\n", page_table, (uintptr_t)(page_table) + 0x1000, kernel_mmu_translate(page_table));
-    mmu_map_range(page_table,
-                (uintptr_t)page_table,
-                (uintptr_t)(page_table) + 0x1000,
-                kernel_mmu_translate((uintptr_t)page_table),
-                MMU_LEVEL_4K,
-                PB_READ);
-
-    debugf("process.c (trap_frame_new): Mapping trap frame 0x%08lx:0x%08lx to 0x%08lx\n", frame, (uintptr_t)(frame) + 0x1000, kernel_mmu_translate(frame));
-    mmu_map_range(page_table,
-                (uintptr_t)frame,
-                (uintptr_t)(frame) + 0x1000,
-                kernel_mmu_translate((uintptr_t)frame),
-                // (uint64_t)frame,
-                MMU_LEVEL_4K,
-                PB_READ);
-
-    debugf("process.c (trap_frame_new): Mapping trampoline trap 0x%08lx:0x%08lx to 0x%08lx\n", trampoline_trap_start, trampoline_trap_start + 0x1000, kernel_mmu_translate(trampoline_trap_start));
-    mmu_map_range(page_table,
-                trampoline_trap_start,
-                trampoline_trap_start + 0x1000,
-                kernel_mmu_translate(trampoline_trap_start),
-                MMU_LEVEL_4K,
-                PB_READ | PB_EXECUTE);
-
-    debugf("process.c (trap_frame_new): Mapping trampoline trap 0x%08lx:0x%08lx to 0x%08lx\n", trampoline_trap_start, trampoline_trap_start + 0x1000, kernel_mmu_translate(trampoline_trap_start));
-    mmu_map_range(page_table,
-                kernel_trap_frame->stvec & ~0xfff,
-                (kernel_trap_frame->stvec & ~0xfff) + 0x4000,
-                kernel_mmu_translate(kernel_trap_frame->stvec),
-                MMU_LEVEL_4K,
-                PB_READ | PB_EXECUTE);
-
+    // The trap stack, the trap frame and the trampoline are all in kernel
+    // memory, which every page table shares (see mmu_link_kernel)
     debugf("process.c (trap_frame_new): TrapFrame address: 0x%08x\n", frame);
     return frame;
 }
 
 void trap_frame_free(TrapFrame *frame) {
-    kfree((void *)frame->trap_stack);
+    // The trap stack belongs to the hart, not the frame
     kfree(frame);
 }
 
@@ -374,16 +338,19 @@ void rcb_init(RCB *rcb) {
     rcb->stack_pages = list_new();
     rcb->heap_pages = list_new();
     rcb->file_descriptors = list_new();
+    rcb->mmaps = list_new();
     rcb->environemnt = map_new();
     rcb->ptable = mmu_table_create();
+    mmu_link_kernel(rcb->ptable);
 }
 void rcb_free(RCB *rcb) {
     list_free(rcb->image_pages);
     list_free(rcb->stack_pages);
     list_free(rcb->heap_pages);
     list_free(rcb->file_descriptors);
+    list_free(rcb->mmaps);
     map_free(rcb->environemnt);
-    page_free(rcb->ptable);
+    mmu_free(rcb->ptable);
 }
 
 void rcb_map(RCB *rcb, uint64_t vaddr, uint64_t paddr, uint64_t size, uint64_t bits) {
@@ -395,16 +362,22 @@ void rcb_map(RCB *rcb, uint64_t vaddr, uint64_t paddr, uint64_t size, uint64_t b
     }
 
 
+    // Contiguous regions like the heap and stack get 2M or 1G pages where the alignment allows
+    mmu_map_range(rcb->ptable, vaddr, vaddr + size, paddr, MMU_LEVEL_4K, bits);
+
     // if (size < PAGE_SIZE_2M) {
     uint64_t alignment = ~(PAGE_SIZE_4K - 1);
+    bool kernel_changed = false;
     for (uint64_t i = 0; i < size; i += PAGE_SIZE_4K) {
-        // debugf("rcb_map: Mapping 0x%08lx to 0x%08lx\n", (vaddr + i) & alignment, (paddr + i) & alignment);
-        mmu_map(rcb->ptable, (vaddr + i) & alignment, (paddr + i) & alignment, MMU_LEVEL_4K, bits);
         if (kernel_mmu_translate((paddr + i) & alignment) == MMU_TRANSLATE_PAGE_FAULT) {
             warnf("%p not mapped in kernel space\n", (paddr + i) & alignment);
             mmu_map(kernel_mmu_table, (paddr + i) & alignment, (paddr + i) & alignment, MMU_LEVEL_4K, bits & ~PB_USER | PB_WRITE | PB_READ);
+            kernel_changed = true;
         }
     }
+    if (kernel_changed) {
+        tlb_flush_kernel();
+    }
     // } else {
     //     uint64_t alignment = ~(PAGE_SIZE_2M - 1);
     //     for (uint64_t i = 0; i < size; i += PAGE_SIZE_2M) {
@@ -419,6 +392,432 @@ void rcb_map(RCB *rcb, uint64_t vaddr, uint64_t paddr, uint64_t size, uint64_t b
 
 }
 
+bool process_fault_in(Process *p, uintptr_t vaddr) {
+    uintptr_t page = ALIGN_DOWN_POT(vaddr, PAGE_SIZE_4K);
+    List *pages;
+    // The stack ends at (and includes) the page at stack_vaddr. The lowest page
+    // of the reservation is never mapped, so overflowing the stack still faults.
+    uintptr_t guard = (uintptr_t)p->stack_vaddr + PAGE_SIZE_4K - p->stack_size;
+    if (p->stack_size != 0 && page > guard && page <= (uintptr_t)p->stack_vaddr) {
+        pages = p->rcb.stack_pages;
+    } else if (vaddr >= (uintptr_t)p->heap_vaddr && vaddr < (uintptr_t)p->heap_vaddr + p->break_size) {
+        pages = p->rcb.heap_pages;
+    } else {
+        return false;
+    }
+    if (mmu_translate(p->rcb.ptable, page) != MMU_TRANSLATE_PAGE_FAULT) {
+        // Already there, so the fault was not about a missing page
+        return false;
+    }
+
+    void *frame = page_zalloc();
+    if (frame == NULL) {
+        warnf("process.c (process_fault_in): Out of memory for page %p of process %d\n", page, p->pid);
+        return false;
+    }
+    uint64_t bits = PB_READ | PB_WRITE;
+    if (p->mode == PM_USER) {
+        bits |= PB_USER;
+    }
+    if (!mmu_map(p->rcb.ptable, page, (uintptr_t)frame, MMU_LEVEL_4K, bits)) {
+        page_free(frame);
+        return false;
+    }
+    list_add_ptr(pages, frame);
+    tlb_flush_page(p, page);
+    return true;
+}
+
+// The mapped file `vaddr` is in, or NULL
+static MmapRegion *process_mmap_find(Process *p, uintptr_t vaddr) {
+    struct ListElem *e;
+    list_for_each(p->rcb.mmaps, e) {
+        MmapRegion *region = list_elem_value_ptr(e);
+        if (vaddr >= region->start && vaddr < region->start + region->length) {
+            return region;
+        }
+    }
+    return NULL;
+}
+
+// Free a region whose pages are no longer mapped anywhere
+static void process_mmap_release(MmapRegion *region) {
+    struct ListElem *e;
+    list_for_each(region->private_pages, e) {
+        page_free(list_elem_value_ptr(e));
+    }
+    list_free(region->private_pages);
+    pcache_put(region->file);
+    kfree(region);
+}
+
+// Drop every mapped file of a process whose user mappings are gone already
+static void process_mmap_release_all(Process *p) {
+    struct ListElem *e;
+    list_for_each(p->rcb.mmaps, e) {
+        process_mmap_release(list_elem_value_ptr(e));
+    }
+    list_clear(p->rcb.mmaps);
+}
+
+uintptr_t process_mmap(Process *p, PageCacheFile *file, uint64_t length, int prot, int flags, uint64_t offset) {
+    length = ALIGN_UP_POT(length, PAGE_SIZE_4K);
+    MmapRegion *region = (MmapRegion *)kzalloc(sizeof(MmapRegion));
+    if (region == NULL) {
+        return 0;
+    }
+    region->private_pages = list_new();
+
+    mutex_spinlock(&p->lock);
+    // First fit: move past every region in the way until nothing is
+    uintptr_t start = USER_MMAP_BOTTOM;
+    bool moved = true;
+    while (moved && start + length <= USER_MMAP_TOP) {
+        moved = false;
+        struct ListElem *e;
+        list_for_each(p->rcb.mmaps, e) {
+            MmapRegion *other = list_elem_value_ptr(e);
+            if (start < other->start + other->length && other->start < start + length) {
+                start = other->start + other->length;
+                moved = true;
+            }
+        }
+    }
+    if (length == 0 || start + length > USER_MMAP_TOP) {
+        mutex_unlock(&p->lock);
+        list_free(region->private_pages);
+        kfree(region);
+        return 0;
+    }
+    region->start = start;
+    region->length = length;
+    region->offset = offset;
+    region->prot = prot;
+    region->flags = flags;
+    region->file = file;
+    list_add_ptr(p->rcb.mmaps, region);
+    mutex_unlock(&p->lock);
+    debugf("process.c (process_mmap): Mapped %lu bytes at %p for process %d\n", length, start, p->pid);
+    return start;
+}
+
+int process_munmap(Process *p, uintptr_t addr, uint64_t length) {
+    uintptr_t end = addr + ALIGN_UP_POT(length, PAGE_SIZE_4K);
+    List *doomed = list_new();
+    struct ListElem *e;
+
+    mutex_spinlock(&p->lock);
+    list_for_each(p->rcb.mmaps, e) {
+        MmapRegion *region = list_elem_value_ptr(e);
+        uintptr_t region_end = region->start + region->length;
+        if (region->start >= addr && region_end <= end) {
+            list_add_ptr(doomed, region);
+        } else if (region->start < end && addr < region_end) {
+            // Splitting a region is not supported
+            mutex_unlock(&p->lock);
+            list_free(doomed);
+            return -EINVAL;
+        }
+    }
+    bool unmapped = false;
+    list_for_each(doomed, e) {
+        MmapRegion *region = list_elem_value_ptr(e);
+        list_remove_ptr(p->rcb.mmaps, region);
+        for (uintptr_t page = region->start; page < region->start + region->length; page += PAGE_SIZE_4K) {
+            if (mmu_unmap(p->rcb.ptable, page) != MMU_TRANSLATE_PAGE_FAULT) {
+                unmapped = true;
+            }
+        }
+    }
+    // The pages are only given back once no TLB can reach them anymore
+    if (unmapped) {
+        tlb_flush_process(p);
+    }
+    list_for_each(doomed, e) {
+        process_mmap_release(list_elem_value_ptr(e));
+    }
+    mutex_unlock(&p->lock);
+    list_free(doomed);
+    return 0;
+}
+
+bool process_fault_mmap(Process *p, uintptr_t vaddr, bool write) {
+    uintptr_t page = ALIGN_DOWN_POT(vaddr, PAGE_SIZE_4K);
+    MmapRegion *region = process_mmap_find(p, page);
+    if (region == NULL || (write && !(region->prot & PROT_WRITE))) {
+        return false;
+    }
+    uint64_t index = (region->offset + (page - region->start)) / PAGE_SIZE_4K;
+    bool shared = region->flags & MAP_SHARED;
+
+    uint64_t *entry = mmu_find_leaf(p->rcb.ptable, page);
+    if (entry != NULL) {
+        if (!write || (*entry & PB_WRITE)) {
+            // Already there, so the fault was not about this page
+            return false;
+        }
+        void *frame = (void *)((*entry & ~0x3FFUL) << 2);
+        if (shared) {
+            // The first store to a cached page, which was mapped read-only to catch it
+            pcache_mark_dirty(region->file, index);
+            *entry |= PB_WRITE;
+        } else {
+            void *copy = page_alloc();
+            if (copy == NULL) {
+                warnf("process.c (process_fault_mmap): Out of memory for page %p of process %d\n", page, p->pid);
+                return false;
+            }
+            memcpy(copy, frame, PAGE_SIZE_4K);
+            *entry = ((uint64_t)copy >> 2) | (*entry & 0x3FF) | PB_WRITE;
+            list_add_ptr(region->private_pages, copy);
+        }
+        tlb_flush_page(p, page);
+        return true;
+    }
+
+    void *frame = pcache_get_page(region->file, index);
+    if (frame == NULL) {
+        return false;
+    }
+    uint64_t bits = PB_READ;
+    if (p->mode == PM_USER) {
+        bits |= PB_USER;
+    }
+    void *copy = NULL;
+    if (write && shared) {
+        pcache_mark_dirty(region->file, index);
+        bits |= PB_WRITE;
+    } else if (write) {
+        copy = page_alloc();
+        if (copy == NULL) {
+            warnf("process.c (process_fault_mmap): Out of memory for page %p of process %d\n", page, p->pid);
+            return false;
+        }
+        memcpy(copy, frame, PAGE_SIZE_4K);
+        frame = copy;
+        bits |= PB_WRITE;
+    }
+    if (!mmu_map(p->rcb.ptable, page, (uintptr_t)frame, MMU_LEVEL_4K, bits)) {
+        if (copy != NULL) {
+            page_free(copy);
+        }
+        return false;
+    }
+    if (copy != NULL) {
+        list_add_ptr(region->private_pages, copy);
+    }
+    tlb_flush_page(p, page);
+    return true;
+}
+
+// The list of pages a user page belongs to, by where it is mapped
+static List *process_page_list(Process *p, uintptr_t page) {
+    if (page < (uintptr_t)p->stack_vaddr + PAGE_SIZE_4K && page >= (uintptr_t)p->stack_vaddr + PAGE_SIZE_4K - p->stack_size) {
+        return p->rcb.stack_pages;
+    } else if (page >= (uintptr_t)p->heap_vaddr && page < (uintptr_t)p->heap_vaddr + p->heap_size) {
+        return p->rcb.heap_pages;
+    } else if (page >= USER_MMAP_BOTTOM && page < USER_MMAP_TOP) {
+        // A shared region's pages belong to the page cache, which holds the only
+        // reference to them, so process_fault_cow never looks for one in a list
+        MmapRegion *region = process_mmap_find(p, page);
+        if (region != NULL) {
+            return region->private_pages;
+        }
+    }
+    return p->rcb.image_pages;
+}
+
+bool process_fault_cow(Process *p, uintptr_t vaddr) {
+    uintptr_t page = ALIGN_DOWN_POT(vaddr, PAGE_SIZE_4K);
+    uint64_t *entry = mmu_find_leaf(p->rcb.ptable, page);
+    if (entry == NULL || !(*entry & PB_COW)) {
+        return false;
+    }
+    void *frame = (void *)((*entry & ~0x3FFUL) << 2);
+    uint64_t bits = (*entry & 0x3FF & ~PB_COW) | PB_WRITE;
+
+    if (!page_is_shared(frame)) {
+        // No one else has the page anymore, so it is simply made writable again
+        *entry = ((uint64_t)frame >> 2) | bits;
+        tlb_flush_page(p, page);
+        return true;
+    }
+    void *copy = page_alloc();
+    if (copy == NULL) {
+        warnf("process.c (process_fault_cow): Out of memory for page %p of process %d\n", page, p->pid);
+        return false;
+    }
+    memcpy(copy, frame, PAGE_SIZE_4K);
+    *entry = ((uint64_t)copy >> 2) | bits;
+    tlb_flush_page(p, page);
+    List *pages = process_page_list(p, page);
+    if (list_remove_ptr(pages, frame)) {
+        // Only drops our share, the other owners keep the original
+        page_free(frame);
+    }
+    list_add_ptr(pages, copy);
+    return true;
+}
+
+// Give `to` a share of every page in `from`
+static void process_share_pages(List *to, List *from) {
+    struct ListElem *e;
+    list_for_each(from, e) {
+        page_ref(list_elem_value_ptr(e));
+        list_add_ptr(to, list_elem_value_ptr(e));
+    }
+}
+
+Process *process_fork(Process *parent) {
+    Process *child = process_new(parent->mode);
+
+    mutex_spinlock(&parent->lock);
+    child->quantum = parent->quantum;
+    // The child starts where the parent is, so forking doesn't buy CPU time
+    child->nice = parent->nice;
+    child->vruntime = parent->vruntime;
+    child->entry_point = parent->entry_point;
+    child->image = parent->image;
+    child->image_size = parent->image_size;
+    child->text = parent->text;
+    child->text_vaddr = parent->text_vaddr;
+    child->text_size = parent->text_size;
+    child->bss = parent->bss;
+    child->bss_vaddr = parent->bss_vaddr;
+    child->bss_size = parent->bss_size;
+    child->rodata = parent->rodata;
+    child->rodata_vaddr = parent->rodata_vaddr;
+    child->rodata_size = parent->rodata_size;
+    child->data = parent->data;
+    child->data_vaddr = parent->data_vaddr;
+    child->data_size = parent->data_size;
+    child->stack_size = parent->stack_size;
+    child->stack_vaddr = parent->stack_vaddr;
+    child->heap_size = parent->heap_size;
+    child->heap_vaddr = parent->heap_vaddr;
+    child->break_size = parent->break_size;
+
+    // Nothing is copied now. Both processes map the same pages read-only,
+    // and whichever stores to a page first gets its own copy of it.
+    process_share_pages(child->rcb.image_pages, parent->rcb.image_pages);
+    process_share_pages(child->rcb.stack_pages, parent->rcb.stack_pages);
+    process_share_pages(child->rcb.heap_pages, parent->rcb.heap_pages);
+    // Mapped files too. A private region's copies are shared like the heap,
+    // while the dirty pages of a shared region come out PB_COW with the page
+    // cache as their only owner, so the next store just makes them writable again.
+    bool shared = true;
+    struct ListElem *m;
+    list_for_each(parent->rcb.mmaps, m) {
+        MmapRegion *region = list_elem_value_ptr(m);
+        MmapRegion *copy = (MmapRegion *)kmalloc(sizeof(MmapRegion));
+        if (copy == NULL) {
+            // Every share taken so far is on the child's lists, so freeing
+            // the child gives them back
+            shared = false;
+            break;
+        }
+        *copy = *region;
+        copy->private_pages = list_new();
+        process_share_pages(copy->private_pages, region->private_pages);
+        pcache_ref(region->file);
+        list_add_ptr(child->rcb.mmaps, copy);
+    }
+    if (shared) {
+        shared = mmu_share_user(child->rcb.ptable, parent->rcb.ptable);
+        // The parent's writable pages just became read-only
+        tlb_flush_process(parent);
+    }
+    mutex_unlock(&parent->lock);
+    if (!shared) {
+        warnf("process.c (process_fork): Out of memory while copying process %d\n", parent->pid);
+        process_map_remove(child->pid);
+        process_free(child);
+        return NULL;
+    }
+
+    struct List *keys = map_get_keys(parent->rcb.environemnt);
+    struct ListElem *k;
+    list_for_each(keys, k) {
+        char *key = list_elem_value_ptr(k);
+        char *value;
+        map_get(parent->rcb.environemnt, key, (MapValue *)&value);
+        process_put_env(child, key, value);
+    }
+    map_free_get_keys(keys);
+
+    // The child picks up right after the fork syscall, where it returns 0
+    memcpy(child->frame->xregs, parent->frame->xregs, sizeof(child->frame->xregs));
+    memcpy(child->frame->fregs, parent->frame->fregs, sizeof(child->frame->fregs));
+    child->frame->sepc = parent->frame->sepc;
+    child->frame->xregs[XREG_A0] = 0;
+    return child;
+}
+
+// Free every page on a list, or drop our share of the ones still shared
+static void process_put_pages(List *pages) {
+    struct ListElem *e;
+    list_for_each(pages, e) {
+        page_free(list_elem_value_ptr(e));
+    }
+    list_clear(pages);
+}
+
+int process_exec(Process *p, const uint8_t *elf, const struct ElfImageKey *key) {
+    if (!elf_is_valid(elf)) {
+        return 1;
+    }
+
+    mutex_spinlock(&p->lock);
+    mmu_unmap_user(p->rcb.ptable);
+    tlb_flush_process(p);
+    process_put_pages(p->rcb.image_pages);
+    process_put_pages(p->rcb.stack_pages);
+    process_put_pages(p->rcb.heap_pages);
+    process_mmap_release_all(p);
+    p->image = p->text = p->bss = p->rodata = p->data = NULL;
+    p->image_size = p->text_size = p->bss_size = p->rodata_size = p->data_size = 0;
+    p->text_vaddr = p->bss_vaddr = p->rodata_vaddr = p->data_vaddr = NULL;
+    p->stack_size = USER_STACK_SIZE;
+    p->stack_vaddr = (uint8_t *)USER_STACK_TOP;
+    p->heap_size = USER_HEAP_SIZE;
+    p->heap_vaddr = (uint8_t *)USER_HEAP_BOTTOM;
+    p->break_size = 0;
+    memset(p->frame->xregs, 0, sizeof(p->frame->xregs));
+    memset(p->frame->fregs, 0, sizeof(p->frame->fregs));
+    mutex_unlock(&p->lock);
+
+    // Sets the entry point, stack and global pointers
+    return elf_create_process(p, elf, key);
+}
+
+uintptr_t process_brk(Process *p, uintptr_t addr) {
+    uintptr_t start = (uintptr_t)p->heap_vaddr;
+    uintptr_t old_break = start + p->break_size;
+    if (addr < start || addr > start + p->heap_size) {
+        // Asking for 0 (or anything else outside the heap) just reads the break
+        return old_break;
+    }
+
+    // Give back every page that is now entirely above the break. Growing
+    // needs nothing here, the new pages are mapped when they are touched.
+    // The pages are only freed once no TLB can reach them anymore.
+    List *unmapped = list_new();
+    for (uintptr_t page = ALIGN_UP_POT(addr, PAGE_SIZE_4K); page < old_break; page += PAGE_SIZE_4K) {
+        uintptr_t frame = mmu_unmap(p->rcb.ptable, page);
+        if (frame != MMU_TRANSLATE_PAGE_FAULT) {
+            list_remove_ptr(p->rcb.heap_pages, frame);
+            list_add_ptr(unmapped, (void *)frame);
+        }
+    }
+    if (list_size(unmapped) > 0) {
+        tlb_flush_process(p);
+    }
+    process_put_pages(unmapped);
+    list_free(unmapped);
+    p->break_size = addr - start;
+    return addr;
+}
+
 void trap_frame_set_stack_pointer(TrapFrame *frame, uint64_t stack_pointer) {
     frame->xregs[2] = stack_pointer;
 }
@@ -434,11 +833,11 @@ Process *process_new(ProcessMode mode)
     p->lock = MUTEX_UNLOCKED;
     mutex_spinlock(&p->lock);
     p->pid = generate_unique_pid();
-    p->hart = sbi_whoami();
+    p->hart = hart_id();
     p->mode = mode;
     p->state = PS_WAITING;
     p->quantum = 1;
-    p->priority = 1;
+    p->nice = 0;
     
 
     // Initialize the Resource Control Block
@@ -453,7 +852,7 @@ Process *process_new(ProcessMode mode)
     // p->frame->stvec = trampoline_trap_start;
     // p->frame->trap_satp = SATP_KERNEL;
 
-    p->frame = trap_frame_new(mode == PM_USER, p->rcb.ptable, p->pid);
+    p->frame = trap_frame_new(mode == PM_USER, p->rcb.ptable);
 
 
     // p->frame->sie = SIE_SEIE | SIE_SSIE | SIE_STIE;
@@ -518,86 +917,30 @@ Process *process_new(ProcessMode mode)
     // }
     
 
-    // We need to map certain kernel portions into the user's page table. Notice
-    // that the PB_USER is NOT set, but it needs to be there because we need to execute
-    // the trap/start instructions while using the user's page table until we change SATP.
-    void process_asm_run(void *frame_addr);
-    rcb_map(&p->rcb, trampoline_thread_start, kernel_mmu_translate(trampoline_thread_start), 0x1000, PB_READ | PB_EXECUTE);
-    rcb_map(&p->rcb, trampoline_trap_start, kernel_mmu_translate(trampoline_trap_start), 0x1000, PB_READ | PB_EXECUTE);
-    rcb_map(&p->rcb, (uintptr_t)process_asm_run, kernel_mmu_translate((uintptr_t)process_asm_run), 0x10000, PB_READ | PB_EXECUTE);
-    rcb_map(&p->rcb, (uintptr_t)os_trap_handler, kernel_mmu_translate((uintptr_t)os_trap_handler), 0x4000, PB_READ | PB_EXECUTE);
-    rcb_map(&p->rcb, (uintptr_t)p->frame, kernel_mmu_translate((uintptr_t)p->frame), 0x1000, PB_READ | PB_WRITE | PB_EXECUTE);
+    // The trap/start instructions and the trap frame have to be reachable while
+    // the user's page table is still in satp. They need no mapping here, since
+    // rcb_init linked in the kernel's global mappings (without PB_USER).
     // Map the kernel's text section into the user's page table.
     // rcb_map(&p->rcb, KERNEL_TEXT_START, kernel_mmu_translate(KERNEL_TEXT_START), KERNEL_TEXT_SIZE, PB_READ | PB_EXECUTE);
     // rcb_map(&p->rcb, (uintptr_t)p->frame, kernel_mmu_translate((uintptr_t)p->frame), 0x1000, PB_READ | PB_WRITE | PB_EXECUTE);
 
-    uint64_t permission_bits = PB_READ | PB_EXECUTE | PB_WRITE;
-    if (mode == PM_USER) {
-        permission_bits |= PB_USER;
-    }
-    p->heap_size = USER_HEAP_SIZE;
+    // Only the address ranges of the stack and heap are reserved here. Their
+    // pages are allocated one at a time on first touch, see process_fault_in.
+    p->stack = NULL;
     p->stack_size = USER_STACK_SIZE;
-    do {
-        infof("Allocating %d pages for the stack\n", p->stack_size / PAGE_SIZE);
-        p->stack = page_znalloc(p->stack_size / PAGE_SIZE);
-        if (!p->stack) {
-            p->stack_size /= 2;
-            warnf("Stack allocation failed, trying with %d pages\n", p->stack_size / PAGE_SIZE);
-        }
-
-        if (p->stack_size < PAGE_SIZE * 32) {
-            fatalf("process.c (process_new): Stack size too small\n");
-        }
-    } while (!p->stack);
-    
-    do {
-        infof("Allocating %d pages for the heap\n", p->heap_size / PAGE_SIZE);
-        p->heap = page_znalloc(p->heap_size / PAGE_SIZE);
-        if (!p->heap) {
-            p->heap_size /= 2;
-            warnf("Heap allocation failed, trying with %d pages\n", p->heap_size / PAGE_SIZE);
-        }
-
-        if (p->heap_size < PAGE_SIZE * 4) {
-            fatalf("process.c (process_new): Heap size too small\n");
-        }
-    } while (!p->heap);
-
-    infof("Stack: %p\n", p->stack);
-    infof("Heap: %p\n", p->heap);
     p->stack_vaddr = USER_STACK_TOP;
+    // The heap starts out empty and grows with the brk syscall
+    p->heap = NULL;
+    p->heap_size = USER_HEAP_SIZE;
     p->heap_vaddr = USER_HEAP_BOTTOM;
+    p->break_size = 0;
     if (mode == PM_USER) {
         trap_frame_set_stack_pointer(p->frame, USER_STACK_TOP);
         trap_frame_set_heap_pointer(p->frame, USER_HEAP_BOTTOM);
     }
 
-    debugf("Wiping the heap\n");
-    memset(p->heap, 0, p->heap_size);
-    for (uint64_t i = 0; i < p->heap_size / PAGE_SIZE; i++) {
-        // list_add_ptr(p->rcb.heap_pages, p->heap + i * PAGE_SIZE);
-        if (p->heap_vaddr + i * PAGE_SIZE > USER_HEAP_TOP) {
-            fatalf("process.c (process_new): Heap overflow\n");
-        }
-        rcb_map(&p->rcb, 
-                p->heap_vaddr + i * PAGE_SIZE, 
-                kernel_mmu_translate((uint64_t)p->heap + i * PAGE_SIZE), 
-                PAGE_SIZE,
-                permission_bits);
-    }
-    debugf("Wiping the stack\n");
-    memset(p->stack, 0, p->stack_size);
-    for (uint64_t i = 0; i < p->stack_size / PAGE_SIZE; i++) {
-        // list_add_ptr(p->rcb.stack_pages, p->stack + i * PAGE_SIZE);
-        if (USER_STACK_BOTTOM + i * PAGE_SIZE > USER_STACK_TOP) {
-            fatalf("process.c (process_new): Stack overflow\n");
-        }
-
-        rcb_map(&p->rcb, 
-                p->stack_vaddr - i * PAGE_SIZE, 
-                kernel_mmu_translate((uint64_t)p->stack + i * PAGE_SIZE), 
-                PAGE_SIZE,
-                permission_bits);
+    if (USER_STACK_BOTTOM + p->stack_size - PAGE_SIZE > USER_STACK_TOP) {
+        fatalf("process.c (process_new): Stack overflow\n");
     }
     #ifdef DEBUG_PROCESS
     mmu_print_entries(p->rcb.ptable, MMU_LEVEL_4K);
@@ -648,6 +991,11 @@ int process_free(Process *p)
         list_free(p->rcb.heap_pages);
     }
 
+    if (p->rcb.mmaps) {
+        process_mmap_release_all(p);
+        list_free(p->rcb.mmaps);
+    }
+
     if (p->rcb.file_descriptors) {
         list_for_each(p->rcb.file_descriptors, e) {
             page_free(list_elem_value_ptr(e));
@@ -671,13 +1019,37 @@ int process_free(Process *p)
     }
 
     if (p->rcb.ptable) {
-        page_free(p->rcb.ptable);
+        mmu_free(p->rcb.ptable);
     }
 
     kfree(p);
     return 0;
 }
 
+// Each hart takes its traps on a stack of its own, so two harts trapping at
+// once don't run over each other. Hart 0 boots on the one main sets up. The
+// stacks grow down, so these are their tops.
+static uint64_t hart_trap_stacks[MAX_ALLOWABLE_HARTS];
+static Mutex trap_stacks_lock = MUTEX_UNLOCKED;
+
+static uint64_t hart_trap_stack(unsigned int hart)
+{
+    if (hart == 0 || hart >= MAX_ALLOWABLE_HARTS) {
+        return kernel_trap_frame->trap_stack;
+    }
+    mutex_spinlock(&trap_stacks_lock);
+    if (hart_trap_stacks[hart] == 0) {
+        void *stack = page_znalloc(TRAP_STACK_PAGES);
+        if (stack == NULL) {
+            fatalf("process.c (hart_trap_stack): No memory for the trap stack of hart %u\n", hart);
+        }
+        hart_trap_stacks[hart] = (uint64_t)stack + TRAP_STACK_PAGES * PAGE_SIZE_4K;
+    }
+    uint64_t top = hart_trap_stacks[hart];
+    mutex_unlock(&trap_stacks_lock);
+    return top;
+}
+
 bool process_run(Process *p, unsigned int hart)
 {
     if (p == NULL) {
@@ -686,7 +1058,7 @@ bool process_run(Process *p, unsigned int hart)
     }
 
     void process_asm_run(void *frame_addr);
-    unsigned int me = sbi_whoami();
+    unsigned int me = hart_id();
 
     if (me == hart) {
         if (p->state == PS_DEAD) {
@@ -702,9 +1074,14 @@ bool process_run(Process *p, unsigned int hart)
         // debugf("process.c (process_run): Running process %d on hart %d\n", p->pid, hart);
         if (p->mode == PM_SUPERVISOR) {
             p->frame->sstatus |= SSTATUS_SPP_SUPERVISOR | SSTATUS_SPIE_BIT;
+            // Kernel code reads the hart from tp (see hart_id), and the
+            // trampoline loads tp from the frame
+            p->frame->xregs[XREG_TP] = hart;
         }
+        p->frame->trap_stack = hart_trap_stack(hart);
         // kernel_trap_frame->sie |= SIE_SSIE | SIE_STIE;
         // debugf("Jumping to 0x%08lx\n", (uintptr_t)p->frame->sepc);
+        tlb_activate(p, hart);
         process_asm_run(p->frame);
         
         fatalf("process.c (process_run): process_asm_run returned\n");
@@ -713,11 +1090,19 @@ bool process_run(Process *p, unsigned int hart)
         return false;
     }
 
+    if (p->mode == PM_SUPERVISOR) {
+        p->frame->sstatus |= SSTATUS_SPP_SUPERVISOR | SSTATUS_SPIE_BIT;
+        p->frame->xregs[XREG_TP] = hart;
+    }
+    p->frame->trap_stack = hart_trap_stack(hart);
+    tlb_activate(p, hart);
     return sbi_hart_start(hart, trampoline_thread_start, (unsigned long)p->frame, p->frame->satp);
 }
 
 // Map of all the processes, key is PID.
 static Map *processes;
+// Guards both maps, which every hart looks processes up in
+static Mutex process_maps_lock = MUTEX_UNLOCKED;
 
 // Initialize the processes map, needs to be called before creating the
 // first process.
@@ -732,7 +1117,9 @@ void process_map_set(Process *p)
 {
     mutex_spinlock(&p->lock);
     debugf("process.c (process_map_set): Setting PID %d\n", p->pid);
+    mutex_spinlock(&process_maps_lock);
     map_set_int(processes, p->pid, (MapValue)p);
+    mutex_unlock(&process_maps_lock);
     mutex_unlock(&p->lock);
 }
 
@@ -744,11 +1131,11 @@ void process_map_set(Process *p)
 // Get process stored on the process map using the PID as the key.
 Process *process_map_get(uint16_t pid) 
 {
-    if (!process_map_contains(pid)) {
-        return NULL;
-    }
     MapValue val;
-    if (!map_get_int(processes, pid, &val)) {
+    mutex_spinlock(&process_maps_lock);
+    bool found = map_get_int(processes, pid, &val);
+    mutex_unlock(&process_maps_lock);
+    if (!found) {
         return NULL;
     }
     return (Process *)val;
@@ -756,12 +1143,17 @@ Process *process_map_get(uint16_t pid)
 
 bool process_map_contains(uint16_t pid) 
 {
-    return map_contains_int(processes, pid);
+    mutex_spinlock(&process_maps_lock);
+    bool found = map_contains_int(processes, pid);
+    mutex_unlock(&process_maps_lock);
+    return found;
 }
 
 void process_map_remove(uint16_t pid)
 {
+    mutex_spinlock(&process_maps_lock);
     map_remove_int(processes, pid);
+    mutex_unlock(&process_maps_lock);
 }
 
 // Keep track of the PIDs running on each hart.
@@ -780,7 +1172,9 @@ void pid_harts_map_set(uint32_t hart, uint16_t pid)
 {
     if (hart > MAX_NUM_HARTS - 1)
         fatalf("set_pid_on_hart: Invalid hart number\n");
+    mutex_spinlock(&process_maps_lock);
     map_set_int(pid_on_harts, hart, pid);
+    mutex_unlock(&process_maps_lock);
 }
 
 // Get the PID running on hart
@@ -788,7 +1182,9 @@ uint16_t pid_harts_map_get(uint32_t hart)
 {
     if (hart > MAX_NUM_HARTS - 1)
         fatalf("get_pid_on_hart: Invalid hart number\n");
-    MapValue val;
+    MapValue val = 0;
+    mutex_spinlock(&process_maps_lock);
     map_get_int(pid_on_harts, hart, &val);
+    mutex_unlock(&process_maps_lock);
     return (uint16_t)val;
 }
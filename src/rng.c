@@ -35,7 +35,7 @@ void rng_fill(void *virtual_buffer_address, uint16_t size) {
     }
 
     VirtioDescriptor desc;
-    desc.addr = kernel_mmu_translate((uintptr_t)virtual_buffer_address);
+    desc.addr = kernel_mmu_translate_fast((uintptr_t)virtual_buffer_address);
     desc.len = size;
     desc.flags = VIRTQ_DESC_F_WRITE;
     desc.next = 0;
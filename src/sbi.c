@@ -34,6 +34,16 @@ int sbi_hart_start(unsigned int hart, unsigned long target, unsigned long scratc
     return stat;
 }
 
+int sbi_send_ipi(unsigned int hart)
+{
+    int stat;
+    asm volatile("mv a7, %1\nmv a0, %2\necall\nmv %0, a0\n"
+                 : "=r"(stat)
+                 : "r"(SBI_SVCALL_SEND_IPI), "r"(hart)
+                 : "a0", "a7");
+    return stat;
+}
+
 void sbi_hart_stop(void)
 {
     asm volatile("mv a7, %0\necall\nwfi" : : "r"(SBI_SVCALL_HART_STOP) : "a0", "a7");
@@ -3,7 +3,6 @@ Scheduler - uses completely fair scheduler approach
 */
 
 #include <process.h>
-#include <rbtree.h>
 #include <sched.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -15,9 +14,12 @@ Scheduler - uses completely fair scheduler approach
 #include <trap.h>
 #include <debug.h>
 #include <kmalloc.h>
+#include <page.h>
 #include <lock.h>
 #include <compiler.h>
 #include <config.h>
+#include <util.h>
+#include <cfs.h>
 
 // #define DEBUG_SCHED
 #ifdef DEBUG_SCHED
@@ -26,11 +28,50 @@ Scheduler - uses completely fair scheduler approach
 #define debugf(...)
 #endif
 
-static RBTree *sched_tree;
+/*
+ * Every hart has its own run queue of the processes that are ready to run
+ * on it, so picking the next process only takes that hart's lock. A running
+ * process is on no queue, which is what keeps two harts from picking the
+ * same one. It goes back on the queue of the hart it ran on when it is
+ * switched out.
+ *
+ * Work moves between harts in three ways. A hart whose queue is empty
+ * steals from the busiest queue instead of idling, every SCHED_BALANCE_TICKS
+ * schedules a hart pulls half the difference from the busiest queue, and
+ * sched_add hands a new process to an idle hart (waking it with an IPI) or
+ * starts a parked one for it. No more than one queue lock is ever held.
+ *
+ * Sleeping processes are kept out of the run queue, in a min-heap on the hart
+ * they slept on, ordered by when they wake up. The hart's timer is armed for
+ * the earlier of the end of the time slice and the first wakeup, and the
+ * sleepers that are due are moved to the run queue when it fires.
+ */
+
+typedef struct RunQueue {
+    Mutex lock;
+    // Processes that are ready to run here, lowest vruntime first
+    CfsQueue cfs;
+    // What the hart runs now, and what it runs when there is nothing else.
+    // Harts that can't be started have no idle process.
+    Process *current;
+    Process *idle;
+    // Sleeping processes, a min-heap on sleep_until. Space for one more is
+    // made when a process goes to sleep, so it is never allocated here.
+    Process **sleepers;
+    uint64_t nr_sleeping;
+    uint64_t sleepers_capacity;
+    // Schedules since the hart last balanced its load
+    uint64_t ticks;
+    bool started;
+} RunQueue;
+
+// sbi_hart_get_status of a hart that is parked and can be started
+#define HART_STATUS_PARKED 1
+
+static RunQueue run_queues[MAX_ALLOWABLE_HARTS];
+// Taken to start a hart
 static Mutex sched_lock = MUTEX_UNLOCKED;
 
-static Process *idle_process = NULL, *current_process = NULL;
-
 void sbi_print(char *c) {
     while (*c != '\0') {
         sbi_putchar(*c);
@@ -57,243 +98,341 @@ void idle_process_main() {
         sbi_print("Idle woke up!\n");
         #endif
         // infof("Idle woke up!\n");
-        WFI();
+        // Clear pages ahead of page_zalloc, and only sleep once there is nothing to clear
+        if (!page_zero_pool_refill()) {
+            WFI();
+        }
     }
 }
 
+static RunQueue *sched_queue(int hart) {
+    if (hart < 0 || hart >= MAX_ALLOWABLE_HARTS) {
+        return NULL;
+    }
+    return &run_queues[hart];
+}
+
 Process *sched_get_idle_process() {
-    return idle_process;
+    RunQueue *rq = sched_queue(hart_id());
+    return rq == NULL ? NULL : rq->idle;
+}
+
+static uint64_t rq_nr_queued(RunQueue *rq) {
+    return __atomic_load_n(&rq->cfs.nr_queued, __ATOMIC_RELAXED);
+}
+
+// Take the queued process with the lowest vruntime that is ready to run, or
+// NULL. Dead processes are dropped on the way. Must be called with the
+// queue's lock held.
+static Process *rq_pop_runnable(RunQueue *rq) {
+    Process *p = cfs_first(&rq->cfs);
+    while (p != NULL) {
+        Process *next = cfs_next(p);
+        if (p->state == PS_DEAD) {
+            debugf("rq_pop_runnable: Dropping dead Process %d\n", p->pid);
+            cfs_dequeue(&rq->cfs, p);
+        } else if (p->state == PS_RUNNING) {
+            cfs_dequeue(&rq->cfs, p);
+            return p;
+        }
+        p = next;
+    }
+    return NULL;
+}
+
+// The sleep heap helpers must be called with the queue's lock held.
+static void sleep_swap(RunQueue *rq, uint64_t a, uint64_t b) {
+    Process *tmp = rq->sleepers[a];
+    rq->sleepers[a] = rq->sleepers[b];
+    rq->sleepers[b] = tmp;
+}
+
+static void sleep_sift_down(RunQueue *rq, uint64_t i) {
+    while (true) {
+        uint64_t smallest = i;
+        uint64_t left = 2 * i + 1;
+        uint64_t right = 2 * i + 2;
+        if (left < rq->nr_sleeping && rq->sleepers[left]->sleep_until < rq->sleepers[smallest]->sleep_until) {
+            smallest = left;
+        }
+        if (right < rq->nr_sleeping && rq->sleepers[right]->sleep_until < rq->sleepers[smallest]->sleep_until) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        sleep_swap(rq, i, smallest);
+        i = smallest;
+    }
+}
+
+// There has to be room, see sched_sleep
+static void sleep_push(RunQueue *rq, Process *p) {
+    uint64_t i = rq->nr_sleeping++;
+    rq->sleepers[i] = p;
+    while (i > 0 && rq->sleepers[(i - 1) / 2]->sleep_until > rq->sleepers[i]->sleep_until) {
+        sleep_swap(rq, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static void sleep_remove_at(RunQueue *rq, uint64_t i) {
+    rq->sleepers[i] = rq->sleepers[--rq->nr_sleeping];
+    if (i == rq->nr_sleeping) {
+        return;
+    }
+    // The moved process may belong above or below i
+    while (i > 0 && rq->sleepers[(i - 1) / 2]->sleep_until > rq->sleepers[i]->sleep_until) {
+        sleep_swap(rq, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    sleep_sift_down(rq, i);
 }
 
+// Move the sleepers that are due by `now` to the run queue
+static void sleep_wake_due(RunQueue *rq, uint64_t now) {
+    while (rq->nr_sleeping > 0 && rq->sleepers[0]->sleep_until <= now) {
+        Process *p = rq->sleepers[0];
+        sleep_remove_at(rq, 0);
+        if (p->state != PS_SLEEPING) {
+            debugf("sleep_wake_due: Dropping Process %d, which is no longer asleep\n", p->pid);
+            continue;
+        }
+        debugf("sleep_wake_due: Process %d is ready to run\n", p->pid);
+        p->state = PS_RUNNING;
+        cfs_enqueue(&rq->cfs, p);
+    }
+}
+
+// Each queue's vruntimes count from its own min_vruntime, so a process that
+// moves between harts keeps the lead or lag it had on the old queue.
+static void rebase_vruntime(Process *p, uint64_t from_min, uint64_t to_min) {
+    p->vruntime = p->vruntime > from_min ? p->vruntime - from_min : 0;
+    p->vruntime += to_min;
+}
+
+// The queue other than `hart`'s with the most processes on it, or NULL if they are all empty
+static RunQueue *sched_busiest(int hart) {
+    RunQueue *busiest = NULL;
+    uint64_t most = 0;
+    for (int h = 0; h < MAX_ALLOWABLE_HARTS; h++) {
+        uint64_t queued = rq_nr_queued(&run_queues[h]);
+        if (h != hart && queued > most) {
+            busiest = &run_queues[h];
+            most = queued;
+        }
+    }
+    return busiest;
+}
+
+// Take a process that is ready to run from the busiest other queue, or NULL
+static Process *sched_steal(int hart) {
+    RunQueue *busiest = sched_busiest(hart);
+    if (busiest == NULL) {
+        return NULL;
+    }
+    mutex_spinlock(&busiest->lock);
+    Process *p = rq_pop_runnable(busiest);
+    uint64_t from_min = busiest->cfs.min_vruntime;
+    mutex_unlock(&busiest->lock);
+    if (p != NULL) {
+        rebase_vruntime(p, from_min, run_queues[hart].cfs.min_vruntime);
+        debugf("sched_steal: Hart %d took Process %d\n", hart, p->pid);
+    }
+    return p;
+}
+
+// Pull processes from the busiest queue until it and this hart's are about even
+static void sched_balance(int hart) {
+    RunQueue *rq = &run_queues[hart];
+    RunQueue *busiest = sched_busiest(hart);
+    if (busiest == NULL) {
+        return;
+    }
+    uint64_t mine = rq_nr_queued(rq);
+    uint64_t theirs = rq_nr_queued(busiest);
+    if (theirs <= mine + 1) {
+        return;
+    }
+    for (uint64_t moved = 0; moved < (theirs - mine) / 2; moved++) {
+        mutex_spinlock(&busiest->lock);
+        // The one furthest from running, so the busy hart keeps what it runs next
+        Process *p = cfs_last(&busiest->cfs);
+        if (p != NULL) {
+            cfs_dequeue(&busiest->cfs, p);
+        }
+        uint64_t from_min = busiest->cfs.min_vruntime;
+        mutex_unlock(&busiest->lock);
+        if (p == NULL) {
+            break;
+        }
+        mutex_spinlock(&rq->lock);
+        rebase_vruntime(p, from_min, rq->cfs.min_vruntime);
+        cfs_enqueue(&rq->cfs, p);
+        mutex_unlock(&rq->lock);
+    }
+}
+
+static Process *sched_new_idle(int hart) {
+    Process *idle = process_new(PM_SUPERVISOR);
+    idle->state = PS_RUNNING;
+    idle->hart = hart;
+    idle->quantum = 4;
+    // Never queued, so this only shows in process_debug
+    idle->nice = NICE_MAX;
+    // idle_process_main is in kernel memory, which every page table links in
+    idle->frame->sepc = (uint64_t)idle_process_main;
+    // It runs kernel code, which finds its hart in tp (see hart_id)
+    idle->frame->xregs[XREG_TP] = hart;
+    debugf("sched_new_idle: Idle Process for hart %d created with pid %d\n", hart, idle->pid);
+    return idle;
+}
 
 static bool is_init = false;
-//initialize scheduler tree
+//initialize the run queues and an idle process for every hart that can run
 void sched_init() {
-    mutex_spinlock(&sched_lock);
     process_map_init();
     pid_harts_map_init();
-    sched_tree = rb_new();
-    //create idle Process
-    idle_process = process_new(PM_SUPERVISOR);
-    
-    idle_process->state = PS_RUNNING;
-    idle_process->hart = sbi_whoami();
-    debugf("sched_init: Idle Process created with pid %d\n", idle_process->pid);
-    idle_process->runtime = 1;
-    idle_process->quantum = 4;
-    idle_process->priority = 20;
-    // idle_process->frame->xregs
-    // kfree(p->rcb.ptable);
-    // p->rcb.ptable = kernel_mmu_table;
-    // p->frame = *kernel_trap_frame;
-    // memset(&p->frame, 0, sizeof(TrapFrame));
-    // uint64_t permission_bits = PB_READ | PB_EXECUTE | PB_WRITE | PB_USER;
-
-
-    // p->frame.sepc = kernel_mmu_translate(idle_process_main);
-    // p->frame.sstatus = 0x0000000000000000;
-    // p->frame.stvec = trampoline_trap_start;
-    // p->frame.sscratch = kernel_mmu_translate(&p->frame);
-    // p->frame.satp = SATP(kernel_mmu_translate(p->rcb.ptable), p->pid % 4094 + 2);
-    // p->frame.trap_satp = SATP_KERNEL;
-    // p->frametrap_stack = kzalloc(0x1000);
-    // mmu_map_range(p->rcb.ptable, 
-    //             p->frame.trap_stack, 
-    //             p->frame.trap_stack + 0x10000, 
-    //             kernel_mmu_translate(p->frame.trap_stack), 
-    //             MMU_LEVEL_4K,
-    //             permission_bits);
-    // mmu_map_range(p->rcb.ptable, 
-    //             p->frame.sscratch, 
-    //             p->frame.sscratch + 0x10000, 
-    //             kernel_mmu_translate(p->frame.sscratch),
-    //             MMU_LEVEL_4K,
-    //             permission_bits);
-    // mmu_map_range(p->rcb.ptable,
-    //             p->rcb.ptable,
-    //             p->rcb.ptable + 0x10000,
-    //             kernel_mmu_translate(p->rcb.ptable),
-    //             MMU_LEVEL_4K,
-    //             permission_bits);
-    // mmu_map_range(p->rcb.ptable,
-    //             &p->frame,
-    //             &p->frame + 0x10000,
-    //             kernel_mmu_translate(&p->frame),
-    //             MMU_LEVEL_4K,
-    //             permission_bits);
-
-    // // Add the trap handler to the process's page table
-    // mmu_map_range(p->rcb.ptable,
-    //             p->frame.stvec,
-    //             p->frame.stvec + 0x10000,
-    //             kernel_mmu_translate(p->frame.stvec),
-    //             MMU_LEVEL_4K,
-    //             permission_bits);
-
-    // void process_asm_run(void);
-    // unsigned long trans_trampoline_start = mmu_translate(kernel_mmu_table, trampoline_thread_start);
-    // unsigned long trans_trampoline_trap  = mmu_translate(kernel_mmu_table, trampoline_trap_start);
-    // unsigned long trans_process_asm_run  = mmu_translate(kernel_mmu_table, process_asm_run);
-    // unsigned long trans_os_trap_handler  = mmu_translate(kernel_mmu_table, os_trap_handler);
-    // mmu_map(p->rcb.ptable, trampoline_thread_start, trans_trampoline_start, MMU_LEVEL_4K,
-    //         PB_READ | PB_EXECUTE | PB_USER);
-    // mmu_map(p->rcb.ptable, trampoline_trap_start, trans_trampoline_trap, MMU_LEVEL_4K,
-    //         PB_READ | PB_EXECUTE | PB_USER);
-    // // Map the trap stack
-    // mmu_map(p->rcb.ptable, process_asm_run, trans_process_asm_run, MMU_LEVEL_4K,
-    //         PB_READ | PB_EXECUTE | PB_USER);
-    // mmu_map(p->rcb.ptable, os_trap_handler, trans_os_trap_handler, MMU_LEVEL_4K,
-    //         PB_READ | PB_EXECUTE | PB_USER);
-    // // Map trap frame to user's page table
-    // uintptr_t trans_frame = kernel_mmu_translate((uintptr_t)&p->frame);
-    // mmu_map(p->rcb.ptable, (uintptr_t)&p->frame, trans_frame, MMU_LEVEL_4K, PB_READ | PB_WRITE | PB_EXECUTE | PB_USER);
-    rcb_map(&idle_process->rcb, idle_process_main, idle_process_main, 0x1000, PB_READ | PB_EXECUTE);
-    // mmu_translate(p->rcb.ptable, p->frame.stvec);
-    // CSR_READ(p->frame->sie, "sie");
-    
-    // uint64_t  gpregs[32]; 
-    // double    fpregs[32]; 
-    // uint64_t  sepc;     
-    // uint64_t  sstatus;  
-    // uint64_t  sie;      
-    // uint64_t  satp;     
-    // uint64_t  sscratch; 
-    // uint64_t  stvec;    
-    // uint64_t  trap_satp;
-    // uint64_t  trap_stack;
-
-    // memcpy(idle_process->frame->xregs, kernel_trap_frame->xregs, sizeof(kernel_trap_frame->xregs));
-    // rcb_map(&idle_process->rcb, idle_process_main, idle_process_main, 0x1000, PB_READ | PB_EXECUTE);
-    // rcb_map(&idle_process->rcb, sbi_putchar, sbi_putchar, 0x1000, PB_READ | PB_EXECUTE);
-    // rcb_map(&idle_process->rcb, sbi_get_time, sbi_get_time, 0x1000, PB_READ | PB_EXECUTE);
-    // rcb_map(&idle_process->rcb, sbi_print, sbi_print, 0x1000, PB_READ | PB_EXECUTE);
-    // rcb_map(&idle_process->rcb, &start_time, &start_time, 0x1000, PB_READ | PB_WRITE | PB_EXECUTE);
-    debugf("sched_init: Idle Process RCB initialized\n");
-    // rcb_map(&idle_process->rcb, TE)
-
-    // rcb_map(&idle_process->rcb, sym_start(text), , sym_start(text), MMU_LEVEL_1G,
-    //               PB_READ | PB_WRITE | PB_EXECUTE);
-    // mmu_map(p->rcb.ptable, idle_process_main, idle_process_main, MMU_LEVEL_4K, PB_READ | PB_WRITE | PB_EXECUTE | PB_USER);
-
-    // p->frame.sepc = (uint64_t) idle_process_main;
-    // CSR_READ(p->frame.sstatus, "sstatus");
-    
-    idle_process->runtime += CONTEXT_SWITCH_TIMER;
-    // process_map_set(p);
-    set_current_process(idle_process);
-    //add idle Process to scheduler tree
-    mutex_unlock(&sched_lock);
-    sched_add(idle_process);
-    mutex_spinlock(&sched_lock);
+    int me = hart_id();
+    for (int h = 0; h < MAX_ALLOWABLE_HARTS; h++) {
+        RunQueue *rq = &run_queues[h];
+        rq->lock = MUTEX_UNLOCKED;
+        cfs_init(&rq->cfs);
+        rq->sleepers = NULL;
+        rq->nr_sleeping = 0;
+        rq->sleepers_capacity = 0;
+        rq->current = NULL;
+        rq->ticks = 0;
+        rq->started = h == me;
+        // The other harts stay parked until something is queued for them
+        if (h == me || sbi_hart_get_status(h) == HART_STATUS_PARKED) {
+            rq->idle = sched_new_idle(h);
+        } else {
+            rq->idle = NULL;
+        }
+    }
+    set_current_process(run_queues[me].idle);
+    debugf("sched_init: Scheduler initialized\n");
+}
 
-    // process_debug(p);
-    // Print the next Process to run
-    mutex_unlock(&sched_lock);
-    Process *next_process = sched_get_next();
-    mutex_spinlock(&sched_lock);
+void sched_print_processes() {
+    debugf("sched_print_processes: Printing run queues\n");
+    for (int h = 0; h < MAX_ALLOWABLE_HARTS; h++) {
+        RunQueue *rq = &run_queues[h];
+        if (rq->idle == NULL) {
+            continue;
+        }
+        debugf("  hart %d: %s, running %d, %lu queued\n", h, rq->started ? "started" : "parked",
+               rq->current == NULL ? 0 : rq->current->pid, rq->cfs.nr_queued);
+    }
+}
 
-    if (next_process == NULL) {
-        debugf("sched_init: No Process to run\n");
-    } else if (next_process == sched_get_idle_process()) {
-        debugf("sched_init: First Process to run is idle\n");
-    } else {
-        debugf("sched_init: First Process to run is %d\n", next_process->pid);
+// Bring up a parked hart on its idle process
+static void sched_start_hart(int hart) {
+    RunQueue *rq = &run_queues[hart];
+    Process *idle = rq->idle;
+    idle->frame->sepc = (uint64_t)idle_process_main;
+    idle->frame->xregs[XREG_TP] = hart;
+    idle->hart = hart;
+    idle->ran_at = sbi_get_time();
+    rq->current = idle;
+    pid_harts_map_set(hart, idle->pid);
+    // Its first timer interrupt comes right away and has it look for work
+    sbi_add_timer(hart, 0);
+    if (!process_run(idle, hart)) {
+        warnf("sched_start_hart: Could not start hart %d\n", hart);
+        return;
     }
+    debugf("sched_start_hart: Started hart %d\n", hart);
+}
 
-    debugf("sched_init: Scheduler initialized\n");
-    mutex_unlock(&sched_lock);
+// Pick the hart to queue a new process on: an idle one if there is any,
+// then a parked one, then the one with the shortest queue.
+static int sched_pick_hart(int me) {
+    int parked = -1;
+    int shortest = me;
+    for (int h = 0; h < MAX_ALLOWABLE_HARTS; h++) {
+        RunQueue *rq = &run_queues[h];
+        if (rq->idle == NULL) {
+            continue;
+        }
+        uint64_t queued = rq_nr_queued(rq);
+        if (!rq->started) {
+            if (parked < 0) {
+                parked = h;
+            }
+        } else if (rq->current == rq->idle && queued == 0) {
+            return h;
+        } else if (queued < rq_nr_queued(&run_queues[shortest])) {
+            shortest = h;
+        }
+    }
+    return parked >= 0 ? parked : shortest;
 }
 
-void sched_print_processes() {
+// Get `hart` to look at its queue: start it if it is parked, or interrupt it if it is idle
+static void sched_wake(int hart, int me) {
+    if (hart == me) {
+        return;
+    }
+    RunQueue *rq = &run_queues[hart];
     mutex_spinlock(&sched_lock);
-    debugf("sched_print_processes: Printing scheduler tree\n");
-    
+    bool start = !rq->started;
+    rq->started = true;
     mutex_unlock(&sched_lock);
+    if (start) {
+        sched_start_hart(hart);
+    } else if (rq->current == rq->idle) {
+        sbi_send_ipi(hart);
+    }
 }
 
-static int total_processes = 0;
-
-//adds node to scheduler tree
-void sched_add(Process *p) {  
-    mutex_spinlock(&sched_lock);
+//adds process to a run queue
+void sched_add(Process *p) {
     if (p->state == PS_DEAD) {
         warnf("sched_add: Process %d is dead\n", p->pid);
-        mutex_unlock(&sched_lock);
         return;
     }
-
-    mutex_spinlock(&p->lock);
-    total_processes++;
-    //NOTE: Process key is runtime * priority
-    rb_insert_ptr(sched_tree, p->runtime * p->priority, p);
-    // process_map_set(p);
-    // pid_harts_map_set(p->hart, p->pid);
-    debugf("Scheduled Process %d with runtime %d and priority %d\n", p->pid, p->runtime, p->priority);
-    mutex_unlock(&p->lock);
-    mutex_unlock(&sched_lock);
+    int me = hart_id();
+    int hart = sched_queue(me) == NULL ? 0 : sched_pick_hart(me);
+    RunQueue *rq = &run_queues[hart];
+
+    mutex_spinlock(&rq->lock);
+    // A new process starts at the queue's min_vruntime, see src/cfs.c
+    cfs_enqueue(&rq->cfs, p);
+    mutex_unlock(&rq->lock);
+    debugf("Scheduled Process %d on hart %d with vruntime %lu and nice %d\n", p->pid, hart, p->vruntime, p->nice);
+    sched_wake(hart, me);
 }
 
 void sched_invoke(Process *p, int hart) {
     is_init = true;
     debugf("sched_invoke: Invoking scheduler on hart %d\n", hart);
+    // A running process is on no run queue, see above
     p->hart = hart;
-    sched_add(p);
+    p->ran_at = sbi_get_time();
     process_run(p, hart);
 }
 
-//get (pop) Process with the lowest vruntime
+//take the process with the lowest vruntime off this hart's queue (or another's)
 Process *sched_get_next() {
     debugf("sched_get_next: Getting next Process to run\n");
-    mutex_spinlock(&sched_lock);
-    Process *min_process = NULL;
-    bool search_success = rb_min_val_ptr(sched_tree, &min_process);
-    
-    //implementation of async Process freeing
-    uint64_t i = 0;
-    while (min_process == NULL || min_process->state != PS_RUNNING) {
-        if (i++ > 20) {
-            // Retuning idle Process
-            // warnf("sched_get_next: No Process to run\n");
-            mutex_unlock(&sched_lock);
-            return sched_get_idle_process();
-        }
-
-        debugf("Min Process is %d\n", min_process->pid);
-        if (!process_map_contains(min_process->pid)) {
-            warnf("sched_get_next: Process %d not found in process map\n", min_process->pid);
-            min_process = NULL;
-            break;
-        }
-
-        if (!rb_contains(sched_tree, min_process->runtime * min_process->priority)) {
-            warnf("sched_get_next: Process %d is not in the scheduler\n", min_process->pid);
-            if (!search_success) {
-                min_process = NULL;
-                break;
-            }
-        }
-        // If the process is dead, remove it from the tree
-        if (min_process->state == PS_DEAD) {
-            rb_delete(sched_tree, min_process->runtime * min_process->priority);
-            total_processes-=1;
-        }
-
-        if (min_process->state == PS_SLEEPING) {
-            // Check if the Process is ready to run
-            debugf("sched_get_next: Process %d is sleeping until %d\n", min_process->pid, min_process->sleep_until);
-            if (min_process->sleep_until < sbi_get_time()) {
-                debugf("sched_get_next: Process %d is ready to run\n", min_process->pid);
-                min_process->state = PS_RUNNING;
-                break;
-            } else {
-                debugf("sched_get_next: Process %d is not ready to run\n", min_process->pid);
-            }
-        }
-        search_success = rb_min_val_ptr(sched_tree, &min_process);
+    int hart = hart_id();
+    RunQueue *rq = sched_queue(hart);
+    if (rq == NULL) {
+        return NULL;
     }
-    debugf("sched_get_next: Next Process to run is %d\n", min_process->pid);
-    mutex_unlock(&sched_lock);
-    return min_process;
+    mutex_spinlock(&rq->lock);
+    Process *next = rq_pop_runnable(rq);
+    mutex_unlock(&rq->lock);
+    if (next == NULL) {
+        next = sched_steal(hart);
+    }
+    if (next == NULL) {
+        return rq->idle;
+    }
+    debugf("sched_get_next: Next Process to run is %d\n", next->pid);
+    return next;
 }
 /*
  NOTE: async Process freeing is where if the Process is killed while it is idle 
@@ -341,112 +480,111 @@ void sched_handle_timer_interrupt(int hart) {
     }
 
     debugf("sched_handle_timer_interrupt: hart %d\n", hart);
-    //put Process currently on the hart back in the scheduler to recalc priority
-    // uint16_t pid = pid_harts_map_get(hart);
-    // Process *current_proc = process_map_get(pid);
-    Process *current_proc = sched_get_current();
-    if (current_proc == NULL) {
-        debugf("sched_handle_timer_interrupt: No Process to interrupt\n");
+    RunQueue *rq = sched_queue(hart);
+    if (rq == NULL) {
         return;
     }
-
-    if (current_proc == sched_get_idle_process()) {
-        debugf("sched_handle_timer_interrupt: Idle Process interrupted\n");
-    } else {
-        debugf("sched_handle_timer_interrupt: Process %d interrupted\n", current_proc->pid);
-    }
-    // Remove the Process from the tree
-    rb_delete(sched_tree, current_proc->runtime * current_proc->priority);
-    if (current_proc->state == PS_RUNNING) {
-        current_proc->hart = HART_NONE;
-        // Update the Process's runtime
-        sbi_add_timer(sbi_whoami(), CONTEXT_SWITCH_TIMER);
-
-        current_proc->runtime += CONTEXT_SWITCH_TIMER;
-        current_proc->priority = 1;
-        debugf("sched_handle_timer_interrupt: Process %d quantum is now %d\n", current_proc->pid, current_proc->quantum);
-        debugf("sched_handle_timer_interrupt: Process %d runtime is now %d\n", current_proc->pid, current_proc->runtime);
-        // Add the Process back to the tree
-        debugf("sched_handle_timer_interrupt: Putting Process %d back in scheduler\n", current_proc->pid);
-        
-        // remove_process(current_proc);
-        debugf("sched_handle_timer_interrupt: Putting Process %d back in scheduler\n", current_proc->pid);
-        // sched_add(current_proc);
-        // Print the program counter of the Process that was interrupted
-        debugf("pc: %lx\n", current_proc->frame->sepc);
-        // Print map size
-        // debugf("sched_handle_timer_interrupt: Map size is %d\n", process_map_size());
-    }
-
-    if (current_proc->state != PS_DEAD) {
-        debugf("sched_handle_timer_interrupt: Putting Process %d back in scheduler\n", current_proc->pid);
-        rb_insert_ptr(sched_tree, current_proc->runtime * current_proc->priority, current_proc);
-    } else {
-        total_processes-=1;
-        warnf("sched_handle_timer_interrupt: Process %d is dead\n", current_proc->pid);
+    //charge the Process currently on the hart for the time it ran and put it back in its queue
+    uint64_t now = sbi_get_time();
+    Process *current_proc = rq->current;
+    if (current_proc != NULL && current_proc != rq->idle) {
+        uint64_t delta = now > current_proc->ran_at ? now - current_proc->ran_at : 0;
+        current_proc->runtime += delta;
+        current_proc->vruntime += cfs_scale(delta, current_proc->nice);
+        if (current_proc->state == PS_DEAD) {
+            warnf("sched_handle_timer_interrupt: Process %d is dead\n", current_proc->pid);
+        } else if (current_proc->state == PS_SLEEPING) {
+            debugf("sched_handle_timer_interrupt: Process %d sleeps until %lu\n", current_proc->pid, current_proc->sleep_until);
+            current_proc->hart = HART_NONE;
+            mutex_spinlock(&rq->lock);
+            sleep_push(rq, current_proc);
+            mutex_unlock(&rq->lock);
+        } else {
+            debugf("sched_handle_timer_interrupt: Process %d vruntime is now %lu\n", current_proc->pid, current_proc->vruntime);
+            current_proc->hart = HART_NONE;
+            mutex_spinlock(&rq->lock);
+            cfs_enqueue(&rq->cfs, current_proc);
+            cfs_update_min_vruntime(&rq->cfs);
+            mutex_unlock(&rq->lock);
+        }
     }
 
-    //get an idle Process
-    debugf("sched_handle_timer_interrupt: Getting next Process to run\n");
-    Process *next_process = sched_get_next(); // Implement this function to get the currently running Process
-    if (next_process == NULL) {
-        debugf("sched_handle_timer_interrupt: No Process to run\n");
-        next_process = sched_get_idle_process();
-    }
+    mutex_spinlock(&rq->lock);
+    sleep_wake_due(rq, now);
+    mutex_unlock(&rq->lock);
 
-    if (next_process == sched_get_idle_process() && total_processes > 1 && current_proc != sched_get_idle_process() && current_proc != NULL && current_proc->state != PS_DEAD) {
-        debugf("Short circuiting idle process to execute Process %d\n", current_proc->pid);
-        next_process = current_proc;
+    if (++rq->ticks >= SCHED_BALANCE_TICKS) {
+        rq->ticks = 0;
+        sched_balance(hart);
     }
-    
-    if (next_process == sched_get_idle_process()) {
+
+    Process *next_process = sched_get_next();
+    if (next_process == NULL || next_process == rq->idle) {
+        next_process = rq->idle;
         next_process->frame->sepc = (uint64_t) idle_process_main;
         debugf("sched_handle_timer_interrupt: Next Process to run is idle\n");
     } else {
         debugf("sched_handle_timer_interrupt: Next Process to run is %d\n", next_process->pid);
     }
-    //execute Process until next interrupt
-    if (next_process != NULL) {
-        set_current_process(next_process);
-        //set timer
-        sbi_add_timer(hart, CONTEXT_SWITCH_TIMER);
-        // debugf("sched_handle_timer_interrupt: Running Process %d\n", next_process->pid);
-        // load_state(&next_process->frame);
-        process_run(next_process, hart);
-    } else {
-        debugf("sched_handle_timer_interrupt: No Process to run\n");
+    next_process->ran_at = now;
+    //execute Process until the slice is up or the next sleeper is due
+    uint64_t deadline = now + CONTEXT_SWITCH_TIMER;
+    mutex_spinlock(&rq->lock);
+    if (rq->nr_sleeping > 0 && rq->sleepers[0]->sleep_until < deadline) {
+        deadline = rq->sleepers[0]->sleep_until;
     }
-    // CSR_READ(current_proc->frame->sepc, "sepc");
-
-    // unsigned long time_slice = get_time_slice(); // Implement this function based on the timer configuration
-    // sched_update_vruntime(current_process, time_slice);
-    // Process *next_process = sched_choose_next();
-    // if (next_process != current_process) {
-    //     context_switch(current_process, next_process); // Implement context_switch function
-    // }
+    mutex_unlock(&rq->lock);
+    sbi_add_timer(hart, deadline > now ? deadline - now : 0);
+    process_run(next_process, hart);
     debugf("sched_handle_timer_interrupt: hart %d done\n", hart);
 }
 
-void sched_remove(Process *p) {
-    mutex_spinlock(&sched_lock);
-    debugf("sched_remove: Removing Process %d from scheduler\n", p->pid);
-    // rb_delete(sched_tree, p->runtime * p->priority);
-    // Find the process in the tree
-    Process *found_process;
-    rb_find(sched_tree, p->runtime * p->priority, (uint64_t*)&found_process);
-    if (found_process == NULL) {
-        debugf("sched_remove: Process %d not found in scheduler\n", p->pid);
-        mutex_unlock(&sched_lock);
-        return;
+bool sched_sleep(Process *p, uint64_t until) {
+    RunQueue *rq = sched_queue(hart_id());
+    if (rq == NULL) {
+        return false;
     }
-    if (found_process == p) {
-        debugf("sched_remove: Removing Process %d from scheduler\n", p->pid);
-        rb_delete(sched_tree, p->runtime * p->priority);
-    } else {
-        debugf("sched_remove: Process %d not found in scheduler\n", p->pid);
+    mutex_spinlock(&rq->lock);
+    if (rq->nr_sleeping == rq->sleepers_capacity) {
+        uint64_t capacity = rq->sleepers_capacity == 0 ? 16 : rq->sleepers_capacity * 2;
+        Process **sleepers = (Process **)kcalloc(capacity, sizeof(Process *));
+        if (sleepers == NULL) {
+            mutex_unlock(&rq->lock);
+            return false;
+        }
+        if (rq->sleepers != NULL) {
+            memcpy(sleepers, rq->sleepers, rq->nr_sleeping * sizeof(Process *));
+            kfree(rq->sleepers);
+        }
+        rq->sleepers = sleepers;
+        rq->sleepers_capacity = capacity;
     }
+    p->sleep_until = until;
+    p->state = PS_SLEEPING;
+    mutex_unlock(&rq->lock);
+    return true;
+}
 
-    mutex_unlock(&sched_lock);
+void sched_remove(Process *p) {
+    debugf("sched_remove: Removing Process %d from scheduler\n", p->pid);
+    for (int h = 0; h < MAX_ALLOWABLE_HARTS; h++) {
+        RunQueue *rq = &run_queues[h];
+        mutex_spinlock(&rq->lock);
+        if (p->sched_node.queue == &rq->cfs) {
+            cfs_dequeue(&rq->cfs, p);
+            mutex_unlock(&rq->lock);
+            return;
+        }
+        for (uint64_t i = 0; i < rq->nr_sleeping; i++) {
+            if (rq->sleepers[i] == p) {
+                sleep_remove_at(rq, i);
+                mutex_unlock(&rq->lock);
+                return;
+            }
+        }
+        mutex_unlock(&rq->lock);
+    }
+    debugf("sched_remove: Process %d not found in scheduler\n", p->pid);
 }
 
 // void context_switch(Process *from, Process *to) {
@@ -482,21 +620,12 @@ void sched_remove(Process *p) {
 // }
 
 Process *sched_get_current(void) {
-    mutex_spinlock(&sched_lock);
     if (!is_init) {
         debugf("sched_get_current: Scheduler not initialized\n");
-        mutex_unlock(&sched_lock);
         return NULL;
     }
-    // return current_process;
-    int hart = sbi_whoami();
-    uint16_t pid = pid_harts_map_get(hart);
-    if (!process_map_contains(pid)) {
-        fatalf("sched_get_current: Process %d not found on hart %d\n", pid, hart);
-    }
-    Process *p = process_map_get(pid);
-    mutex_unlock(&sched_lock);
-    return p;
+    RunQueue *rq = sched_queue(hart_id());
+    return rq == NULL ? NULL : rq->current;
 }
 
 // //amount of time before hart is interrupted
@@ -508,16 +637,18 @@ void set_current_process(Process *proc) {
         warnf("set_current_process: Process is NULL\n");
         return;
     }
+    int hart = hart_id();
+    RunQueue *rq = sched_queue(hart);
     mutex_spinlock(&proc->lock);
-    
+
     if (!process_map_contains(proc->pid)) {
         fatalf("set_current_process: Process %d not found\n", proc->pid);
-    } else {
-        // debugf("set_current_process: Process %d found\n", proc->pid);
     }
-    pid_harts_map_set(sbi_whoami(), proc->pid);
-    proc->hart = sbi_whoami();
-    current_process = proc;
+    pid_harts_map_set(hart, proc->pid);
+    proc->hart = hart;
+    if (rq != NULL) {
+        rq->current = proc;
+    }
 
     mutex_unlock(&proc->lock);
 }
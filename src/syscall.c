@@ -16,6 +16,7 @@
 #include <virtio.h>
 #include <gpu.h>
 #include <uaccess.h>
+#include <pcache.h>
 
 // #define SYSCALL_DEBUG
 #ifdef SYSCALL_DEBUG
@@ -81,33 +82,27 @@ SYSCALL(get_env)
     const char *var_vaddr = (const char *)XREG(A0);
     Process *p = sched_get_current();
 
-    const char *var_paddr = mmu_translate(p->rcb.ptable, (uintptr_t)var_vaddr);
-    if (var_paddr == -1UL) {
-        XREG(A0) = -EFAULT;
+    char var[USER_STRING_MAX];
+    long err = strncpy_from_user(var, p->rcb.ptable, var_vaddr, sizeof(var));
+    if (err < 0) {
+        XREG(A0) = err;
         return;
     }
 
-    debugf("syscall.c (get_env): Getting env var %s\n", (char *)var_paddr);
+    debugf("syscall.c (get_env): Getting env var %s\n", var);
     
     // Get the value pointer from the process
-    const char *value = process_get_env(p, (char *)var_paddr);
+    const char *value = process_get_env(p, var);
     if (!value) {
-        debugf("syscall.c (get_env): Env var %s not found\n", (char *)var_paddr);
+        debugf("syscall.c (get_env): Env var %s not found\n", var);
         XREG(A0) = -ENOENT;
         return;
     }
     debugf("syscall.c (get_env): Got env var %s\n", value);
 
     // Copy the value to the user address
-    uintptr_t value_vaddr = XREG(A1);
-    // debugf("syscall.c (get_env): Copying env var %s to %lx\n", value, value_vaddr);
-    uintptr_t value_paddr = mmu_translate(p->rcb.ptable, value_vaddr);
-    if (value_paddr == -1UL) {
-        XREG(A0) = -EFAULT;
-        return;
-    }
-    // Copy the value to the user address
-    memcpy((void *)value_paddr, value, strlen(value) + 1);
+    void *value_vaddr = (void *)XREG(A1);
+    XREG(A0) = copy_to_user(value_vaddr, p->rcb.ptable, value, strlen(value) + 1);
 }
 
 SYSCALL(put_env)
@@ -116,30 +111,24 @@ SYSCALL(put_env)
     debugf("syscall.c (put_env) with args: %lx %lx %lx %lx %lx %lx\n", XREG(A0), XREG(A1), XREG(A2), XREG(A3), XREG(A4), XREG(A5));
 
     const char *var_vaddr = (const char *)XREG(A0);
+    const char *value_vaddr = (const char *)XREG(A1);
     Process *p = sched_get_current();
 
-    const char *var_paddr = mmu_translate(p->rcb.ptable, (uintptr_t)var_vaddr);
-    if (var_paddr == -1UL) {
-        debugf("syscall.c (put_env): MMU translated to null\n");
-        XREG(A0) = -EFAULT;
-        return;
+    char var[USER_STRING_MAX];
+    char value[USER_STRING_MAX];
+    long err = strncpy_from_user(var, p->rcb.ptable, var_vaddr, sizeof(var));
+    if (err >= 0) {
+        err = strncpy_from_user(value, p->rcb.ptable, value_vaddr, sizeof(value));
     }
-
-    debugf("syscall.c (get_env): Getting env var %s\n", (char *)var_paddr);
-    
-    // Copy the value from the user address to the process
-    uintptr_t value_vaddr = XREG(A1);
-    // debugf("syscall.c (get_env): Copying env var %s to %lx\n", value, value_vaddr);
-    uintptr_t value_paddr = mmu_translate(p->rcb.ptable, value_vaddr);
-    if (value_paddr == -1UL) {
-        debugf("syscall.c (put_env): MMU translated to null\n");
-        XREG(A0) = -EFAULT;
+    if (err < 0) {
+        debugf("syscall.c (put_env): Could not copy the arguments in\n");
+        XREG(A0) = err;
         return;
     }
 
     // Copy the value to the process
-    process_put_env(p, (char *)var_paddr, (char *)value_paddr);
-    debugf("syscall.c (put_env): Put env var %s\n", (char *)value_paddr);
+    process_put_env(p, var, value);
+    debugf("syscall.c (put_env): Put env var %s\n", value);
 }
 
 SYSCALL(pid_get_env)
@@ -154,7 +143,7 @@ SYSCALL(pid_get_env)
     // Get the second argument, the variable name
     const char *var_vaddr = (const char *)XREG(A1);
     // Get the third argument, the buffer to write the value to
-    const char *value_vaddr = (const char *)XREG(A2);
+    char *value_vaddr = (char *)XREG(A2);
     debugf("syscall.c (pid_get_env): Got PID %d\n", pid);
     pid %= PID_LIMIT;
     debugf("syscall.c (pid_get_env): Got var vaddr %p\n", var_vaddr);
@@ -171,38 +160,28 @@ SYSCALL(pid_get_env)
         debugf("syscall.c (pid_get_env): Process %d found\n", pid);
     }
 
-    // Translate the variable name to a physical address
-    const char *var_paddr = mmu_translate(parent->rcb.ptable, (uintptr_t)var_vaddr);
-    if (var_paddr == -1UL) {
-        warnf("syscall.c (pid_get_env): MMU translated to null\n");
-        // MMU translated to null
-        XREG(A0) = -EFAULT;
+    // Copy the variable name in from the caller
+    char var[USER_STRING_MAX];
+    long err = strncpy_from_user(var, parent->rcb.ptable, var_vaddr, sizeof(var));
+    if (err < 0) {
+        warnf("syscall.c (pid_get_env): Could not copy the variable name\n");
+        XREG(A0) = err;
         return;
     } else {
-        debugf("syscall.c (pid_get_env): Var %s found\n", (char *)var_paddr);
-    }
-    
-    const char *value_paddr = mmu_translate(parent->rcb.ptable, (uintptr_t)value_vaddr);
-    if (value_paddr == -1UL) {
-        warnf("syscall.c (pid_get_env): MMU translated to null\n");
-        // MMU translated to null
-        XREG(A0) = -EFAULT;
-        return;
-    } else {
-        debugf("syscall.c (pid_get_env): Value %s found\n", (char *)value_paddr);
+        debugf("syscall.c (pid_get_env): Var %s found\n", var);
     }
 
     // Get the value pointer from the process
-    const char *value = process_get_env(p, (char *)var_paddr);
+    const char *value = process_get_env(p, var);
     if (!value) {
-        warnf("syscall.c (pid_get_env): Env var %s not found\n", (char *)var_paddr);
+        warnf("syscall.c (pid_get_env): Env var %s not found\n", var);
         // Env var not found
         XREG(A0) = -ENOENT;
         return;
     } else {
         debugf("syscall.c (pid_get_env): Got env var %s\n", value);
     }
-    memcpy((void *)value_paddr, value, strlen(value) + 1);
+    XREG(A0) = copy_to_user(value_vaddr, parent->rcb.ptable, value, strlen(value) + 1);
 }
 
 SYSCALL(pid_put_env)
@@ -236,29 +215,23 @@ SYSCALL(pid_put_env)
         debugf("syscall.c (pid_put_env): Process %d found\n", pid);
     }
 
-    // Translate the variable name to a physical address
-    const char *var_paddr = mmu_translate(parent->rcb.ptable, (uintptr_t)var_vaddr);
-    if (var_paddr == -1UL) {
-        warnf("syscall.c (pid_put_env): MMU translated to null\n");
-        // MMU translated to null
-        XREG(A0) = -EFAULT;
-        return;
-    } else {
-        debugf("syscall.c (pid_put_env): Var %s found\n", (char *)var_paddr);
+    // Copy the variable name and value in from the caller
+    char var[USER_STRING_MAX];
+    char value[USER_STRING_MAX];
+    long err = strncpy_from_user(var, parent->rcb.ptable, var_vaddr, sizeof(var));
+    if (err >= 0) {
+        err = strncpy_from_user(value, parent->rcb.ptable, value_vaddr, sizeof(value));
     }
-
-    const char *value_paddr = mmu_translate(parent->rcb.ptable, (uintptr_t)value_vaddr);
-    if (value_paddr == -1UL) {
-        warnf("syscall.c (pid_put_env): MMU translated to null\n");
-        // MMU translated to null
-        XREG(A0) = -EFAULT;
+    if (err < 0) {
+        warnf("syscall.c (pid_put_env): Could not copy the arguments in\n");
+        XREG(A0) = err;
         return;
     } else {
-        debugf("syscall.c (pid_put_env): Value %s found\n", (char *)value_paddr);
+        debugf("syscall.c (pid_put_env): Var %s = %s\n", var, value);
     }
 
     // Copy the value to the process
-    process_put_env(p, (char *)var_paddr, (char *)value_paddr);
+    process_put_env(p, var, value);
 }
 
 
@@ -321,14 +294,17 @@ SYSCALL(sleep)
     if (!p) {
         fatalf("syscall.c (sleep): Null process on hart %d", p->hart);
     }
-    // // Sleep the process. VIRT_TIMER_FREQ is 10MHz, divided by 1000, we get 10KHz
-
-    /*
-    // Commented out until we implement an IO buffer for the process
-    */
-    debugf("syscall.c (sleep) Sleeping PID %d at %d until %d\n", p->pid, sbi_get_time(), sbi_get_time() + XREG(A0) * VIRT_TIMER_FREQ / 1000);
-    // p->sleep_until = sbi_get_time() + XREG(A0) * VIRT_TIMER_FREQ / 1000;
-    // p->state = PS_SLEEPING;
+    if (XREG(A0) <= 0) {
+        return;
+    }
+    // Sleep the process. VIRT_TIMER_FREQ is 10MHz, divided by 1000, we get 10KHz
+    uint64_t until = sbi_get_time() + XREG(A0) * VIRT_TIMER_FREQ / 1000;
+    debugf("syscall.c (sleep) Sleeping PID %d at %d until %d\n", p->pid, sbi_get_time(), until);
+    // The process leaves the hart once the syscall is done (see src/trap.c),
+    // and its hart's timer wakes it up
+    if (!sched_sleep(p, until)) {
+        warnf("syscall.c (sleep): Could not put process %d to sleep\n", p->pid);
+    }
 }
 
 SYSCALL(events)
@@ -359,46 +335,37 @@ SYSCALL(events)
     }
 
     InputDevice *keyboard = input_device_get_keyboard();
-    VirtioInputEvent *event;
+    VirtioInputEvent event;
 
     mutex_spinlock(&keyboard->lock);
     
-    uintptr_t event_buffer = scratch[XREG_A0];
+    VirtioInputEvent *event_buffer = (VirtioInputEvent *)scratch[XREG_A0];
     unsigned max_events = scratch[XREG_A1];
 
     uint64_t i;
     for (i = 0; i < max_events && i < keyboard->buffer_count; ++i) {
-        uintptr_t phys_start = mmu_translate(p->rcb.ptable, event_buffer + i * 8);
-        uintptr_t phys_end = mmu_translate(p->rcb.ptable, event_buffer + (i + 1) * 8 - 1);
-        
-        if (phys_start == -1UL && phys_end == -1UL) {
-            debugf("syscall.c (events): MMU translated to null\n");
+        if (!input_device_buffer_pop(keyboard, &event)) {
+            debugf("syscall.c (events): Couldn't get an event from the input device buffer\n\n");
             break;
         }
 
-        if (!input_device_buffer_pop(keyboard, event)) {
-            debugf("syscall.c (events): Couldn't get an event from the input device buffer\n\n");
+        if (copy_to_user(&event_buffer[i], p->rcb.ptable, &event, sizeof(event)) < 0) {
+            debugf("syscall.c (events): Event buffer is not mapped\n");
             break;
         }
-        
-        memcpy((void *)phys_start, event, 8);
-        kfree(event);
     }
 
     mutex_unlock(&keyboard->lock);
     scratch[XREG_A0] = i;
 }
 
-SYSCALL(screen_draw)
+// Draw a buffer to the screen for screen_draw and screen_draw_flags
+static void do_screen_draw(SYSCALL_PARAM_LIST, uint32_t flags)
 {
     SYSCALL_ENTER();
     debugf("syscall.c (screen_draw): Drawing\n");
 
     Process *proc = sched_get_current();
-    // p->state = PS_WAITING;
-
-    // p->sleep_until = sbi_get_time() + VIRT_TIMER_FREQ / 1000000;
-    // p->state = PS_SLEEPING;
     debugf("syscall.c (screen_draw): Got process %d\n", proc->pid);
 
     // Get the first argument, the buffer to draw
@@ -415,114 +382,111 @@ SYSCALL(screen_draw)
     uint64_t y_scale = XREG(A3);
     debugf("syscall.c (screen_draw): Got scale %d\n", y_scale);
 
-    // Translate the buffer to a physical address
-    const Pixel *buf_paddr = mmu_translate(proc->rcb.ptable, (uintptr_t)buf_vaddr);
-    if (buf_paddr == -1UL) {
-        warnf("syscall.c (screen_draw): MMU translated to null\n");
-        // MMU translated to null
+    // Copy the rectangle in from the process
+    Rectangle rect;
+    if (copy_from_user(&rect, proc->rcb.ptable, rect_vaddr, sizeof(Rectangle)) < 0) {
+        warnf("syscall.c (screen_draw): Rect %p is not mapped\n", rect_vaddr);
         XREG(A0) = -EFAULT;
         return;
-    } else {
-        debugf("syscall.c (screen_draw): Buffer %p found\n", (char *)buf_paddr);
     }
 
-    const Rectangle *rect_paddr = mmu_translate(proc->rcb.ptable, (uintptr_t)rect_vaddr);
-    if (rect_paddr == -1UL) {
-        warnf("syscall.c (screen_draw): MMU translated to null\n");
-        // MMU translated to null
-        XREG(A0) = -EFAULT;
-        return;
-    } else {
-        debugf("syscall.c (screen_draw): Rect %p found\n", (char *)rect_paddr);
-    }
-
-    debugf("syscall.c (screen_draw): Drawing to %d %d %d %d\n", rect_paddr->x, rect_paddr->y, rect_paddr->width, rect_paddr->height);
+    debugf("syscall.c (screen_draw): Drawing to %d %d %d %d\n", rect.x, rect.y, rect.width, rect.height);
 
-    Console *console = gpu_get_console();
-    debugf("Console at %p\n", console);
-    Pixel *frame_buf = gpu_get_frame_buf();
     Rectangle *screen_rect = gpu_get_screen_rect();
     uint32_t screen_width = screen_rect->width;
     uint32_t screen_height = screen_rect->height;
     debugf("Screen width %d\n", screen_width);
     debugf("Screen height %d\n", screen_height);
 
-    uint32_t base_x = rect_paddr->x;
-    uint32_t base_y = rect_paddr->y;
-    uint32_t width = rect_paddr->width;
-    uint32_t height = rect_paddr->height;
-
-    // Draw the buffer
-    // for (unsigned y_ = 0; y_ < height; ++y_) {
-    //     for (unsigned x_ = 0; x_ < width; ++x_) {
-    //         if (base_x + x_ >= screen_width || base_y + y_ >= screen_height) {
-    //             continue;
-    //         }
-    //         // debugf("syscall.c (screen_draw): Drawing pixel %d %d\n", x + x_, y + y_);
-    //         frame_buf[(base_y + y_) * screen_width + (base_x + x_)] = buf_paddr[y_ * width + x_];
-    //     }
-    // }
+    uint32_t base_x = rect.x;
+    uint32_t base_y = rect.y;
+    uint32_t width = rect.width;
+    uint32_t height = rect.height;
+
     XREG(A0) = 0;
-    // for (uint32_t y=0; y < height * y_scale; y += y_scale) {
-    //     for (uint32_t x=0; x < width * x_scale; x += x_scale) {
-    //         uint32_t frame_buf_x = base_x + x;
-    //         uint32_t frame_buf_y = base_y + y;
-    //         uint32_t frame_buff_offset = frame_buf_y * screen_width + frame_buf_x;
-    //         if (frame_buf_x >= screen_width || frame_buf_y >= screen_height) {
-    //             XREG(A0) = -EFAULT;
-    //             continue;
-    //         }
-    //         uint32_t user_buf_x = x / x_scale;
-    //         uint32_t user_buf_y = y / y_scale;
-    //         uint32_t user_buf_offset = user_buf_y * width + user_buf_x;
-    //         Pixel p = buf_paddr[user_buf_offset];
-    //         debugf("syscall.c (screen_draw): Drawing pixel r=%d g=%d b=%d a=%d at (%d,%d)\n", p.r, p.g, p.b, p.a, frame_buf_x, frame_buf_y);
-    //         for (uint32_t sy = 0; sy < y_scale; ++sy) {
-    //             for (uint32_t sx = 0; sx < x_scale; ++sx) {
-    //                 uint32_t frame_buf_x = base_x + x + sx;
-    //                 uint32_t frame_buf_y = base_y + y + sy;
-    //                 uint32_t frame_buff_offset = frame_buf_y * screen_width + frame_buf_x;
-    //                 if (frame_buf_x >= screen_width || frame_buf_y >= screen_height) {
-    //                     XREG(A0) = -EFAULT;
-    //                     continue;
-    //                 }
-    //                 // If the pixel is non-zero, print it
-    //                 if (p.r || p.g || p.b || p.a) {
-    //                     // debugf("syscall.c (screen_draw): Drawing pixel r=%d g=%d b=%d a=%d at (%d,%d)\n", p.r, p.g, p.b, p.a, frame_buf_x, frame_buf_y);
-    //                 }
-    //                 frame_buf[frame_buff_offset] = p;
-    //             }
-    //         }
-
-    //     }
-    // }
+    if (x_scale == 0 || y_scale == 0 || width == 0 || height == 0) {
+        return;
+    }
+
+    // Clip the scaled rectangle to the screen once, up front
+    uint64_t scaled_width = width * x_scale;
+    uint64_t scaled_height = height * y_scale;
+    uint64_t visible_width = base_x < screen_width ? screen_width - base_x : 0;
+    uint64_t visible_height = base_y < screen_height ? screen_height - base_y : 0;
+    if (visible_width > scaled_width) {
+        visible_width = scaled_width;
+    }
+    if (visible_height > scaled_height) {
+        visible_height = scaled_height;
+    }
+    if (visible_width < scaled_width || visible_height < scaled_height) {
+        // Part of the rectangle is off the screen
+        XREG(A0) = -EFAULT;
+    }
+    if (visible_width == 0 || visible_height == 0) {
+        return;
+    }
+
+    // Only the source pixels that land on the screen are needed
+    uint32_t src_cols = (visible_width + x_scale - 1) / x_scale;
+    uint32_t src_rows = (visible_height + y_scale - 1) / y_scale;
+    uint64_t src_row_bytes = src_cols * sizeof(Pixel);
+    // Used when a source row is split across pages that are not physically adjacent
+    Pixel *row_copy = NULL;
+
+    for (uint32_t src_y = 0; src_y < src_rows; ++src_y) {
+        // Use the row in place if it is physically contiguous, otherwise copy it
+        const Pixel *row;
+        UserCursor cursor;
+        user_cursor_init(&cursor, proc->rcb.ptable, &buf_vaddr[(uint64_t)src_y * width], src_row_bytes, false);
+        void *paddr;
+        long length = user_cursor_next(&cursor, &paddr);
+        if (length == (long)src_row_bytes) {
+            row = (const Pixel *)paddr;
+        } else {
+            if (row_copy == NULL) {
+                row_copy = (Pixel *)kmalloc(src_row_bytes);
+            }
+            if (row_copy == NULL
+                || copy_from_user(row_copy, proc->rcb.ptable, &buf_vaddr[(uint64_t)src_y * width], src_row_bytes) < 0) {
+                warnf("syscall.c (screen_draw): Buffer %p is not mapped\n", buf_vaddr);
+                XREG(A0) = row_copy == NULL ? -ENOMEM : -EFAULT;
+                break;
+            }
+            row = row_copy;
+        }
 
-    // Draw the buffer scaled by `scale`
-    for (unsigned y_ = 0; y_ < height; ++y_) {
-        for (unsigned x_ = 0; x_ < width; ++x_) {
-            // if (x + x_ * x_scale >= screen_width || y + y_ * y_scale >= screen_height) {
-            //     XREG(A0) = -EFAULT;
-            //     continue;
-            // }
-            Pixel p = *(Pixel*)mmu_translate(proc->rcb.ptable, &buf_vaddr[y_ * width + x_]);
-            // debugf("syscall.c (screen_draw): Drawing pixel %d %d = (r=%d g=%d b=%d a=%d)\n", x_ * x_scale, y_ * y_scale, p.r, p.g, p.b, p.a);
-            for (unsigned sy = 0; sy < y_scale; ++sy) {
-                for (unsigned sx = 0; sx < x_scale; ++sx) {
-                    uint64_t x_pos = base_x + x_ * x_scale + sx;
-                    uint64_t y_pos = base_y + y_ * y_scale + sy;
-
-                    if (x_pos >= screen_width || y_pos >= screen_height) {
-                        XREG(A0) = -EFAULT;
-                        continue;
-                    }
-
-                    frame_buf[y_pos * screen_width + x_pos] = p;
-                }
+        // Draw the row once, then repeat it for the rest of its scaled height
+        uint32_t y = base_y + src_y * y_scale;
+        uint32_t rows = base_y + visible_height - y;
+        if (rows > y_scale) {
+            rows = y_scale;
+        }
+        gpu_blit_row(base_x, y, visible_width, row, x_scale, flags);
+        for (uint32_t sy = 1; sy < rows; ++sy) {
+            if (flags & GPU_BLIT_ALPHA_SKIP) {
+                // The skipped pixels show what was underneath, which differs per row
+                gpu_blit_row(base_x, y + sy, visible_width, row, x_scale, flags);
+            } else {
+                gpu_blit_copy_row(base_x, y, y + sy, visible_width);
             }
         }
     }
+    if (row_copy != NULL) {
+        kfree(row_copy);
+    }
     debugf("syscall.c (screen_draw): Drawn\n");
-    
+}
+
+SYSCALL(screen_draw)
+{
+    do_screen_draw(hart, epc, scratch, 0);
+}
+
+SYSCALL(screen_draw_flags)
+{
+    // Like screen_draw, with blit flags such as GPU_BLIT_ALPHA_SKIP in a4
+    do_screen_draw(hart, epc, scratch, XREG(A4));
 }
 
 SYSCALL(screen_get_dims)
@@ -540,18 +504,12 @@ SYSCALL(screen_get_dims)
     const Rectangle *rect_vaddr = (const Rectangle *)XREG(A0);
     debugf("syscall.c (screen_draw): Got rect vaddr %p\n", rect_vaddr);
 
-    // Translate the buffer to a physical address
-    const Pixel *rect_paddr = mmu_translate(p->rcb.ptable, (uintptr_t)rect_vaddr);
-
-    if (rect_paddr == -1UL) {
-        warnf("syscall.c (screen_draw): MMU translated to null\n");
-        // MMU translated to null
+    // Copy the screen dimensions out to the process
+    if (copy_to_user((void *)rect_vaddr, p->rcb.ptable, gpu_get_screen_rect(), sizeof(Rectangle)) < 0) {
+        warnf("syscall.c (screen_get_dims): Rect %p is not mapped\n", rect_vaddr);
         XREG(A0) = -EFAULT;
         return;
-    } else {
-        debugf("syscall.c (screen_draw): Rect %p found\n", (char *)rect_paddr);
     }
-    memcpy((void *)rect_paddr, gpu_get_screen_rect(), sizeof(Rectangle));
     XREG(A0) = 0;
 
 }
@@ -568,20 +526,12 @@ SYSCALL(screen_flush) {
     debugf("syscall.c (screen_flush): Got rect vaddr %p\n", rect_vaddr);
     if (rect_vaddr) {
         debugf("syscall.c (screen_flush): Flushing rectangle\n");
-        // Translate the buffer to a physical address
-        const Rectangle *rect_paddr = mmu_translate(p->rcb.ptable, (uintptr_t)rect_vaddr);
-        if (rect_paddr == -1UL) {
-            warnf("syscall.c (screen_flush): MMU translated to null\n");
-            // MMU translated to null
+        Rectangle rect;
+        if (copy_from_user(&rect, p->rcb.ptable, rect_vaddr, sizeof(Rectangle)) < 0) {
+            warnf("syscall.c (screen_flush): Rect %p is not mapped\n", rect_vaddr);
             XREG(A0) = -EFAULT;
             return;
-        } else {
-            debugf("syscall.c (screen_flush): Rect %p found\n", (char *)rect_paddr);
         }
-
-        // Rectangle rect;
-        // copy_from(&rect, p->rcb.ptable, rect_vaddr, sizeof(Rectangle));
-        Rectangle rect = *rect_paddr;
         debugf("Found rect %d %d %d %d\n", rect.x, rect.y, rect.width, rect.height);
         gpu_transfer_to_host_2d(gpu_get_screen_rect(), 1, 0);
         gpu_flush(rect);
@@ -607,21 +557,14 @@ SYSCALL(get_keyboard_event)
     
     VirtioInputEvent event = keyboard_get_next_event();
 
-    // Translate the buffer to a physical address
-    const VirtioInputEvent *event_vaddr = (const VirtioInputEvent *)XREG(A0);
-    const VirtioInputEvent *event_paddr = mmu_translate(p->rcb.ptable, (uintptr_t)event_vaddr);
-
-    if (event_paddr == -1UL) {
-        warnf("syscall.c (get_keyboard_event): MMU translated to null\n");
-        // MMU translated to null
+    // Copy the event out to the process
+    VirtioInputEvent *event_vaddr = (VirtioInputEvent *)XREG(A0);
+    if (copy_to_user(event_vaddr, p->rcb.ptable, &event, sizeof(VirtioInputEvent)) < 0) {
+        warnf("syscall.c (get_keyboard_event): Event %p is not mapped\n", event_vaddr);
         XREG(A0) = -EFAULT;
         return;
-    } else {
-        debugf("syscall.c (get_keyboard_event): Event %p found\n", (char *)event_paddr);
     }
 
-    memcpy((void *)event_paddr, &event, sizeof(VirtioInputEvent));
-
     XREG(A0) = 0;
 }
 
@@ -633,21 +576,14 @@ SYSCALL(get_tablet_event)
     
     VirtioInputEvent event = tablet_get_next_event();
 
-    // Translate the buffer to a physical address
-    const VirtioInputEvent *event_vaddr = (const VirtioInputEvent *)XREG(A0);
-    const VirtioInputEvent *event_paddr = mmu_translate(p->rcb.ptable, (uintptr_t)event_vaddr);
-
-    if (event_paddr == -1UL) {
-        warnf("syscall.c (get_tablet_event): MMU translated to null\n");
-        // MMU translated to null
+    // Copy the event out to the process
+    VirtioInputEvent *event_vaddr = (VirtioInputEvent *)XREG(A0);
+    if (copy_to_user(event_vaddr, p->rcb.ptable, &event, sizeof(VirtioInputEvent)) < 0) {
+        warnf("syscall.c (get_tablet_event): Event %p is not mapped\n", event_vaddr);
         XREG(A0) = -EFAULT;
         return;
-    } else {
-        debugf("syscall.c (get_tablet_event): Event %p found\n", (char *)event_paddr);
     }
 
-    memcpy((void *)event_paddr, &event, sizeof(VirtioInputEvent));
-
     XREG(A0) = 0;
 }
 
@@ -670,14 +606,15 @@ SYSCALL(path_exists)
         return;
     }
 
-    const char *path_paddr = mmu_translate(p->rcb.ptable, (uintptr_t)path_vaddr);
-    if (path_paddr == -1UL) {
-        XREG(A0) = -EFAULT;
+    char path[USER_STRING_MAX];
+    long err = strncpy_from_user(path, p->rcb.ptable, path_vaddr, sizeof(path));
+    if (err < 0) {
+        XREG(A0) = err;
         return;
     }
 
-    debugf("syscall.c (path_exists): Checking if path %s is dir\n", path_paddr);
-    XREG(A0) = vfs_exists(path_paddr);
+    debugf("syscall.c (path_exists): Checking if path %s is dir\n", path);
+    XREG(A0) = vfs_exists(path);
 }
 
 
@@ -693,14 +630,15 @@ SYSCALL(path_is_dir)
         return;
     }
 
-    const char *path_paddr = mmu_translate(p->rcb.ptable, (uintptr_t)path_vaddr);
-    if (path_paddr == -1UL) {
-        XREG(A0) = -EFAULT;
+    char path[USER_STRING_MAX];
+    long err = strncpy_from_user(path, p->rcb.ptable, path_vaddr, sizeof(path));
+    if (err < 0) {
+        XREG(A0) = err;
         return;
     }
 
-    debugf("syscall.c (path_is_dir): Checking if path %s is dir\n", path_paddr);
-    XREG(A0) = vfs_is_dir(path_paddr);
+    debugf("syscall.c (path_is_dir): Checking if path %s is dir\n", path);
+    XREG(A0) = vfs_is_dir(path);
 }
 
 SYSCALL(path_is_file)
@@ -715,14 +653,15 @@ SYSCALL(path_is_file)
         return;
     }
 
-    const char *path_paddr = mmu_translate(p->rcb.ptable, (uintptr_t)path_vaddr);
-    if (path_paddr == -1UL) {
-        XREG(A0) = -EFAULT;
+    char path[USER_STRING_MAX];
+    long err = strncpy_from_user(path, p->rcb.ptable, path_vaddr, sizeof(path));
+    if (err < 0) {
+        XREG(A0) = err;
         return;
     }
 
-    debugf("syscall.c (path_is_file): Checking if path %s is file\n", path_paddr);
-    XREG(A0) = vfs_is_file(path_paddr);
+    debugf("syscall.c (path_is_file): Checking if path %s is file\n", path);
+    XREG(A0) = vfs_is_file(path);
 }
 
 SYSCALL(path_list_dir)
@@ -742,47 +681,42 @@ SYSCALL(path_list_dir)
         return;
     }
 
-    if (!entries_buffer_vaddr) {
+    if (!entries_buffer_vaddr || entries_buffer_size == 0) {
         warnf("syscall.c (path_list_dir): Entries buffer is null\n");
         XREG(A0) = -EINVAL;
         return;
     }
 
-    const char *path_paddr = mmu_translate(p->rcb.ptable, (uintptr_t)path_vaddr);
-
-    if (path_paddr == -1UL) {
-        XREG(A0) = -EFAULT;
+    char path[USER_STRING_MAX];
+    long err = strncpy_from_user(path, p->rcb.ptable, path_vaddr, sizeof(path));
+    if (err < 0) {
+        XREG(A0) = err;
         return;
     }
-    debugf("syscall.c (path_list_dir): Got path %s\n", path_paddr);
+    debugf("syscall.c (path_list_dir): Got path %s\n", path);
     
-    // if (!vfs_is_dir(path_paddr)) {
+    // if (!vfs_is_dir(path)) {
     //     XREG(A0) = -ENOTDIR;
-    //     warnf("syscall.c (path_list_dir): Path %s is not a directory\n", path_paddr);
+    //     warnf("syscall.c (path_list_dir): Path %s is not a directory\n", path);
     //     return;
     // } else {
-    //     debugf("syscall.c (path_list_dir): Path %s is a directory\n", path_paddr);
+    //     debugf("syscall.c (path_list_dir): Path %s is a directory\n", path);
     // }
 
 
-    char *entries_buffer_paddr = mmu_translate(p->rcb.ptable, (uintptr_t)entries_buffer_vaddr);
-    if (entries_buffer_paddr == -1UL) {
-        XREG(A0) = -EFAULT;
-        return;
-    }
-    // debugf("syscall.c (path_list_dir): Got entries buffer %p\n", entries_buffer_paddr);
-
-    // debugf("syscall.c (path_list_dir): Listing dir %s\n", path_paddr);
+    // debugf("syscall.c (path_list_dir): Listing dir %s\n", path);
 
     CSR_WRITE("sscratch", p->frame->sscratch);
-    // char buf[2048] = {0};
-    vfs_list_dir(path_paddr, entries_buffer_paddr, entries_buffer_size, return_full_path);
-    // debugf("syscall.c (path_list_dir): Listed dir %s\n", buf);
-    // copy_to(entries_buffer_vaddr, p->rcb.ptable, buf, entries_buffer_size);
-    // memcpy(entries_buffer_paddr, buf, entries_buffer_size);
-    // vfs_list_dir(path_paddr, entries_buffer_paddr, entries_buffer_size, return_full_path);
-    debugf("syscall.c (path_list_dir): Listed dir %s\n", path_paddr);
-    XREG(A0) = 0;
+    // List into a kernel buffer, then copy out only the part that was used
+    char *buf = (char *)kzalloc(entries_buffer_size);
+    if (buf == NULL) {
+        XREG(A0) = -ENOMEM;
+        return;
+    }
+    vfs_list_dir(path, buf, entries_buffer_size, return_full_path);
+    XREG(A0) = copy_to_user(entries_buffer_vaddr, p->rcb.ptable, buf, strlen(buf) + 1);
+    kfree(buf);
+    debugf("syscall.c (path_list_dir): Listed dir %s\n", path);
 }
 
 SYSCALL(get_file_size)
@@ -798,22 +732,22 @@ SYSCALL(get_file_size)
         return;
     }
 
-    const char *path_paddr = mmu_translate(p->rcb.ptable, (uintptr_t)path_vaddr);
-
-    if (path_paddr == -1UL) {
-        XREG(A0) = -EFAULT;
+    char path[USER_STRING_MAX];
+    long err = strncpy_from_user(path, p->rcb.ptable, path_vaddr, sizeof(path));
+    if (err < 0) {
+        XREG(A0) = err;
         return;
     }
-    debugf("syscall.c (get_file_size): Got path %s\n", path_paddr);
+    debugf("syscall.c (get_file_size): Got path %s\n", path);
 
-    // debugf("syscall.c (get_file_size): Getting file size of %s\n", path_paddr);
+    // debugf("syscall.c (get_file_size): Getting file size of %s\n", path);
     // char buf[2048] = {0};
-    // vfs_read(path_paddr, path_paddr, buffer_size);
-    File *file = vfs_open(path_paddr, 0, O_RDONLY, VFS_TYPE_FILE);
+    // vfs_read(path, path, buffer_size);
+    File *file = vfs_open(path, 0, O_RDONLY, VFS_TYPE_FILE);
     Stat stat;
     vfs_stat(file, &stat);
     vfs_close(file);
-    debugf("syscall.c (get_file_size): File %s has size %d\n", path_paddr, stat.size);
+    debugf("syscall.c (get_file_size): File %s has size %d\n", path, stat.size);
     XREG(A0) = stat.size;
 }
 
@@ -839,135 +773,154 @@ SYSCALL(read_file)
         return;
     }
 
-    const char *path_paddr = mmu_translate(p->rcb.ptable, (uintptr_t)path_vaddr);
-
-    if (path_paddr == -1UL) {
-        XREG(A0) = -EFAULT;
+    char path[USER_STRING_MAX];
+    long err = strncpy_from_user(path, p->rcb.ptable, path_vaddr, sizeof(path));
+    if (err < 0) {
+        XREG(A0) = err;
         return;
     }
-    debugf("syscall.c (read_file): Got path %s\n", path_paddr);
+    debugf("syscall.c (read_file): Got path %s\n", path);
 
-    char *buffer_paddr = mmu_translate(p->rcb.ptable, (uintptr_t)buffer_vaddr);
-    if (buffer_paddr == -1UL) {
-        XREG(A0) = -EFAULT;
+    // debugf("syscall.c (read_file): Reading file %s\n", path);
+    File *file = vfs_open(path, 0, O_RDONLY, VFS_TYPE_FILE);
+    if (file == NULL) {
+        warnf("syscall.c (read_file): Failed to open file %s\n", path);
+        XREG(A0) = -ENOENT;
         return;
     }
-    debugf("syscall.c (read_file): Got buffer %p\n", buffer_paddr);
-
-    // debugf("syscall.c (read_file): Reading file %s\n", path_paddr);
-    // char buf[2048] = {0};
-    // vfs_read(path_paddr, path_paddr, buffer_size);
-    File *file = vfs_open(path_paddr, 0, O_RDONLY, VFS_TYPE_FILE);
     Stat stat;
     vfs_stat(file, &stat);
-    
 
     uint64_t file_size = stat.size;
-    debugf("syscall.c (read_file): File %s has size %d\n", path_paddr, file_size);
-    #define min(a, b) ((a) < (b) ? (a) : (b))
-    #define max(a, b) ((a) > (b) ? (a) : (b))
-    char *tmp_buffer = (char*)kzalloc(max(file_size, buffer_size));
-
-    uint64_t read_bytes = vfs_read(file, tmp_buffer, min(file_size, buffer_size));
-    // uint64_t read_bytes = 0;
-    if (read_bytes < 0) {
-        warnf("syscall.c (read_file): Failed to read file %s\n", path_paddr);
-        XREG(A0) = -EIO;
-        vfs_close(file);
-        return;
+    debugf("syscall.c (read_file): File %s has size %d\n", path, file_size);
+    uint64_t total = file_size < buffer_size ? file_size : buffer_size;
+
+    // Read straight into the user's pages. Physically adjacent pages are read
+    // together so the filesystem sees a few large sequential reads instead of
+    // a bounce buffer copied a byte at a time.
+    uint64_t read_bytes = 0;
+    UserCursor cursor;
+    user_cursor_init(&cursor, p->rcb.ptable, buffer_vaddr, total, true);
+    while (read_bytes < total) {
+        void *paddr;
+        long chunk = user_cursor_next(&cursor, &paddr);
+        if (chunk < 0) {
+            warnf("syscall.c (read_file): Buffer page %p is not mapped\n", buffer_vaddr + read_bytes);
+            vfs_close(file);
+            XREG(A0) = chunk;
+            return;
+        }
+
+        int n = vfs_read(file, paddr, chunk);
+        if (n < 0) {
+            warnf("syscall.c (read_file): Failed to read file %s\n", path);
+            vfs_close(file);
+            XREG(A0) = -EIO;
+            return;
+        }
+        read_bytes += n;
+        if (n < chunk) {
+            break;
+        }
     }
     vfs_close(file);
     debugf("syscall.c (read_file): Read %d bytes\n", read_bytes);
 
-    for (uint64_t i = 0; i < read_bytes; ++i) {
-        *(uint8_t*)mmu_translate(p->rcb.ptable, (uintptr_t)&buffer_vaddr[i]) = tmp_buffer[i];
-    }
-    kfree(tmp_buffer);
-
     XREG(A0) = read_bytes;
 }
 
 
-SYSCALL(spawn_process)
+// Read the ELF file at the user path `path_vaddr` into a kmalloc'd buffer,
+// and fill in `key` to find its image in the image cache.
+// Returns 0, or a negative errno if the path or file is not usable.
+static long read_elf_from_user(Process *p, const char *path_vaddr, uint8_t **elf, ElfImageKey *key)
 {
-    SYSCALL_ENTER();
-    // Add a new process to the scheduler using the file path in A0,
-    // and return the PID in A0
-    debugf("syscall.c (spawn_process): Spawning process\n");
-    Process *p = sched_get_current();
-
-    const char *path_vaddr = (const char *)XREG(A0);
     if (!path_vaddr) {
-        warnf("syscall.c (spawn_process): Path is null\n");
-        XREG(A0) = -EINVAL;
-        return;
+        warnf("syscall.c (read_elf_from_user): Path is null\n");
+        return -EINVAL;
     }
 
-    const char *path_paddr = mmu_translate(p->rcb.ptable, (uintptr_t)path_vaddr);
-
-    if (path_paddr == -1UL) {
-        warnf("syscall.c (spawn_process): MMU translated to null\n");
-        XREG(A0) = -EFAULT;
-        return;
+    char path[USER_STRING_MAX];
+    long err = strncpy_from_user(path, p->rcb.ptable, path_vaddr, sizeof(path));
+    if (err < 0) {
+        warnf("syscall.c (read_elf_from_user): Could not copy the path\n");
+        return err;
     } else {
-        debugf("syscall.c (spawn_process): Got path %s\n", path_paddr);
+        debugf("syscall.c (read_elf_from_user): Got path %s\n", path);
     }
 
-    // debugf("syscall.c (spawn_process): Got path %s\n", path_paddr);
-
     // Check to see if the path exists
-    if (!vfs_exists(path_paddr)) {
-        warnf("syscall.c (spawn_process): Path %s does not exist\n", path_paddr);
-        XREG(A0) = -ENOENT;
-        return;
-    } else {
-        debugf("syscall.c (spawn_process): Path %s exists\n", path_paddr);
+    if (!vfs_exists(path)) {
+        warnf("syscall.c (read_elf_from_user): Path %s does not exist\n", path);
+        return -ENOENT;
     }
 
     // Check to see if the path is a file
-    if (!vfs_is_file(path_paddr)) {
-        warnf("syscall.c (spawn_process): Path %s is not a file\n", path_paddr);
-        XREG(A0) = -ENOTDIR;
-        return;
-    } else {
-        debugf("syscall.c (spawn_process): Path %s is a file\n", path_paddr);
+    if (!vfs_is_file(path)) {
+        warnf("syscall.c (read_elf_from_user): Path %s is not a file\n", path);
+        return -ENOTDIR;
     }
 
     // Read the file
-    debugf("syscall.c (spawn_process): Opening file %s\n", path_paddr);
-    File *elf_file = vfs_open(path_paddr, 0, O_RDONLY, VFS_TYPE_FILE);
+    debugf("syscall.c (read_elf_from_user): Opening file %s\n", path);
+    File *elf_file = vfs_open(path, 0, O_RDONLY, VFS_TYPE_FILE);
     Stat stat;
     vfs_stat(elf_file, &stat);
-    debugf("syscall.c (spawn_process): File %s has size %d\n", path_paddr, stat.size);
+    debugf("syscall.c (read_elf_from_user): File %s has size %d\n", path, stat.size);
+    key->dev = elf_file->dev;
+    key->inode = elf_file->inode;
+    key->generation = elf_cache_generation();
 
     uint64_t file_size = stat.size;
 
-    uint8_t *file_buffer = (char*)kmalloc(file_size);
+    uint8_t *file_buffer = (uint8_t *)kmalloc(file_size);
     if (vfs_read(elf_file, file_buffer, file_size) < 0) {
-        warnf("syscall.c (spawn_process): Failed to read file %s\n", path_paddr);
-        XREG(A0) = -EIO;
-        return;
+        warnf("syscall.c (read_elf_from_user): Failed to read file %s\n", path);
+        vfs_close(elf_file);
+        kfree(file_buffer);
+        return -EIO;
     }
     vfs_close(elf_file);
 
     // Check to see if the file is an ELF
     if (!elf_is_valid(file_buffer)) {
-        warnf("syscall.c (spawn_process): File %s is not a valid ELF\n", path_paddr);
-        XREG(A0) = -ENOEXEC;
+        warnf("syscall.c (read_elf_from_user): File %s is not a valid ELF\n", path);
+        kfree(file_buffer);
+        return -ENOEXEC;
+    }
+    *elf = file_buffer;
+    return 0;
+}
+
+SYSCALL(spawn_process)
+{
+    SYSCALL_ENTER();
+    // Add a new process to the scheduler using the file path in A0,
+    // and return the PID in A0
+    debugf("syscall.c (spawn_process): Spawning process\n");
+    Process *p = sched_get_current();
+
+    uint8_t *file_buffer;
+    ElfImageKey key;
+    long err = read_elf_from_user(p, (const char *)XREG(A0), &file_buffer, &key);
+    if (err < 0) {
+        XREG(A0) = err;
         return;
     }
 
     // Create a new process
     debugf("syscall.c (spawn_process): Creating new process\n");
     Process *new_process = process_new(PM_USER);
-    if (elf_create_process(new_process, file_buffer)) {
+    int failed = elf_create_process(new_process, file_buffer, &key);
+    kfree(file_buffer);
+    if (failed) {
         warnf("syscall.c (spawn_process): Failed to create process\n");
         XREG(A0) = -ENOEXEC;
         return;
     }
     debugf("syscall.c (spawn_process): Created new process\n");
     new_process->state = PS_RUNNING;
-    new_process->hart = sbi_whoami();
+    new_process->hart = HART_NONE;
     debugf("syscall.c (spawn_process): Scheduling new process\n");
     // sched_add(new_process);
     debugf("syscall.c (spawn_process): Scheduled new process\n");
@@ -975,9 +928,136 @@ SYSCALL(spawn_process)
     debugf("syscall.c (spawn_process): Child process has PID %d\n", new_process->pid);
     XREG(A0) = new_process->pid;
 
+    // It runs once a hart picks it up, which is right away if one is idle
     sched_add(new_process);
-    process_run(new_process, new_process->hart);
+}
+
+SYSCALL(brk)
+{
+    SYSCALL_ENTER();
+    Process *p = sched_get_current();
+    // brk(0) just asks for the current break
+    XREG(A0) = process_brk(p, XREG(A0));
+    debugf("syscall.c (brk): Break of process %d is now 0x%08lx\n", p->pid, XREG(A0));
+}
 
+SYSCALL(fork)
+{
+    SYSCALL_ENTER();
+    Process *p = sched_get_current();
+    Process *child = process_fork(p);
+    if (child == NULL) {
+        XREG(A0) = -ENOMEM;
+        return;
+    }
+    child->state = PS_RUNNING;
+    child->hart = sbi_whoami();
+    debugf("syscall.c (fork): Process %d forked into %d\n", p->pid, child->pid);
+    XREG(A0) = child->pid;
+    sched_add(child);
+}
+
+SYSCALL(exec)
+{
+    SYSCALL_ENTER();
+    // Replace the current image with the ELF file at the path in A0.
+    // Only returns (with an error in A0) if the file can't be run.
+    Process *p = sched_get_current();
+
+    uint8_t *file_buffer;
+    ElfImageKey key;
+    long err = read_elf_from_user(p, (const char *)XREG(A0), &file_buffer, &key);
+    if (err < 0) {
+        XREG(A0) = err;
+        return;
+    }
+    int failed = process_exec(p, file_buffer, &key);
+    kfree(file_buffer);
+    if (failed) {
+        // The old image is gone by now, so there is nothing to return to
+        warnf("syscall.c (exec): Could not load the new image of process %d\n", p->pid);
+        p->state = PS_DEAD;
+        return;
+    }
+    debugf("syscall.c (exec): Process %d now starts at 0x%08lx\n", p->pid, p->frame->sepc);
+}
+
+SYSCALL(mmap)
+{
+    SYSCALL_ENTER();
+    // Map the file at the path in A0. There are no file descriptors, so the
+    // file is named the same way read_file names it.
+    Process *p = sched_get_current();
+
+    const char *path_vaddr = (const char *)XREG(A0);
+    uint64_t length = XREG(A1);
+    int prot = XREG(A2);
+    int flags = XREG(A3);
+    uint64_t offset = XREG(A4);
+
+    if (!path_vaddr || length == 0 || offset % PAGE_SIZE_4K != 0
+        || (flags != MAP_SHARED && flags != MAP_PRIVATE)) {
+        XREG(A0) = -EINVAL;
+        return;
+    }
+
+    char path[USER_STRING_MAX];
+    long err = strncpy_from_user(path, p->rcb.ptable, path_vaddr, sizeof(path));
+    if (err < 0) {
+        XREG(A0) = err;
+        return;
+    }
+
+    flags_t open_flags = (flags == MAP_SHARED && (prot & PROT_WRITE)) ? O_RDWR : O_RDONLY;
+    File *file = vfs_open(path, open_flags, 0, VFS_TYPE_FILE);
+    if (file == NULL) {
+        warnf("syscall.c (mmap): Failed to open file %s\n", path);
+        XREG(A0) = -ENOENT;
+        return;
+    }
+    if (!file->is_file || offset >= file->size) {
+        vfs_close(file);
+        XREG(A0) = -EINVAL;
+        return;
+    }
+    // The page cache keeps the inode once the file is closed
+    PageCacheFile *cached = pcache_get(file->dev, file->inode, file->size);
+    vfs_close(file);
+    if (cached == NULL) {
+        XREG(A0) = -ENOMEM;
+        return;
+    }
+
+    uintptr_t addr = process_mmap(p, cached, length, prot, flags, offset);
+    if (addr == 0) {
+        pcache_put(cached);
+        XREG(A0) = -ENOMEM;
+        return;
+    }
+    debugf("syscall.c (mmap): Mapped %s at 0x%08lx for process %d\n", path, addr, p->pid);
+    XREG(A0) = addr;
+}
+
+SYSCALL(munmap)
+{
+    SYSCALL_ENTER();
+    Process *p = sched_get_current();
+    XREG(A0) = process_munmap(p, XREG(A0), XREG(A1));
+}
+
+SYSCALL(nice)
+{
+    SYSCALL_ENTER();
+    Process *p = sched_get_current();
+    // Takes effect from the next time the process is charged for running
+    int nice = p->nice + (int)XREG(A0);
+    if (nice < NICE_MIN) {
+        nice = NICE_MIN;
+    } else if (nice > NICE_MAX) {
+        nice = NICE_MAX;
+    }
+    p->nice = nice;
+    XREG(A0) = nice;
 }
 
 /**
@@ -1023,6 +1103,13 @@ static SYSCALL_RETURN_TYPE (*const SYSCALLS[])(SYSCALL_PARAM_LIST) = {
     SYSCALL_PTR(spawn_process), /* 22 */
     SYSCALL_PTR(read_file), /* 23 */
     SYSCALL_PTR(get_file_size), /* 24 */
+    SYSCALL_PTR(brk), /* 25 */
+    SYSCALL_PTR(fork), /* 26 */
+    SYSCALL_PTR(exec), /* 27 */
+    SYSCALL_PTR(mmap), /* 28 */
+    SYSCALL_PTR(munmap), /* 29 */
+    SYSCALL_PTR(nice), /* 30 */
+    SYSCALL_PTR(screen_draw_flags), /* 31 */
 };
 
 static const int NUM_SYSCALLS = sizeof(SYSCALLS) / sizeof(SYSCALLS[0]);
@@ -1044,7 +1131,9 @@ void syscall_handle(int hart, uint64_t epc, int64_t *scratch)
     else {
         // debugf("syscall_handle: Calling syscall %ld\n", XREG(A7));
         // debugf("With args: %lx %lx %lx %lx %lx %lx\n", XREG(A0), XREG(A1), XREG(A2), XREG(A3), XREG(A4), XREG(A5));
+        kernel_lock(hart);
         SYSCALL_EXEC(XREG(A7));
+        kernel_unlock();
     }
 }
 
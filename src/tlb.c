@@ -0,0 +1,287 @@
+/*
+*   Address space IDs and TLB shootdowns
+*/
+#include <tlb.h>
+#include <config.h>
+#include <csr.h>
+#include <debug.h>
+#include <lock.h>
+#include <mmu.h>
+#include <sbi.h>
+#include <util.h>
+
+// #define TLB_DEBUG
+
+#ifdef TLB_DEBUG
+#define debugf(...) debugf(__VA_ARGS__)
+#else
+#define debugf(...)
+#endif
+
+/*
+ * Every process gets its own ASID the first time it runs, so its TLB entries
+ * survive the switches to the kernel and to other processes. An ASID is only
+ * handed out once per generation. When they run out, the generation goes up,
+ * all ASIDs are free again, and each hart flushes its whole TLB before it
+ * runs anything with a new one. The ASIDs the harts are running right then
+ * stay taken, since those processes return to user mode straight from a trap
+ * without coming through tlb_activate.
+ *
+ * A process remembers which harts may hold its entries. Changing a mapping
+ * flushes this hart at once, interrupts the hart that is running the process
+ * (if another one is), and leaves a note for the rest to flush the ASID the
+ * next time they run it. Nothing is flushed when a process is freed, because
+ * its ASID is not handed out again before the next rollover flush anyway.
+ */
+
+#define ASID_NONE             0
+#define ASID_NUM(asid)        ((asid) & 0xFFFFUL)
+#define ASID_GENERATION(asid) ((asid) & ~0xFFFFUL)
+#define ASID_GENERATION_STEP  (1UL << 16)
+
+static Mutex asid_lock = MUTEX_UNLOCKED;
+// The ASID bits the MMU has, 0 if it has none
+static uint64_t asid_mask;
+static uint64_t asid_generation = ASID_GENERATION_STEP;
+static uint64_t asid_next;
+static uint64_t asid_used[(KERNEL_ASID + 1) / 64];
+// The ASID each hart returns to user mode with, ASID_NONE if it runs the kernel
+static uint64_t active_asid[MAX_ALLOWABLE_HARTS];
+// The ASIDs that stayed taken over the last rollover
+static uint64_t reserved_asid[MAX_ALLOWABLE_HARTS];
+// The generation each hart has flushed its TLB for
+static uint64_t hart_generation[MAX_ALLOWABLE_HARTS];
+// Harts that have run anything, which kernel flushes have to reach
+static uint64_t harts_seen;
+// Set by another hart that wants this one to flush, cleared once it has
+static bool flush_pending[MAX_ALLOWABLE_HARTS];
+
+static void asid_mark(uint64_t num) {
+    asid_used[num / 64] |= 1UL << (num % 64);
+}
+
+static bool asid_is_used(uint64_t num) {
+    return asid_used[num / 64] & (1UL << (num % 64));
+}
+
+// Start a new generation. Must be called with the lock held.
+static void asid_rollover(void) {
+    asid_generation += ASID_GENERATION_STEP;
+    memset(asid_used, 0, sizeof(asid_used));
+    asid_mark(ASID_NONE);
+    asid_mark(KERNEL_ASID & asid_mask);
+    for (int h = 0; h < MAX_ALLOWABLE_HARTS; h++) {
+        reserved_asid[h] = active_asid[h];
+        asid_mark(active_asid[h]);
+    }
+    asid_next = 1;
+    debugf("asid_rollover: Generation %lu\n", asid_generation / ASID_GENERATION_STEP);
+}
+
+// Find a free ASID, starting a new generation if there is none.
+// Must be called with the lock held.
+static uint64_t asid_alloc(void) {
+    if (asid_mask == 0) {
+        return asid_generation | ASID_NONE;
+    }
+    for (int tries = 0; tries < 2; tries++) {
+        while (asid_next <= asid_mask) {
+            uint64_t num = asid_next++;
+            if (!asid_is_used(num)) {
+                asid_mark(num);
+                return asid_generation | num;
+            }
+        }
+        asid_rollover();
+    }
+    // Fewer ASIDs than harts. ASID_NONE makes the trampoline flush on every switch.
+    return asid_generation | ASID_NONE;
+}
+
+// Was `num` kept over the last rollover? Only a process of the previous
+// generation can own it. Must be called with the lock held.
+static bool asid_is_reserved(uint64_t asid) {
+    if (ASID_GENERATION(asid) + ASID_GENERATION_STEP != asid_generation || ASID_NUM(asid) == ASID_NONE) {
+        return false;
+    }
+    for (int h = 0; h < MAX_ALLOWABLE_HARTS; h++) {
+        if (reserved_asid[h] == ASID_NUM(asid)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void tlb_init(void) {
+    uint64_t satp;
+    // SATP_KERNEL asks for ASID 0xFFFF, and the bits the MMU lacks read back as 0
+    CSR_READ(satp, "satp");
+    mutex_spinlock(&asid_lock);
+    asid_mask = (satp >> SATP_ASID_BIT) & 0xFFFF;
+    memset(asid_used, 0, sizeof(asid_used));
+    asid_mark(ASID_NONE);
+    asid_mark(KERNEL_ASID & asid_mask);
+    asid_next = 1;
+    memset(active_asid, 0, sizeof(active_asid));
+    memset(reserved_asid, 0, sizeof(reserved_asid));
+    for (int h = 0; h < MAX_ALLOWABLE_HARTS; h++) {
+        hart_generation[h] = asid_generation;
+    }
+    mutex_unlock(&asid_lock);
+    debugf("tlb_init: %lu ASIDs\n", asid_mask);
+}
+
+void tlb_activate(Process *p, int hart) {
+    if (hart < 0 || hart >= MAX_ALLOWABLE_HARTS) {
+        if (p->mode == PM_USER) {
+            p->frame->satp = SATP(kernel_mmu_translate((uintptr_t)p->rcb.ptable), ASID_NONE);
+        }
+        return;
+    }
+    uint64_t bit = 1UL << hart;
+    bool local = hart == sbi_whoami();
+    uint64_t sstatus;
+    CSR_READ(sstatus, "sstatus");
+    IRQ_OFF();
+
+    mutex_spinlock(&asid_lock);
+    harts_seen |= bit;
+    // Kernel processes run on SATP_KERNEL
+    uint64_t num = ASID_NONE;
+    bool stale = false;
+    if (p->mode == PM_USER) {
+        if (ASID_GENERATION(p->asid) != asid_generation) {
+            if (asid_is_reserved(p->asid)) {
+                p->asid = asid_generation | ASID_NUM(p->asid);
+            } else {
+                // Nobody has entries for a fresh ASID, this hart included after the check below
+                p->asid = asid_alloc();
+                p->tlb_harts = 0;
+                p->tlb_stale = 0;
+            }
+        }
+        stale = p->tlb_stale & bit;
+        p->tlb_stale &= ~bit;
+        p->tlb_harts |= bit;
+        num = ASID_NUM(p->asid);
+    }
+    active_asid[hart] = num;
+    // Checked after allocating, which may have started a new generation whose
+    // ASIDs were last used by other processes
+    if (hart_generation[hart] != asid_generation) {
+        // A hart that is being started flushes everything on the way in, see _spawn_kthread
+        if (local) {
+            SFENCE_ALL();
+            stale = false;
+        }
+        hart_generation[hart] = asid_generation;
+    }
+    mutex_unlock(&asid_lock);
+
+    if (p->mode != PM_USER) {
+        if (sstatus & SSTATUS_SIE) IRQ_ON();
+        return;
+    }
+    if (stale && local) {
+        SFENCE_ASID(num);
+    }
+    p->frame->satp = SATP(kernel_mmu_translate((uintptr_t)p->rcb.ptable), num);
+    if (sstatus & SSTATUS_SIE) IRQ_ON();
+}
+
+// Ask the harts in `harts` to flush everything and wait until they have.
+// Must be called without the lock held.
+static void tlb_shootdown(uint64_t harts, int me) {
+    uint64_t sent = 0;
+    for (int h = 0; h < MAX_ALLOWABLE_HARTS; h++) {
+        if (!(harts & (1UL << h)) || h == me) {
+            continue;
+        }
+        __atomic_store_n(&flush_pending[h], true, __ATOMIC_RELEASE);
+        if (sbi_send_ipi(h)) {
+            sent |= 1UL << h;
+        } else {
+            // Not running, so it flushes when it is started
+            __atomic_store_n(&flush_pending[h], false, __ATOMIC_RELEASE);
+        }
+    }
+    for (int h = 0; h < MAX_ALLOWABLE_HARTS; h++) {
+        if (!(sent & (1UL << h))) {
+            continue;
+        }
+        while (__atomic_load_n(&flush_pending[h], __ATOMIC_ACQUIRE)) {
+            // The other hart may be waiting on us just the same
+            if (me >= 0 && me < MAX_ALLOWABLE_HARTS) {
+                tlb_handle_ipi(me);
+            }
+        }
+    }
+}
+
+static void tlb_flush(Process *p, uintptr_t vaddr, bool whole) {
+    int me = sbi_whoami();
+    uint64_t sstatus;
+    CSR_READ(sstatus, "sstatus");
+    IRQ_OFF();
+
+    mutex_spinlock(&asid_lock);
+    uint64_t num = ASID_NUM(p->asid);
+    uint64_t running = 0;
+    for (int h = 0; h < MAX_ALLOWABLE_HARTS; h++) {
+        uint64_t bit = 1UL << h;
+        if (!(p->tlb_harts & bit)) {
+            continue;
+        }
+        if (h == me) {
+            if (whole) {
+                SFENCE_ASID(num);
+            } else {
+                SFENCE(vaddr, num);
+            }
+        } else if (active_asid[h] == num && num != ASID_NONE) {
+            running |= bit;
+        } else {
+            // Flushed the next time it runs `p`
+            p->tlb_stale |= bit;
+        }
+    }
+    mutex_unlock(&asid_lock);
+
+    if (running != 0) {
+        tlb_shootdown(running, me);
+    }
+    if (sstatus & SSTATUS_SIE) IRQ_ON();
+}
+
+void tlb_flush_page(Process *p, uintptr_t vaddr) {
+    tlb_flush(p, ALIGN_DOWN_POT(vaddr, PAGE_SIZE_4K), false);
+}
+
+void tlb_flush_process(Process *p) {
+    tlb_flush(p, 0, true);
+}
+
+void tlb_flush_kernel(void) {
+    int me = sbi_whoami();
+    uint64_t sstatus;
+    CSR_READ(sstatus, "sstatus");
+    IRQ_OFF();
+
+    SFENCE_ALL();
+    mutex_spinlock(&asid_lock);
+    uint64_t harts = harts_seen;
+    mutex_unlock(&asid_lock);
+    tlb_shootdown(harts, me);
+
+    if (sstatus & SSTATUS_SIE) IRQ_ON();
+}
+
+void tlb_handle_ipi(int hart) {
+    if (hart < 0 || hart >= MAX_ALLOWABLE_HARTS) {
+        return;
+    }
+    if (__atomic_load_n(&flush_pending[hart], __ATOMIC_ACQUIRE)) {
+        SFENCE_ALL();
+        __atomic_store_n(&flush_pending[hart], false, __ATOMIC_RELEASE);
+    }
+}
@@ -10,6 +10,8 @@
 #include <sbi.h>
 #include <process.h>
 #include <sched.h>
+#include <tlb.h>
+#include <lock.h>
 
 // #define TRAP_DEBUG
 #ifdef TRAP_DEBUG
@@ -22,7 +24,8 @@
 void syscall_handle(int hart, uint64_t epc, int64_t *scratch);
 
 
-static uint64_t scheduler_time = 0;
+// When each hart last picked a process to run
+static uint64_t scheduler_time[MAX_ALLOWABLE_HARTS];
 
 // Called from asm/spawn.S: _spawn_kthread
 void os_trap_handler(void)
@@ -86,6 +89,8 @@ void os_trap_handler(void)
     // debugf("Sscratch: %lx\n", scratch);
 
     int hart = sbi_whoami();
+    // tp still holds whatever the trapped code left in it
+    hart_id_set(hart);
     // IRQ_ON();
     // CSR_WRITE("sscratch", hart);
     // __asm__ volatile ("li t1, 2\n"
@@ -103,10 +108,20 @@ void os_trap_handler(void)
         frame->sepc = epc;
         TrapFrame save = *frame;
         switch (cause) {
-            case CAUSE_SSIP:
-                infof("os_trap_handerl: Supervisor software interrupt!\n");
-                // TODO
-                break;
+            case CAUSE_SSIP: {
+                // Another hart wants this one to flush its TLB (see src/tlb.c)
+                debugf("os_trap_handler: Supervisor software interrupt!\n");
+                unsigned long sip;
+                CSR_READ(sip, "sip");
+                CSR_WRITE("sip", sip & ~SIP_SSIP);
+                tlb_handle_ipi(hart);
+                // Or sched_add queued work for it while it was idle (see src/sched.c)
+                if (sched_get_current() == sched_get_idle_process()) {
+                    CSR_WRITE("sscratch", &save);
+                    scheduler_time[hart] = now;
+                    sched_handle_timer_interrupt(hart);
+                }
+            } break;
             case CAUSE_STIP:
                 // Ack timer will reset the timer to INFINITE
                 // In src/sbi.c
@@ -118,14 +133,10 @@ void os_trap_handler(void)
                 CSR_WRITE("sscratch", &save);
                 // CSR_WRITE("sscratch", kernel_trap_frame);
                 // sched_handle_timer_interrupt(hart);
-                if (now - scheduler_time > CONTEXT_SWITCH_TIMER) {
-                    debugf("Process %d is running. Resuming process\n", p->pid);
-                    process_run(sched_get_current(), hart);
-                } else {
-                    debugf("Process %d is running. Scheduling next process\n", p->pid);
-                    scheduler_time = now;
-                    sched_handle_timer_interrupt(hart);
-                }
+                // The timer only fires once per arming, so every tick has to
+                // go through the scheduler, which arms the next one
+                scheduler_time[hart] = now;
+                sched_handle_timer_interrupt(hart);
                 break;
             case CAUSE_SEIP:
                 debugf("os_trap_handler: Supervisor external interrupt!\n");
@@ -178,7 +189,8 @@ void os_trap_handler(void)
         }
     } else {
         // debugf("Is sync!\n");
-        if (cause != CAUSE_ECALL_S_MODE && cause != CAUSE_ECALL_U_MODE) {
+        if (cause != CAUSE_ECALL_S_MODE && cause != CAUSE_ECALL_U_MODE
+            && cause != CAUSE_LOAD_PAGE_FAULT && cause != CAUSE_STORE_AMO_PAGE_FAULT) {
             debugf("ERROR!!!\n");
             trap_frame_debug(scratch);
         }
@@ -214,14 +226,14 @@ void os_trap_handler(void)
                     // sched_handle_timer_interrupt(hart);
                     if (p == sched_get_idle_process()) {
                         debugf("Process %d is idle. Scheduling next process\n", p->pid);
-                        scheduler_time = now;
+                        scheduler_time[hart] = now;
                         sched_handle_timer_interrupt(hart);
-                    } else if (now - scheduler_time > CONTEXT_SWITCH_TIMER) {
+                    } else if (now - scheduler_time[hart] < CONTEXT_SWITCH_TIMER) {
                         debugf("Process %d is running. Resuming process\n", p->pid);
                         process_run(p, hart);
                     } else {
                         debugf("Process %d is running. Scheduling next process\n", p->pid);
-                        scheduler_time = now;
+                        scheduler_time[hart] = now;
                         sched_handle_timer_interrupt(hart);
                     }
                     return;
@@ -257,10 +269,31 @@ void os_trap_handler(void)
                 fatalf("Instruction page fault at instruction %p accessing address %p\n", epc, tval);
                 break;
             case CAUSE_STORE_AMO_PAGE_FAULT:
-                fatalf("Instruction store page fault at instruction %p accessing address %p\n", epc, tval);
-                break;
             case CAUSE_LOAD_PAGE_FAULT:
-                fatalf("Load page fault at %p = %p", epc, tval);
+                // Stack, heap and mapped file pages are only mapped when they are first
+                // touched, and pages shared by fork are only copied when they are first stored to
+                // These reach the page cache and the filesystem, so they hold the
+                // same lock as the syscalls do.
+                p = sched_get_current();
+                kernel_lock(hart);
+                bool mapped = p != NULL && ((cause == CAUSE_STORE_AMO_PAGE_FAULT && process_fault_cow(p, tval))
+                                            || process_fault_in(p, tval)
+                                            || process_fault_mmap(p, tval, cause == CAUSE_STORE_AMO_PAGE_FAULT));
+                kernel_unlock();
+                if (mapped) {
+                    debugf("Mapped page %p for process %d\n", tval, p->pid);
+                    // Run the faulting instruction again
+                    frame->sepc = epc;
+                    CSR_WRITE("sscratch", &save);
+                    IRQ_OFF();
+                    process_run(p, hart);
+                    return;
+                }
+                if (cause == CAUSE_STORE_AMO_PAGE_FAULT) {
+                    fatalf("Instruction store page fault at instruction %p accessing address %p\n", epc, tval);
+                } else {
+                    fatalf("Load page fault at %p = %p", epc, tval);
+                }
                 break;
             default:
                 fatalf(
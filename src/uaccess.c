@@ -1,6 +1,76 @@
 #include <uaccess.h>
+#include <errno.h>
 #include <util.h>
 #include <mmu.h>
+#include <process.h>
+#include <sched.h>
+
+void user_cursor_init(UserCursor *cursor, const PageTable *table, const void *vaddr, unsigned long size, bool write)
+{
+    mmu_cursor_init(&cursor->mmu, table);
+    cursor->vaddr = (uintptr_t)vaddr;
+    cursor->end = (uintptr_t)vaddr + size;
+    cursor->required_bits = PB_USER | (write ? PB_WRITE : PB_READ);
+}
+
+// Translate one user address, checking that its page allows the access.
+static uintptr_t user_cursor_translate(UserCursor *cursor, uintptr_t vaddr)
+{
+    uint64_t bits = 0;
+    uintptr_t paddr = mmu_cursor_translate(&cursor->mmu, vaddr, &bits);
+    bool write = cursor->required_bits & PB_WRITE;
+    if (paddr == MMU_TRANSLATE_PAGE_FAULT) {
+        // A buffer on the running process's stack or heap, or in a mapped file,
+        // may not have been touched yet
+        Process *p = sched_get_current();
+        if (p != NULL && p->rcb.ptable == cursor->mmu.root
+            && (process_fault_in(p, vaddr) || process_fault_mmap(p, vaddr, write))) {
+            paddr = mmu_cursor_translate(&cursor->mmu, vaddr, &bits);
+        }
+    }
+    if (paddr != MMU_TRANSLATE_PAGE_FAULT && write && !(bits & PB_WRITE)) {
+        // The kernel stores through the physical address, so the page has to be
+        // copied (or marked dirty, for a shared file) first
+        Process *p = sched_get_current();
+        if (p != NULL && p->rcb.ptable == cursor->mmu.root
+            && ((bits & PB_COW) ? process_fault_cow(p, vaddr) : process_fault_mmap(p, vaddr, true))) {
+            paddr = mmu_cursor_translate(&cursor->mmu, vaddr, &bits);
+        }
+    }
+    if (paddr == MMU_TRANSLATE_PAGE_FAULT || (bits & cursor->required_bits) != cursor->required_bits) {
+        return MMU_TRANSLATE_PAGE_FAULT;
+    }
+    return paddr;
+}
+
+long user_cursor_next(UserCursor *cursor, void **paddr)
+{
+    if (cursor->vaddr >= cursor->end) {
+        return 0;
+    }
+    uintptr_t start = user_cursor_translate(cursor, cursor->vaddr);
+    if (start == MMU_TRANSLATE_PAGE_FAULT) {
+        return -EFAULT;
+    }
+
+    // The first page may start part way in, every later page starts at its beginning
+    unsigned long length = PAGE_SIZE_4K - (cursor->vaddr % PAGE_SIZE_4K);
+    while (cursor->vaddr + length < cursor->end) {
+        // Keep going while the next page follows on in physical memory too
+        if (user_cursor_translate(cursor, cursor->vaddr + length) != start + length) {
+            break;
+        }
+        length += PAGE_SIZE_4K;
+    }
+    // The last page may end part way in
+    if (cursor->vaddr + length > cursor->end) {
+        length = cursor->end - cursor->vaddr;
+    }
+
+    cursor->vaddr += length;
+    *paddr = (void *)start;
+    return length;
+}
 
 /*
 dst: copy destination
@@ -10,102 +80,88 @@ size: size in bytes
 
 copies <size> bytes from the src address into the <dst> address
 */
-unsigned long copy_from(void *dst, 
-                        const PageTable *from_table, 
-                        const void *from, 
-                        unsigned long size)
+long copy_from_user(void *dst, 
+                    const PageTable *from_table, 
+                    const void *from, 
+                    unsigned long size)
 {
+    UserCursor cursor;
+    user_cursor_init(&cursor, from_table, from, size, false);
 
     unsigned long bytes_copied = 0;
-
-    unsigned long src_start_addr = (unsigned long)from;
-    unsigned long src_end_addr = (unsigned long)from+size;
-    unsigned long src_first_page = ALIGN_DOWN_POT(src_start_addr, PAGE_SIZE_4K);
-
-    // Copy the data from the source to the destination.
-    // Translate the page aligned source address (for each page in the virtual addresses) using mmu_translate to get the address to copy
-    // from the physical memory. Then, use memcpy to copy the data from the physical memory to the destination.
-    for (unsigned long i = src_first_page; i < src_end_addr; i += PAGE_SIZE_4K) {
-        void *physical_address = (void*)mmu_translate(from_table, i);
-
-        // Is this the first page, if so, we need to copy from the offset.
-        unsigned long offset = 0;
-
-        bool is_first_page = i == src_start_addr;
-
-        // If this is the first page:
-        if (is_first_page) {
-            offset = src_start_addr % PAGE_SIZE_4K;
-        }
-
-        // Is this the last page, if so, we need to copy only the remaining bytes.
-        unsigned long bytes_to_copy_from_page = PAGE_SIZE_4K;
-        // If the remaining bytes to copy is less than the page size, then we need to copy only the remaining bytes.
-        if (i + PAGE_SIZE_4K > src_end_addr) {
-            // The remaining bytes to copy is the difference between the end address and the current address.
-            bytes_to_copy_from_page = src_end_addr - i;
-        }
-
-        // Copy the data from the source to the destination.
-        memcpy(dst + bytes_copied, physical_address + offset, bytes_to_copy_from_page);
-
-        // Increment the number of bytes copied.
-        bytes_copied += bytes_to_copy_from_page;
+    void *physical_address;
+    long length;
+    while ((length = user_cursor_next(&cursor, &physical_address)) > 0) {
+        memcpy((uint8_t *)dst + bytes_copied, physical_address, length);
+        bytes_copied += length;
     }
-
-    return bytes_copied;
+    return length < 0 ? length : 0;
 }
 
 /*
 to: copy destination
 src: copy source
-from_table: page table to translate with
+to_table: page table to translate with
 size: size in bytes
 
 copies <size> bytes from the src address into the <to> address
 */
-unsigned long copy_to(void *to, 
-                      const PageTable *to_table, 
-                      const void *src, 
-                      unsigned long size)
+long copy_to_user(void *to, 
+                  const PageTable *to_table, 
+                  const void *src, 
+                  unsigned long size)
 {
+    UserCursor cursor;
+    user_cursor_init(&cursor, to_table, to, size, true);
 
     unsigned long bytes_copied = 0;
+    void *physical_address;
+    long length;
+    while ((length = user_cursor_next(&cursor, &physical_address)) > 0) {
+        memcpy(physical_address, (const uint8_t *)src + bytes_copied, length);
+        bytes_copied += length;
+    }
+    return length < 0 ? length : 0;
+}
 
-    unsigned long dst_start_addr = (unsigned long)to;
-    unsigned long dst_end_addr = (unsigned long)to+size;
-    unsigned long dst_first_page = ALIGN_DOWN_POT(dst_start_addr, PAGE_SIZE_4K);
-
-    // Copy the data from the source to the destination.
-    // Translate the page aligned source address (for each page in the virtual addresses) using mmu_translate to get the address to copy
-    // from the physical memory. Then, use memcpy to copy the data from the physical memory to the destination.
-    for (unsigned long i = dst_first_page; i < dst_end_addr; i += PAGE_SIZE_4K) {
-        void *physical_address = (void*)mmu_translate(to_table, i);
-
-        // Is this the first page, if so, we need to copy from the offset.
-        unsigned long offset = 0;
-
-        bool is_first_page = i == dst_start_addr;
+/*
+dst: copy destination, at least <size> bytes
+from_table: page table to translate with
+from: NUL-terminated string to copy
+size: largest number of bytes to copy, including the NUL
 
-        // If this is the first page:
-        if (is_first_page) {
-            offset = dst_start_addr % PAGE_SIZE_4K;
+copies the string at <from> into <dst>, stopping at the NUL
+*/
+long strncpy_from_user(char *dst, 
+                       const PageTable *from_table, 
+                       const char *from, 
+                       unsigned long size)
+{
+    // Walk one page at a time so a short string near the end of the
+    // address space never touches the pages after it. Pages that were never
+    // touched are faulted in the same way as for copy_from_user.
+    UserCursor cursor;
+    user_cursor_init(&cursor, from_table, from, size, false);
+
+    uintptr_t vaddr = (uintptr_t)from;
+    unsigned long copied = 0;
+    while (copied < size) {
+        const char *page = (const char *)user_cursor_translate(&cursor, vaddr + copied);
+        if ((uintptr_t)page == MMU_TRANSLATE_PAGE_FAULT) {
+            return -EFAULT;
         }
-
-        // Is this the last page, if so, we need to copy only the remaining bytes.
-        unsigned long bytes_to_copy_from_page = PAGE_SIZE_4K;
-        // If the remaining bytes to copy is less than the page size, then we need to copy only the remaining bytes.
-        if (i + PAGE_SIZE_4K > dst_end_addr) {
-            // The remaining bytes to copy is the difference between the end address and the current address.
-            bytes_to_copy_from_page = dst_end_addr - i;
+        unsigned long in_page = PAGE_SIZE_4K - ((vaddr + copied) % PAGE_SIZE_4K);
+        for (unsigned long i = 0; i < in_page && copied < size; i++) {
+            dst[copied] = page[i];
+            if (page[i] == '\0') {
+                return copied;
+            }
+            copied++;
         }
-
-        // Copy the data from the source to the destination.
-        memcpy(physical_address + offset, src + bytes_copied, bytes_to_copy_from_page);
-
-        // Increment the number of bytes copied.
-        bytes_copied += bytes_to_copy_from_page;
     }
-
-    return bytes_copied;
-}
\ No newline at end of file
+    // No room left for the NUL
+    if (size > 0) {
+        dst[size - 1] = '\0';
+    }
+    return -ENAMETOOLONG;
+}
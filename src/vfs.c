@@ -5,6 +5,11 @@
 #include <path.h>
 #include <map.h>
 #include <list.h>
+#include <config.h>
+#include <pcache.h>
+#include <lock.h>
+#include <sbi.h>
+#include <tlb.h>
 
 #define VFS_DEBUG
 
@@ -14,6 +19,41 @@
 #define debugf(...)
 #endif
 
+// A filesystem operation reads and writes several blocks, and the kernel lock
+// is let go while each one is on its way (see block_device_wait_request), so
+// the whole operation holds this lock too. The hart that holds it may take it
+// again, since the vfs calls into itself and into the page cache.
+static Mutex fs_mutex = MUTEX_UNLOCKED;
+static volatile int fs_owner = -1;
+static int fs_depth = 0;
+
+void fs_lock(void) {
+    int hart = hart_id();
+    if (fs_owner == hart) {
+        fs_depth++;
+        return;
+    }
+    if (!mutex_trylock(&fs_mutex)) {
+        // The holder needs the kernel lock back once its block arrives
+        bool relock = kernel_lock_drop(hart);
+        while (!mutex_trylock(&fs_mutex)) {
+            tlb_handle_ipi(hart);
+        }
+        if (relock) {
+            kernel_lock(hart);
+        }
+    }
+    fs_owner = hart;
+    fs_depth = 1;
+}
+
+void fs_unlock(void) {
+    if (--fs_depth == 0) {
+        fs_owner = -1;
+        mutex_unlock(&fs_mutex);
+    }
+}
+
 void debug_file(File *file) {
     debugf("File {\n");
     debugf("    path: %p\n", file->path);
@@ -40,7 +80,7 @@ void debug_file(File *file) {
     debugf("}\n");
 }
 
-int vfs_read(File *file, void *buf, int count) {
+static int vfs_read_locked(File *file, void *buf, int count) {
     if (file->offset + count > file->size) {
         count = file->size - file->offset;
     }
@@ -48,8 +88,20 @@ int vfs_read(File *file, void *buf, int count) {
     switch (file->type) {
     case VFS_TYPE_FILE:
         debugf("vfs_read: reading from file\n");
-        minix3_get_data(file->dev, file->inode, buf, file->offset, count);
+        // Grow the read-ahead window while the file is read in order, and drop it on a seek
+        if (file->offset != 0 && file->offset == file->readahead_offset) {
+            file->readahead = file->readahead == 0 ? 4 : file->readahead * 2;
+            if (file->readahead > VFS_READAHEAD_MAX_ZONES) {
+                file->readahead = VFS_READAHEAD_MAX_ZONES;
+            }
+        } else {
+            file->readahead = 0;
+        }
+        // Stores through shared mappings of the file have to reach the disk first
+        pcache_writeback(file->dev, file->inode);
+        minix3_get_data_with_readahead(file->dev, file->inode, buf, file->offset, count, file->readahead);
         file->offset += count;
+        file->readahead_offset = file->offset;
         return count;
     case VFS_TYPE_BLOCK:
         debugf("vfs_read: reading from block device\n");
@@ -64,7 +116,14 @@ int vfs_read(File *file, void *buf, int count) {
         return -1;
     }
 }
-int vfs_write(File *file, const char *buf, int count) {
+
+int vfs_read(File *file, void *buf, int count) {
+    fs_lock();
+    int ret = vfs_read_locked(file, buf, count);
+    fs_unlock();
+    return ret;
+}
+static int vfs_write_locked(File *file, const char *buf, int count) {
     if (file->offset + count > file->size) {
         count = file->size - file->offset;
     }
@@ -72,6 +131,7 @@ int vfs_write(File *file, const char *buf, int count) {
     switch (file->type) {
     case VFS_TYPE_FILE:
         minix3_put_data(file->dev, file->inode, buf, file->offset, count);
+        pcache_update(file->dev, file->inode, file->offset, buf, count);
         file->offset += count;
         return count;
     case VFS_TYPE_BLOCK:
@@ -87,6 +147,13 @@ int vfs_write(File *file, const char *buf, int count) {
     }
 }
 
+int vfs_write(File *file, const char *buf, int count) {
+    fs_lock();
+    int ret = vfs_write_locked(file, buf, count);
+    fs_unlock();
+    return ret;
+}
+
 
 // Populate stat from a path.
 // Used by stat(2).
@@ -408,7 +475,7 @@ bool vfs_is_open(const char *path) {
     return map_contains(open_files, path);
 }
 
-File *vfs_open(const char *path, flags_t flags, mode_t mode, type_t type) {
+static File *vfs_open_locked(const char *path, flags_t flags, mode_t mode, type_t type) {
     debugf("vfs_open: opening %s\n", path);
 
     if (is_mounted_device(path)) {
@@ -435,6 +502,7 @@ File *vfs_open(const char *path, flags_t flags, mode_t mode, type_t type) {
             file->is_char_device = false;
             file->major = 0;
             file->minor = 0;
+            minix3_inode_acquire(file->dev, file->inode);
             map_set(open_files, path, file);
             return file; 
         }
@@ -655,6 +723,11 @@ File *vfs_open(const char *path, flags_t flags, mode_t mode, type_t type) {
     kfree(path_relative_to_mount_point);
     kfree(parent_path);
 
+    // Keep the inode in the inode table while the file is open
+    if ((file->is_file || file->is_dir) && file->inode != INVALID_INODE) {
+        minix3_inode_acquire(file->dev, file->inode);
+    }
+
     // Insert the file into the open files map
     map_set(open_files, path, file);
     if (!map_contains(open_files, path)) {
@@ -668,7 +741,14 @@ File *vfs_open(const char *path, flags_t flags, mode_t mode, type_t type) {
     return file;
 }
 
-void vfs_close(File *file) {
+File *vfs_open(const char *path, flags_t flags, mode_t mode, type_t type) {
+    fs_lock();
+    File *ret = vfs_open_locked(path, flags, mode, type);
+    fs_unlock();
+    return ret;
+}
+
+static void vfs_close_locked(File *file) {
     debugf("vfs_close: closing %s\n", file->path);
     if (open_files == NULL) {
         open_files = map_new();
@@ -679,12 +759,25 @@ void vfs_close(File *file) {
     }
     // Remove the file from the open files map
     map_remove(open_files, file->path);
+    if ((file->is_file || file->is_dir) && file->inode != INVALID_INODE) {
+        minix3_inode_release(file->dev, file->inode);
+    }
+    // Flush anything written through this file to the disk
+    if (file->flags & (O_WRONLY | O_RDWR)) {
+        minix3_sync(file->dev);
+    }
     // debug_file(file);
     vfs_print_open_files();
     kfree(file->path);
     kfree(file);
 }
 
+void vfs_close(File *file) {
+    fs_lock();
+    vfs_close_locked(file);
+    fs_unlock();
+}
+
 // This creates the `mapped_paths` and `mapped_inodes` maps
 // for caching the paths of files and their inodes
 // void minix3_map_files(VirtioDevice *block_device, const char *mounted_path) {
@@ -723,7 +816,7 @@ void vfs_close(File *file) {
 //     map_set_int(mapped_inodes, inode, (uintptr_t)path);
 // }
 
-int vfs_stat(File *file, Stat *stat) {
+static int vfs_stat_locked(File *file, Stat *stat) {
     VirtioDevice *block_device = file->dev;
     Inode data = minix3_get_inode(block_device, file->inode);
     stat->inode = file->inode;
@@ -738,7 +831,14 @@ int vfs_stat(File *file, Stat *stat) {
     return 0;
 }
 
-bool vfs_link(File *dir, File *file) {
+int vfs_stat(File *file, Stat *stat) {
+    fs_lock();
+    int ret = vfs_stat_locked(file, stat);
+    fs_unlock();
+    return ret;
+}
+
+static bool vfs_link_locked(File *dir, File *file) {
     // uint32_t inode1 = minix3_get_inode_from_path(file1->path1, 0);
     // uint32_t inode2 = minix3_get_inode_from_path(path2, 1);
     VirtioDevice *block_device = dir->dev;
@@ -779,12 +879,19 @@ bool vfs_link(File *dir, File *file) {
     return true;
 }
 
+bool vfs_link(File *dir, File *file) {
+    fs_lock();
+    bool ret = vfs_link_locked(dir, file);
+    fs_unlock();
+    return ret;
+}
+
 // bool vfs_link(File *file1, File *file2) {
 //     return vfs_link_paths(file1->path, file2->path);
 // }
 
 
-bool vfs_exists(const char *path) {
+static bool vfs_exists_locked(const char *path) {
     // file->dev = vfs_get_mounted_device(path);
     // path_relative_to_mount_point = get_path_relative_to_mount_point(path);
     // file->inode = minix3_get_inode_from_path(file->dev, path_relative_to_mount_point, false);
@@ -803,7 +910,14 @@ bool vfs_exists(const char *path) {
     return true;
 }
 
-bool vfs_is_dir(const char *path) {
+bool vfs_exists(const char *path) {
+    fs_lock();
+    bool ret = vfs_exists_locked(path);
+    fs_unlock();
+    return ret;
+}
+
+static bool vfs_is_dir_locked(const char *path) {
     debugf("vfs_is_dir: %s\n", path);
     VirtioDevice *block_device = vfs_get_mounted_device(path);
     debugf("vfs_is_dir: block device is %p\n", block_device);
@@ -823,7 +937,14 @@ bool vfs_is_dir(const char *path) {
     return minix3_is_dir(block_device, inode);
 }
 
-bool vfs_is_file(const char *path) {
+bool vfs_is_dir(const char *path) {
+    fs_lock();
+    bool ret = vfs_is_dir_locked(path);
+    fs_unlock();
+    return ret;
+}
+
+static bool vfs_is_file_locked(const char *path) {
     VirtioDevice *block_device = vfs_get_mounted_device(path);
     if (block_device == NULL) {
         debugf("vfs_exists: could not find block device\n");
@@ -838,8 +959,15 @@ bool vfs_is_file(const char *path) {
     return minix3_is_file(block_device, inode);
 }
 
+bool vfs_is_file(const char *path) {
+    fs_lock();
+    bool ret = vfs_is_file_locked(path);
+    fs_unlock();
+    return ret;
+}
+
 // List a directory separated by newlines to a buffer
-void vfs_list_dir(const char *path, char *buf, size_t buf_size, bool return_full_path) {
+static void vfs_list_dir_locked(const char *path, char *buf, size_t buf_size, bool return_full_path) {
     strcpy(buf, "");
     VirtioDevice *block_device = vfs_get_mounted_device(path);
     if (block_device == NULL) {
@@ -917,4 +1045,10 @@ void vfs_list_dir(const char *path, char *buf, size_t buf_size, bool return_full
         strcat(buf, "\n");
     }
     infof("Listed directory\n");
-}
\ No newline at end of file
+}
+
+void vfs_list_dir(const char *path, char *buf, size_t buf_size, bool return_full_path) {
+    fs_lock();
+    vfs_list_dir_locked(path, buf, buf_size, return_full_path);
+    fs_unlock();
+}
@@ -127,8 +127,23 @@ void job_destroy(Job *job) {
     }
 }
 
-void virtio_callback_and_free_job(VirtioDevice *dev, uint64_t job_id) {
+// Find a job and take it off the device, so only one hart completes it
+static Job *virtio_take_job(VirtioDevice *dev, uint64_t job_id) {
+    uint64_t sstatus;
+    CSR_READ(sstatus, "sstatus");
+    IRQ_OFF();
+    virtio_acquire_device(dev);
     Job *job = virtio_get_job(dev, job_id);
+    if (job != NULL) {
+        vector_remove_val_ptr(dev->jobs, job);
+    }
+    virtio_release_device(dev);
+    if (sstatus & SSTATUS_SIE) IRQ_ON();
+    return job;
+}
+
+void virtio_callback_and_free_job(VirtioDevice *dev, uint64_t job_id) {
+    Job *job = virtio_take_job(dev, job_id);
     if (job == NULL) {
         debugf("No job\n");
         return;
@@ -163,25 +178,28 @@ void virtio_add_job(VirtioDevice *dev, Job job) {
     debugf("Adding job %d to device %p\n", job.job_id, dev);
     if (dev == NULL) {
         warnf("No device\n");
-        virtio_release_device(dev);
         return;
     }
     if (job.callback == NULL) {
         warnf("No callback\n");
-        virtio_release_device(dev);
         return;
     }
     debugf("Adding job %d to device %p\n", job.job_id, dev);
     Job *mem = (Job *)kzalloc(sizeof(Job));
     if (mem == NULL) {
         warnf("Could not allocate memory for job\n");
-        virtio_release_device(dev);
         return;
     }
     debugf("Allocated job %p\n", mem);
     memcpy(mem, &job, sizeof(Job));
     debugf("Copied job from %p to %p\n", &job, mem);
+    uint64_t sstatus;
+    CSR_READ(sstatus, "sstatus");
+    IRQ_OFF();
+    virtio_acquire_device(dev);
     vector_push_ptr(dev->jobs, mem);
+    virtio_release_device(dev);
+    if (sstatus & SSTATUS_SIE) IRQ_ON();
 }
 
 // Job *virtio_get_job(VirtioDevice *dev, uint64_t job_id) {
@@ -222,19 +240,24 @@ void virtio_handle_interrupt(VirtioDevice *dev, VirtioDescriptor desc[], uint16_
         warnf("No job found matching interrupt\n");
         return;
     }
-    Job *job = virtio_get_job(dev, job_id);
+    Job *job = virtio_take_job(dev, job_id);
     if (job == NULL) {
         warnf("No job found with ID %d\n", job_id);
         return;
     }
     job_set_context(job, desc, num_descriptors);
-
-    virtio_complete_job(dev, job_id);
+    job->done = true;
+    if (job->callback != NULL) {
+        job->callback(dev, job);
+    }
+    job_destroy(job);
+    debugf("Job %d done\n", job_id);
 }
 
 uint64_t virtio_which_job_from_interrupt(VirtioDevice *dev) {
-    // Get the ID of the job from the descriptor
-    return (uint64_t)dev->device_idx - 1;
+    // Jobs are keyed by the head descriptor of their chain, which is
+    // the id the device reported in the used ring.
+    return (uint64_t)dev->used_id;
 }
 
 uint64_t virtio_get_job_id_by_index(VirtioDevice *dev, uint64_t index) {
@@ -248,7 +271,7 @@ uint64_t virtio_get_job_id_by_index(VirtioDevice *dev, uint64_t index) {
 }
 
 uint64_t virtio_get_next_job_id(VirtioDevice *dev) {
-    return (uint64_t)dev->device_idx;
+    return (uint64_t)dev->free_head;
 }
 
 void virtio_complete_job(VirtioDevice *dev, uint64_t job_id) {
@@ -262,14 +285,9 @@ void virtio_complete_job(VirtioDevice *dev, uint64_t job_id) {
         warnf("Job %d already done\n", job_id);
         return;
     }
+    // This removes the job from the device and frees it
     virtio_callback_and_free_job(dev, job_id);
-    if (job->done && virtio_has_jobs_left(dev)) {
-        debugf("Job %d done\n", job_id);
-        vector_remove_val_ptr(dev->jobs, job);
-        debugf("Removed job %d\n", job_id);
-    } else {
-        debugf("Job %d not done\n", job_id);
-    }
+    debugf("Job %d done\n", job_id);
 }
 
 volatile struct VirtioBlockConfig *virtio_get_block_config(VirtioDevice *device) {
@@ -439,12 +457,8 @@ void virtio_init(void) {
             debugf("Status: %x\n", viodev.common_cfg->device_status);
             viodev.common_cfg->device_status |= VIRTIO_F_DRIVER;
             debugf("Status: %x\n", viodev.common_cfg->device_status);
-            if (viodev.common_cfg->device_feature & VIRTIO_F_IN_ORDER) {
-                debugf("Device supports in-order\n");
-                viodev.common_cfg->driver_feature |= VIRTIO_F_IN_ORDER;
-            } else {
-                debugf("Device does not support in-order\n");
-            }
+            // We match completions by their used ring id, so we do not need
+            // the device to complete requests in order.
             viodev.common_cfg->device_status |= VIRTIO_F_FEATURES_OK;
             if (!(viodev.common_cfg->device_status & VIRTIO_F_FEATURES_OK)) {
                 warnf("Device does not accept features\n");
@@ -465,9 +479,15 @@ void virtio_init(void) {
             debugf("Device ring size: %d\n", VIRTIO_DEVICE_TABLE_BYTES(qsize));
 
             // Initialize the indices
-            viodev.desc_idx = 0;
             viodev.driver_idx = 0;
             viodev.device_idx = 0;
+            viodev.used_id = 0;
+            // Every descriptor starts out on the free list
+            for (uint16_t d=0; d<qsize; d++) {
+                viodev.desc[d].next = d + 1;
+            }
+            viodev.free_head = 0;
+            viodev.num_free = qsize;
 
             // Add the physical addresses for the descriptor table, driver ring, and device ring to the common configuration
             // We translate the virtual addresses so the devices can actuall access the memory.
@@ -604,39 +624,36 @@ void virtio_send_one_descriptor(VirtioDevice *device, uint16_t which_queue, Virt
 }
 
 
-void virtio_send_descriptor_chain(VirtioDevice *device, uint16_t which_queue, VirtioDescriptor *descriptors, uint16_t num_descriptors, bool notify_device_when_done) {
-    // Confirm the device is ready
-    if (!device->ready) {
-        fatalf("device is not ready\n");
-        return;
-    }
-
-    virtio_acquire_device(device);
+bool virtio_has_free_descriptors(VirtioDevice *device, uint16_t count) {
+    return device->num_free >= count;
+}
 
+// Pop a chain off the free list and publish it in the driver ring, setting
+// `head` to the descriptor it starts at. Must be called with the device
+// acquired and interrupts off.
+static bool virtio_push_chain(VirtioDevice *device, uint16_t which_queue, VirtioDescriptor *descriptors, uint16_t num_descriptors, uint16_t *head) {
     // Select the queue we're using
     if (which_queue >= device->common_cfg->num_queues) {
         fatalf("queue number %d is too big (num_queues=%d)\n", which_queue, device->common_cfg->num_queues);
-        return;
+        return false;
     }
 
     // The size of the queue we're using
     uint64_t queue_size = virtio_set_queue_and_get_size(device, which_queue);
-    /*
-    uint64_t    addr;
-    uint32_t    len;
-#define VIRTQ_DESC_F_NEXT 1
-#define VIRTQ_DESC_F_WRITE 2
-#define VIRTQ_DESC_F_INDIRECT 4
-    uint16_t    flags;
-    uint16_t    next;*/
+    if (num_descriptors == 0 || !virtio_has_free_descriptors(device, num_descriptors)) {
+        warnf("virtio_send_descriptor_chain: %d free descriptors on %s, need %d\n", device->num_free, device->name, num_descriptors);
+        return false;
+    }
+
     device->driver_idx = device->driver->idx;
-    uint64_t head_descriptor_index = device->desc_idx;
+    // Pop the chain off of the free list
+    uint16_t head_descriptor_index = device->free_head;
+    uint16_t descriptor_index = head_descriptor_index;
     for (int i=0; i<num_descriptors; i++) {
-        uint64_t descriptor_index = (device->desc_idx + i) % queue_size;
-        // debugf("Writing descriptor %d to queue %d\n", descriptor_index, which_queue);
+        uint16_t next_free = device->desc[descriptor_index].next;
         VirtioDescriptor descriptor = descriptors[i];
         if (i < num_descriptors - 1) {
-            descriptor.next = (descriptor_index + 1) % queue_size;
+            descriptor.next = next_free;
             descriptor.flags |= VIRTQ_DESC_F_NEXT;
         } else {
             descriptor.next = 0;
@@ -648,23 +665,83 @@ void virtio_send_descriptor_chain(VirtioDevice *device, uint16_t which_queue, Vi
         debugf("Descriptor next: 0x%x = %d\n", descriptor.next, descriptor.next);
         // Put the descriptor in the descriptor table
         device->desc[descriptor_index] = descriptor;
+        descriptor_index = next_free;
     }
+    device->free_head = descriptor_index;
+    device->num_free -= num_descriptors;
+
     // Put the descriptor into the driver ring
     device->driver->ring[device->driver->idx % queue_size] = head_descriptor_index;
+    // The ring entry must be visible before the index that publishes it
+    __sync_synchronize();
     // Increment the index to make it "visible" to the device
     device->driver->idx++;
-    // Update the descriptor index for our bookkeeping
-    device->desc_idx = (device->desc_idx + num_descriptors) % queue_size;
 
     debugf("Driver index: %d\n", device->driver->idx);
-    debugf("Descriptor index: %d\n", device->desc_idx);
-    
+    debugf("Free descriptors: %d\n", device->num_free);
+    *head = head_descriptor_index;
+    return true;
+}
+
+bool virtio_send_descriptor_chain(VirtioDevice *device, uint16_t which_queue, VirtioDescriptor *descriptors, uint16_t num_descriptors, bool notify_device_when_done) {
+    // Confirm the device is ready
+    if (!device->ready) {
+        fatalf("device is not ready\n");
+        return false;
+    }
+
+    // The interrupt handler reaps completions onto the free list, so keep it
+    // out while we are popping descriptors off of it.
+    uint64_t sstatus;
+    CSR_READ(sstatus, "sstatus");
+    IRQ_OFF();
+    virtio_acquire_device(device);
+    uint16_t head;
+    bool sent = virtio_push_chain(device, which_queue, descriptors, num_descriptors, &head);
     virtio_release_device(device);
+    if (sstatus & SSTATUS_SIE) IRQ_ON();
 
     // Notify the device if we're ready to do so
-    if (notify_device_when_done) {
+    if (sent && notify_device_when_done) {
         virtio_notify(device, which_queue);
     }
+    return sent;
+}
+
+bool virtio_send_job(VirtioDevice *device, uint16_t which_queue, VirtioDescriptor *descriptors, uint16_t num_descriptors, uint64_t pid_id, void (*callback)(struct VirtioDevice *device, struct Job *job), void *data) {
+    if (!device->ready) {
+        fatalf("device is not ready\n");
+        return false;
+    }
+    Job *job = (Job *)kzalloc(sizeof(Job));
+    if (job == NULL) {
+        warnf("Could not allocate memory for job\n");
+        return false;
+    }
+    *job = job_create_with_data(0, pid_id, callback, data);
+
+    // The job is keyed by the head its chain takes, so both happen under the
+    // device lock, before any hart can reap the completion.
+    uint64_t sstatus;
+    CSR_READ(sstatus, "sstatus");
+    IRQ_OFF();
+    virtio_acquire_device(device);
+    uint16_t head;
+    bool sent = virtio_push_chain(device, which_queue, descriptors, num_descriptors, &head);
+    if (sent) {
+        job->job_id = head;
+        vector_push_ptr(device->jobs, job);
+    }
+    virtio_release_device(device);
+    if (sstatus & SSTATUS_SIE) IRQ_ON();
+
+    if (!sent) {
+        // Not job_destroy, the data still belongs to the caller
+        kfree(job);
+        return false;
+    }
+    virtio_notify(device, which_queue);
+    return true;
 }
 
 
@@ -680,35 +757,41 @@ uint16_t virtio_receive_descriptor_chain(VirtioDevice *device, uint16_t which_qu
     }
     
 
-    // Get the descriptor index from the device ring
-    uint64_t descriptor_index = device->device->ring[device->device_idx % queue_size].id;
-    // Get the length of the descriptor
-    volatile VirtioDescriptor *descriptor = (volatile VirtioDescriptor*)&device->desc[descriptor_index];
+    virtio_acquire_device(device);
+    // Get the head of the chain from the device ring
+    uint16_t head_descriptor_index = device->device->ring[device->device_idx % queue_size].id;
+    device->used_id = head_descriptor_index;
+    uint16_t descriptor_index = head_descriptor_index;
+    volatile VirtioDescriptor *descriptor = &device->desc[descriptor_index];
 
+    // Copy out the chain and give its descriptors back to the free list
     uint16_t i = 0;
-    while (descriptor->flags & VIRTQ_DESC_F_NEXT) {
-        received[i++] = *descriptor;
+    while (true) {
+        if (i < max_descriptors) {
+            received[i] = *descriptor;
+        }
+        i++;
         debugf("Reading descriptor %d from queue %d\n", descriptor_index, which_queue);
         debugf("Descriptor addr: %p\n", descriptor->addr);
         debugf("Descriptor len: 0x%x = %d\n", descriptor->len, descriptor->len);
         debugf("Descriptor flags: 0x%x = %d\n", descriptor->flags, descriptor->flags);
         debugf("Descriptor next: 0x%x = %d\n", descriptor->next, descriptor->next);
+        if (!(descriptor->flags & VIRTQ_DESC_F_NEXT)) {
+            break;
+        }
         descriptor_index = descriptor->next;
-        descriptor = (volatile VirtioDescriptor*)&device->desc[descriptor_index];
+        descriptor = &device->desc[descriptor_index];
     }
+    descriptor->next = device->free_head;
+    device->free_head = head_descriptor_index;
+    device->num_free += i;
 
-    received[i] = *descriptor;
-    debugf("Reading descriptor %d from queue %d\n", i, which_queue);
-    debugf("Descriptor addr: %p\n", descriptor->addr);
-    debugf("Descriptor len: 0x%x = %d\n", descriptor->len, descriptor->len);
-    debugf("Descriptor flags: 0x%x = %d\n", descriptor->flags, descriptor->flags);
-    debugf("Descriptor next: 0x%x = %d\n", descriptor->next, descriptor->next);
-    i++;
-    // device->device_idx = device->device->idx;
     if (i > max_descriptors) {
         warnf("Received %d descriptors, but expected %d or fewer\n", i, max_descriptors);
+        i = max_descriptors;
     }
     device->device_idx++;
+    virtio_release_device(device);
     return i;
 }
 
@@ -2,6 +2,7 @@
 #include "malloc.h"
 #include "stdio.h"
 #include "string.h"
+#include "unistd.h"
 
 #define NULL ((void*)0)
 
@@ -21,16 +22,26 @@ void init_malloc(void *start, uint32_t size) {
 
 void *salloc(uint32_t bytes) {
 	// printf("salloc: %d\n", bytes);
+	if (heap_start == NULL) {
+		// Nobody gave us a buffer, so start at the process's break
+		uint8_t *brk = sbrk(0);
+		salloc_init(brk, brk);
+	}
 	uint64_t words = (bytes + 128) / 8;
     uint64_t *ret = (uint64_t*)heap_start;
-    while (*ret != 0) {
+    while ((uintptr_t)ret < (uintptr_t)heap_end && *ret != 0) {
 		// printf("salloc: %p taken with reserved words=%ld, bytes=%ld\n", ret, *ret, *ret * 8);
         ret += *ret;
-        if ((uintptr_t)ret >= (uintptr_t)heap_end) {
+    }
+    if ((uintptr_t)(ret + words) > (uintptr_t)heap_end) {
+        // Grow the heap, the kernel maps the new pages when they are first touched
+        int more = (uint8_t*)(ret + words) - heap_end;
+        if (sbrk(more) == (void*)-1) {
             // printf("salloc: out of memory\n");
             // printf("salloc: tried to allocate %d bytes\n", bytes);
             return NULL;
         }
+        heap_end += more;
     }
     *ret = words;
     ret++;
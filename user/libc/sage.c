@@ -60,6 +60,12 @@ int screen_draw_rect(Pixel *buf, Rectangle *rect, uint64_t x_scale, uint64_t y_s
     __asm__ volatile("mv a7, %1\nmv a0, %2\nmv a1, %3\nmv a2, %4\nmv a3, %5\necall\nmv %0, a0" : "=r"(ret) : "r"(12), "r"(buf), "r"(rect), "r"(x_scale), "r"(y_scale) : "a0", "a1", "a2", "a3", "a7");
     return ret;
 }
+int screen_draw_rect_flags(Pixel *buf, Rectangle *rect, uint64_t x_scale, uint64_t y_scale, uint64_t flags) {
+    int ret;
+    // Pass the buf in a0, rect in a1, x_scale in a2, y_scale in a3, flags in a4
+    __asm__ volatile("mv a7, %1\nmv a0, %2\nmv a1, %3\nmv a2, %4\nmv a3, %5\nmv a4, %6\necall\nmv %0, a0" : "=r"(ret) : "r"(31), "r"(buf), "r"(rect), "r"(x_scale), "r"(y_scale), "r"(flags) : "a0", "a1", "a2", "a3", "a4", "a7");
+    return ret;
+}
 int screen_get_dims(Rectangle *rect) {
     int ret;
     // Pass the rect in a0
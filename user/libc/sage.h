@@ -32,6 +32,9 @@ int next_pid(int);
 int pid_get_env(int pid, char *name, char *value);
 int pid_put_env(int pid, char *name, char *value);
 int screen_draw_rect(Pixel *buf, Rectangle *rect, uint64_t x_scale, uint64_t y_scale);
+// Leave the screen alone wherever a pixel of `buf` has an alpha of 0
+#define SCREEN_DRAW_ALPHA_SKIP 1
+int screen_draw_rect_flags(Pixel *buf, Rectangle *rect, uint64_t x_scale, uint64_t y_scale, uint64_t flags);
 int screen_get_dims(Rectangle *rect);
 // void screen_flush(void);
 void screen_flush(Rectangle *rect);
@@ -22,10 +22,17 @@ enum syscall_nos {
     SYS_CHDIR,
     SYS_GETCWD,
     SYS_MKNOD,
-    SYS_FORK,
-    SYS_EXEC,
+    SYS_OLD_FORK,
+    SYS_OLD_EXEC,
     SYS_WAIT,
     SYS_KILL,
+    // Numbered as in the kernel's table in src/syscall.c
+    SYS_BRK = 25,
+    SYS_FORK,
+    SYS_EXEC,
+    SYS_MMAP,
+    SYS_MUNMAP,
+    SYS_NICE,
 };
 
 void exit(void)
@@ -38,17 +45,56 @@ void yield(void)
     __asm__ volatile("mv a7, %0\necall" : : "r"(SYS_YIELD) : "a7");
 }
 
-void sleep(int secs)
+void sleep(int ms)
 {
-    __asm__ volatile("mv a7, %0\nmv a0, %1\necall" : : "r"(SYS_SLEEP), "r"(secs) : "a0", "a7");
+    __asm__ volatile("mv a7, %0\nmv a0, %1\necall" : : "r"(SYS_SLEEP), "r"(ms) : "a0", "a7");
 }
 
-void *sbrk(int amt)
+void *brk(void *addr)
 {
     void *ret;
     __asm__ volatile("mv a7, %1\nmv a0, %2\necall\nmv %0, a0\n"
                      : "=r"(ret)
-                     : "r"(SYS_SBRK), "r"(amt)
+                     : "r"(SYS_BRK), "r"(addr)
+                     : "a0", "a7");
+    return ret;
+}
+
+void *sbrk(int amt)
+{
+    char *old = brk((void *)0);
+    if (amt != 0 && brk(old + amt) != old + amt) {
+        return (void *)-1;
+    }
+    return old;
+}
+
+void *mmap(const char *path, size_t length, int prot, int flags, off_t offset)
+{
+    void *ret;
+    __asm__ volatile("mv a7, %1\nmv a0, %2\nmv a1, %3\nmv a2, %4\nmv a3, %5\nmv a4, %6\necall\nmv %0, a0"
+                     : "=r"(ret)
+                     : "r"(SYS_MMAP), "r"(path), "r"(length), "r"(prot), "r"(flags), "r"(offset)
+                     : "a0", "a1", "a2", "a3", "a4", "a7");
+    return ret;
+}
+
+int munmap(void *addr, size_t length)
+{
+    int ret;
+    __asm__ volatile("mv a7, %1\nmv a0, %2\nmv a1, %3\necall\nmv %0, a0"
+                     : "=r"(ret)
+                     : "r"(SYS_MUNMAP), "r"(addr), "r"(length)
+                     : "a0", "a1", "a7");
+    return ret;
+}
+
+int nice(int inc)
+{
+    int ret;
+    __asm__ volatile("mv a7, %1\nmv a0, %2\necall\nmv %0, a0"
+                     : "=r"(ret)
+                     : "r"(SYS_NICE), "r"(inc)
                      : "a0", "a7");
     return ret;
 }
@@ -10,9 +10,24 @@ struct stat;
 
 void    exit   (void);
 void    yield  (void);
-void    sleep  (int secs);
+// Sleep for `ms` milliseconds
+void    sleep  (int ms);
 int     fstat  (const char *path, struct stat *stat);
+// Set the end of the heap and return the new end, or the old one if it
+// could not be moved. brk(0) returns the current end.
+void   *brk    (void *addr);
+// Move the end of the heap by `amount` bytes and return the old end,
+// or (void *)-1 if the heap could not grow.
 void   *sbrk   (int amount);
+// Map `length` bytes of the file at `path`, starting at `offset` (a multiple
+// of 4096), and return where, or a negative error number cast to a pointer.
+// Pages are read from the disk when first touched.
+void   *mmap   (const char *path, size_t length, int prot, int flags, off_t offset);
+// Remove the mappings in [addr, addr + length). Each one must lie wholly inside.
+int     munmap (void *addr, size_t length);
+// Add `inc` to the nice level (-20 to 19, higher gets less of the CPU) and
+// return the new level.
+int     nice   (int inc);
 int     open   (const char *pathname, int flags, mode_t mode);
 int     close  (int fd);
 ssize_t read   (int fd, void *buf, size_t count);
@@ -36,3 +51,9 @@ int     kill   (int pid);
 #define O_CREAT  0100
 #define O_TRUNC  01000
 
+#define PROT_READ   1
+#define PROT_WRITE  2
+
+#define MAP_SHARED  1
+#define MAP_PRIVATE 2
+